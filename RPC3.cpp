@@ -17,23 +17,111 @@
 #include "RakPeerInterface.h"
 #include "MessageIdentifiers.h"
 #include "NetworkIDManager.h"
+#include "InternalPacket.h"
+#include "RPC3_LZ.h"
+#include "RPC3_Capture.h"
+#include "RPC3_Shards.h"
+#include "RPC3_Trace.h"
+#include "GetTime.h"
+#include "RakSleep.h"
 #include <stdlib.h>
+#include <algorithm>
 
 using namespace RakNet;
 
-int RakNet::RPC3::LocalSlotObjectComp( const LocalSlotObject &key, const LocalSlotObject &data )
+// invokerIndices entry of a slot InvokeSignal() found without its object
+static const unsigned short REMOVED_SLOT_INVOKER=0xFFFF;
+// How long Update() sees no signalled message arrive before it stops waiting for them, see RPC3::wakeupStalled
+static const RakNet::TimeMS WAKEUP_STALL_TIME=10;
+// Layout of the ids given by RPC3::RegisterObject(): a tag in the top 16 bits, then a 24 bit generation and a 24 bit index.
+// Ids from NetworkIDManager::GetNewNetworkID() can carry the tag by chance, so lookups that miss the table still ask the NetworkIDManager.
+static const NetworkID OBJECT_HANDLE_TAG=(NetworkID) 0x5233 << 48;
+static const NetworkID OBJECT_HANDLE_TAG_MASK=(NetworkID) 0xFFFF << 48;
+static const unsigned int OBJECT_HANDLE_INDEX_BITS=24;
+static const uint32_t OBJECT_HANDLE_INDEX_MASK=(1 << OBJECT_HANDLE_INDEX_BITS)-1;
+static const uint32_t OBJECT_HANDLE_GENERATION_MASK=(1 << 24)-1;
+
+RPC3::LocalSlot::~LocalSlot()
 {
-	if (key.callPriority>data.callPriority)
-		return -1;
-	if (key.callPriority==data.callPriority)
+	unsigned int i;
+	for (i=0; i < invokers.Size(); i++)
+		RakNet::OP_DELETE(invokers[i],_FILE_AND_LINE_);
+}
+unsigned int RPC3::LocalSlot::GetInvokerIndex(const _RPC3::FunctionKey &functionKey) const
+{
+	// Identifiers have few distinct functions, usually one
+	unsigned int i;
+	for (i=0; i < invokers.Size(); i++)
 	{
-		if (key.registrationCount<data.registrationCount)
-			return -1;
-		if (key.registrationCount==data.registrationCount)
-			return 0;
-		return 1;
+		if (invokers[i]->functionKey==functionKey)
+			break;
 	}
-
+	return i;
+}
+void RPC3::LocalSlot::AddSlots(unsigned short invokerIndex, const NetworkID *objectInstanceIds, unsigned int count, int callPriority)
+{
+	if (count==0)
+		return;
+	// First slot with a lower priority, the new slots run after every slot registered earlier with the same one
+	unsigned int lower=0, upper=callPriorities.Size();
+	while (lower < upper)
+	{
+		unsigned int middle = (lower+upper)/2;
+		if (callPriorities[middle] >= callPriority)
+			lower=middle+1;
+		else
+			upper=middle;
+	}
+	unsigned int oldSize = objects.Size();
+	objects.Preallocate(oldSize+count,_FILE_AND_LINE_);
+	callPriorities.Preallocate(oldSize+count,_FILE_AND_LINE_);
+	invokerIndices.Preallocate(oldSize+count,_FILE_AND_LINE_);
+	unsigned int i;
+	for (i=0; i < count; i++)
+	{
+		objects.Push(UNASSIGNED_NETWORK_ID,_FILE_AND_LINE_);
+		callPriorities.Push(0,_FILE_AND_LINE_);
+		invokerIndices.Push(0,_FILE_AND_LINE_);
+	}
+	// Shift the slots with a lower priority once, then fill the gap
+	for (i=oldSize; i > lower; i--)
+	{
+		objects[i-1+count]=objects[i-1];
+		callPriorities[i-1+count]=callPriorities[i-1];
+		invokerIndices[i-1+count]=invokerIndices[i-1];
+	}
+	for (i=0; i < count; i++)
+	{
+		objects[lower+i]=objectInstanceIds[i];
+		callPriorities[lower+i]=callPriority;
+		invokerIndices[lower+i]=invokerIndex;
+	}
+}
+void RPC3::LocalSlot::RemoveMarkedSlots(void)
+{
+	unsigned int i, kept=0;
+	for (i=0; i < invokerIndices.Size(); i++)
+	{
+		if (invokerIndices[i]==REMOVED_SLOT_INVOKER)
+			continue;
+		objects[kept]=objects[i];
+		callPriorities[kept]=callPriorities[i];
+		invokerIndices[kept]=invokerIndices[i];
+		kept++;
+	}
+	while (invokerIndices.Size() > kept)
+	{
+		objects.RemoveFromEnd();
+		callPriorities.RemoveFromEnd();
+		invokerIndices.RemoveFromEnd();
+	}
+}
+int RakNet::RPC3::PendingReplyComp( const uint32_t &key, PendingReply * const &data )
+{
+	if (key < data->replyId)
+		return -1;
+	if (key==data->replyId)
+		return 0;
 	return 1;
 }
 
@@ -42,17 +130,62 @@ RPC3::RPC3()
 	currentExecution[0]=0;
 	networkIdManager=0;
 	outgoingTimestamp=0;
+	outgoingMaxAge=0;
 	outgoingPriority=HIGH_PRIORITY;
 	outgoingReliability=RELIABLE_ORDERED;
 	outgoingOrderingChannel=0;
+	objectOrderingChannel=0;
+	objectOrderingChannelCount=0;
 	outgoingBroadcast=true;
 	incomingTimeStamp=0;
-	nextSlotRegistrationCount=0;
+	incomingReceiveTime=0;
+	nextDeferredGroup=0;
+	registryFrozen=false;
+	sharedRegistry=0;
+	shardGroup=0;
+	shardIndex=0;
+	compactHeaderEnabled=true;
+	compressionThreshold=0;
+	captureLog=0;
+	captureStartTime=0;
+	tracer=0;
+	traceSampleInterval=0;
+	traceSampleCounter=0;
+	lastTraceId=0;
+	slowHandlerThreshold=0;
+	incomingDecodedTime=0;
+	outgoingNetworkIDs=0;
+	outgoingNetworkIDCount=0;
+	internedStringLimit=RPC3_MAX_INTERNED_STRINGS;
+	outgoingCall=0;
+	incomingCompactDeref=false;
+	memset(parameterBitsEstimates, 0, sizeof(parameterBitsEstimates));
+	nextReplyId=1;
+	outgoingReplyId=0;
+	incomingReplyId=0;
+	replyTimeout=0;
+	wakeup=0;
+	signalledMessages=0;
+	receivedMessages=0;
+	wakeRequested=false;
+	wakeupStalled=false;
+	wakeupStallCount=0;
+	wakeupStallTime=0;
+	errorReportInterval=0;
+	maxErrorReports=RPC3_DEFAULT_MAX_ERROR_REPORTS;
+	lastErrorReportTime=0;
+	streamWindow=RPC3_DEFAULT_STREAM_WINDOW;
+	streamChunkBytes=RPC3_DEFAULT_STREAM_CHUNK_BYTES;
+	nextStreamId=0;
 }
 
 RPC3::~RPC3()
 {
 	Clear();
+	StopCapture();
+	DisableTracing();
+	if (wakeup)
+		RakNet::OP_DELETE(wakeup,_FILE_AND_LINE_);
 }
 
 void RPC3::SetNetworkIDManager(NetworkIDManager *idMan)
@@ -60,6 +193,89 @@ void RPC3::SetNetworkIDManager(NetworkIDManager *idMan)
 	networkIdManager=idMan;
 }
 
+NetworkID RPC3::RegisterObject(NetworkIDObject *object)
+{
+	uint32_t index;
+	if (freeObjectHandles.Size() > 0)
+		index=freeObjectHandles.Pop();
+	else
+	{
+		ObjectHandle objectHandle;
+		objectHandle.object=0;
+		objectHandle.networkId=UNASSIGNED_NETWORK_ID;
+		objectHandle.generation=0;
+		index=objectHandles.Size();
+		RakAssert(index <= OBJECT_HANDLE_INDEX_MASK);
+		objectHandles.Insert(objectHandle, _FILE_AND_LINE_);
+	}
+	ObjectHandle &objectHandle = objectHandles[index];
+	objectHandle.generation=(objectHandle.generation+1) & OBJECT_HANDLE_GENERATION_MASK;
+	objectHandle.networkId=OBJECT_HANDLE_TAG | ((NetworkID) objectHandle.generation << OBJECT_HANDLE_INDEX_BITS) | index;
+	objectHandle.object=object;
+	object->SetNetworkID(objectHandle.networkId);
+	return objectHandle.networkId;
+}
+
+bool RPC3::RegisterObject(NetworkIDObject *object, NetworkID networkId)
+{
+	object->SetNetworkID(networkId);
+	if (IsObjectHandle(networkId)==false)
+		return false;
+	uint32_t index = (uint32_t) (networkId & OBJECT_HANDLE_INDEX_MASK);
+	while (objectHandles.Size() <= index)
+	{
+		ObjectHandle objectHandle;
+		objectHandle.object=0;
+		objectHandle.networkId=UNASSIGNED_NETWORK_ID;
+		objectHandle.generation=0;
+		objectHandles.Insert(objectHandle, _FILE_AND_LINE_);
+	}
+	ObjectHandle &objectHandle = objectHandles[index];
+	if (objectHandle.object!=0 && objectHandle.object!=object)
+		return false;
+	// An entry freed by UnregisterObject() is taken out of the free list, or RegisterObject() would hand it out again
+	if (objectHandle.object==0)
+	{
+		unsigned int freeIndex = freeObjectHandles.GetIndexOf(index);
+		if (freeIndex!=MAX_UNSIGNED_LONG)
+			freeObjectHandles.RemoveAtIndex(freeIndex);
+	}
+	objectHandle.object=object;
+	objectHandle.networkId=networkId;
+	objectHandle.generation=(uint32_t) (networkId >> OBJECT_HANDLE_INDEX_BITS) & OBJECT_HANDLE_GENERATION_MASK;
+	return true;
+}
+
+void RPC3::UnregisterObject(NetworkIDObject *object)
+{
+	NetworkID networkId = object->GetNetworkID();
+	if (IsObjectHandle(networkId)==false)
+		return;
+	uint32_t index = (uint32_t) (networkId & OBJECT_HANDLE_INDEX_MASK);
+	if (index >= objectHandles.Size() || objectHandles[index].object!=object)
+		return;
+	objectHandles[index].object=0;
+	objectHandles[index].networkId=UNASSIGNED_NETWORK_ID;
+	freeObjectHandles.Push(index, _FILE_AND_LINE_);
+}
+
+NetworkIDObject *RPC3::GetObjectFromID(NetworkID networkId)
+{
+	if ((networkId & OBJECT_HANDLE_TAG_MASK)==OBJECT_HANDLE_TAG)
+	{
+		uint32_t index = (uint32_t) (networkId & OBJECT_HANDLE_INDEX_MASK);
+		// The id includes the generation, so a stale handle does not match the object now in the entry
+		if (index < objectHandles.Size() && objectHandles[index].networkId==networkId)
+			return objectHandles[index].object;
+	}
+	return networkIdManager ? networkIdManager->GET_OBJECT_FROM_ID<NetworkIDObject*>(networkId) : 0;
+}
+
+bool RPC3::IsObjectHandle(NetworkID networkId)
+{
+	return (networkId & OBJECT_HANDLE_TAG_MASK)==OBJECT_HANDLE_TAG;
+}
+
 bool RPC3::UnregisterFunction(const char *uniqueIdentifier)
 {
 	return false;
@@ -67,8 +283,305 @@ bool RPC3::UnregisterFunction(const char *uniqueIdentifier)
 
 bool RPC3::IsFunctionRegistered(const char *uniqueIdentifier)
 {
-	DataStructures::HashIndex i = GetLocalFunctionIndex(uniqueIdentifier);
-	return i.IsInvalid()==false;
+	return GetLocalFunction(uniqueIdentifier)!=0;
+}
+
+void RPC3::FreezeRegistry(void)
+{
+	unsigned j;
+	DataStructures::List<RakNet::RakString> functionKeys, slotKeys;
+	DataStructures::List<const char*> keyPtrs;
+
+	DataStructures::List<LocalRPCFunction*> functionList;
+	localFunctions.GetAsList(functionList,functionKeys,_FILE_AND_LINE_);
+	for (j=0; j < functionKeys.Size(); j++)
+		keyPtrs.Push(functionKeys[j].C_String(),_FILE_AND_LINE_);
+	bool functionsBuilt = frozenFunctions.Build(keyPtrs.Size() ? &keyPtrs[0] : 0, functionList.Size() ? &functionList[0] : 0, functionList.Size());
+
+	DataStructures::List<LocalSlot*> slotList;
+	localSlots.GetAsList(slotList,slotKeys,_FILE_AND_LINE_);
+	keyPtrs.Clear(true,_FILE_AND_LINE_);
+	for (j=0; j < slotKeys.Size(); j++)
+		keyPtrs.Push(slotKeys[j].C_String(),_FILE_AND_LINE_);
+	bool slotsBuilt = frozenSlots.Build(keyPtrs.Size() ? &keyPtrs[0] : 0, slotList.Size() ? &slotList[0] : 0, slotList.Size());
+
+	RakAssert(functionsBuilt && slotsBuilt);
+	registryFrozen = functionsBuilt && slotsBuilt;
+	if (registryFrozen==false)
+		ThawRegistry();
+}
+
+bool RPC3::IsRegistryFrozen(void) const
+{
+	return registryFrozen;
+}
+
+bool RPC3::SetSharedRegistry(RPC3 *registry)
+{
+	if (registry==this)
+		registry=0;
+	if (registry && (registry->IsRegistryFrozen()==false || registry->sharedRegistry))
+		return false;
+	sharedRegistry=registry;
+	return true;
+}
+
+RPC3 *RPC3::GetSharedRegistry(void) const
+{
+	return sharedRegistry;
+}
+
+void RPC3::SetCompactHeaderEnabled(bool enable)
+{
+	compactHeaderEnabled=enable;
+}
+
+unsigned char RPC3::GetProtocolVersion(const SystemAddress &systemAddress)
+{
+	RemoteSystem **remoteSystem = remoteSystems.Peek(systemAddress);
+	if (remoteSystem==0 || compactHeaderEnabled==false)
+		return RPC3_PROTOCOL_LEGACY;
+	return (*remoteSystem)->protocolVersion;
+}
+
+void RPC3::SetCompressionThreshold(unsigned int thresholdBytes)
+{
+	compressionThreshold=thresholdBytes;
+}
+
+void RPC3::SetCompressionForIdentifier(const char *uniqueIdentifier, bool compress)
+{
+	if (compress)
+	{
+		if (compressedIdentifiers.HasData(uniqueIdentifier)==false)
+			compressedIdentifiers.Push(uniqueIdentifier, true, _FILE_AND_LINE_);
+	}
+	else
+		compressedIdentifiers.Remove(uniqueIdentifier, _FILE_AND_LINE_);
+}
+
+void RPC3::SetSendPolicy(const char *uniqueIdentifier, const RPC3SendPolicy &sendPolicy)
+{
+	DataStructures::HashIndex index = sendPolicies.GetIndexOf(uniqueIdentifier);
+	if (index.IsInvalid())
+		sendPolicies.Push(uniqueIdentifier, sendPolicy, _FILE_AND_LINE_);
+	else
+		sendPolicies.ItemAtIndex(index)=sendPolicy;
+}
+
+void RPC3::ClearSendPolicy(const char *uniqueIdentifier)
+{
+	sendPolicies.Remove(uniqueIdentifier, _FILE_AND_LINE_);
+}
+
+void RPC3::SetMaxAge(RakNet::Time maxAge)
+{
+	outgoingMaxAge=maxAge;
+}
+
+void RPC3::SetHandlerMaxAge(const char *uniqueIdentifier, RakNet::Time maxAge)
+{
+	if (maxAge==0)
+	{
+		handlerMaxAges.Remove(uniqueIdentifier, _FILE_AND_LINE_);
+		return;
+	}
+	DataStructures::HashIndex index = handlerMaxAges.GetIndexOf(uniqueIdentifier);
+	if (index.IsInvalid())
+		handlerMaxAges.Push(uniqueIdentifier, maxAge, _FILE_AND_LINE_);
+	else
+		handlerMaxAges.ItemAtIndex(index)=maxAge;
+}
+
+void RPC3::SetObjectOrderingChannels(char firstChannel, unsigned char channelCount)
+{
+	if ((unsigned char) firstChannel >= RPC3_ORDERING_CHANNELS)
+		channelCount=0;
+	else if ((unsigned int) (unsigned char) firstChannel + channelCount > RPC3_ORDERING_CHANNELS)
+		channelCount=(unsigned char) (RPC3_ORDERING_CHANNELS - (unsigned char) firstChannel);
+	objectOrderingChannel=firstChannel;
+	objectOrderingChannelCount=channelCount;
+}
+
+void RPC3::SetStringInterningLimit(unsigned int maxStrings)
+{
+	internedStringLimit = maxStrings < RPC3_MAX_INTERNED_STRINGS ? maxStrings : RPC3_MAX_INTERNED_STRINGS;
+}
+
+const RPC3Statistics &RPC3::GetStatistics(void) const
+{
+	return statistics;
+}
+
+void RPC3::SetErrorReportInterval(RakNet::TimeMS interval, unsigned int maxReports)
+{
+	errorReportInterval=interval;
+	maxErrorReports=maxReports;
+}
+
+void RPC3::SetStreamWindow(unsigned int windowBytes, unsigned int chunkBytes)
+{
+	streamWindow=windowBytes;
+	streamChunkBytes=chunkBytes > 0 ? chunkBytes : 1;
+}
+
+void RPC3::EnableTracing(unsigned int sampleInterval, unsigned int capacity)
+{
+	if (tracer==0 || tracer->GetCapacity() < capacity)
+	{
+		DisableTracing();
+		tracer = RakNet::OP_NEW_1<RPC3Tracer>(_FILE_AND_LINE_, capacity);
+	}
+	traceSampleInterval=sampleInterval;
+	traceSampleCounter=0;
+}
+
+void RPC3::DisableTracing(void)
+{
+	traceSampleInterval=0;
+	if (tracer)
+	{
+		RakNet::OP_DELETE(tracer, _FILE_AND_LINE_);
+		tracer=0;
+	}
+}
+
+RPC3Tracer *RPC3::GetTracer(void) const
+{
+	return tracer;
+}
+
+void RPC3::SetSlowHandlerCallback(RakNet::TimeUS thresholdUS, const SlowHandlerCallback &callback)
+{
+	slowHandlerThreshold = callback ? thresholdUS : 0;
+	slowHandlerCallback=callback;
+}
+
+void RPC3::AddOutgoingTrace(const char *uniqueIdentifier, bool isCall, const OutgoingCall *call)
+{
+	RPC3TraceRecord record = RPC3TraceRecord();
+	record.traceId=call->traceId;
+	record.origin=GetMyGUIDUnified();
+	record.outgoing=true;
+	record.isCall=isCall;
+	strncpy(record.identifier, uniqueIdentifier, sizeof(record.identifier)-1);
+	record.times[RPC3_TRACE_CALL]=call->traceTimes[RPC3_TRACE_CALL];
+	record.times[RPC3_TRACE_SERIALIZED]=call->traceTimes[RPC3_TRACE_SERIALIZED];
+	record.times[RPC3_TRACE_SENT]=RakNet::GetTimeUS();
+	tracer->Add(record);
+}
+
+void RPC3::AddIncomingTrace(const SystemAddress &systemAddress, const CallHeader &header, RPC3TraceRecord *record)
+{
+	DescribeIncomingTrace(systemAddress, header, record);
+	FinishIncomingTrace(record);
+}
+
+void RPC3::DescribeIncomingTrace(const SystemAddress &systemAddress, const CallHeader &header, RPC3TraceRecord *record)
+{
+	record->outgoing=false;
+	record->isCall=header.isCall;
+	strncpy(record->identifier, header.identifier, sizeof(record->identifier)-1);
+	record->identifier[sizeof(record->identifier)-1]=0;
+	if (header.options & CALL_OPTION_TRACE)
+	{
+		record->traceId=header.traceId;
+		if (rakPeerInterface)
+			record->origin=rakPeerInterface->GetGuidFromSystemAddress(systemAddress);
+	}
+}
+
+void RPC3::FinishIncomingTrace(RPC3TraceRecord *record)
+{
+	record->times[RPC3_TRACE_HANDLED]=RakNet::GetTimeUS();
+	// A handler that returned before reading its arguments, or failed to, counts as decoded when it returned
+	if (record->times[RPC3_TRACE_DECODED]==0)
+		record->times[RPC3_TRACE_DECODED]=record->times[RPC3_TRACE_HANDLED];
+
+	if (tracer && record->traceId!=0)
+		tracer->Add(*record);
+	if (slowHandlerThreshold!=0 && record->GetSpan(RPC3_TRACE_SPAN_HANDLER) >= slowHandlerThreshold)
+		slowHandlerCallback(*record);
+}
+
+bool RPC3::StartCapture(const char *path)
+{
+	StopCapture();
+	captureLog = RakNet::OP_NEW<_RPC3::CaptureLog>(_FILE_AND_LINE_);
+	if (captureLog->Create(path)==false)
+	{
+		RakNet::OP_DELETE(captureLog, _FILE_AND_LINE_);
+		captureLog=0;
+		return false;
+	}
+	captureStartTime=RakNet::GetTimeUS();
+	return true;
+}
+
+void RPC3::StopCapture(void)
+{
+	if (captureLog)
+	{
+		RakNet::OP_DELETE(captureLog, _FILE_AND_LINE_);
+		captureLog=0;
+	}
+}
+
+bool RPC3::IsCapturing(void) const
+{
+	return captureLog!=0;
+}
+
+bool RPC3::ReplayCapture(const char *path, bool realTime, unsigned int *messageCount)
+{
+	_RPC3::CaptureLog log;
+	if (messageCount)
+		*messageCount=0;
+	if (log.Open(path)==false)
+		return false;
+
+	_RPC3::CaptureRecord record;
+	RakNet::TimeUS replayStartTime = RakNet::GetTimeUS();
+	RakNet::TimeUS firstReceiveTime = 0;
+	unsigned int count=0;
+	uint64_t recordCount = log.GetRecordCount();
+	while (count < recordCount)
+	{
+		if (log.Read(&record)==false)
+			return false;
+		if (count==0)
+			firstReceiveTime=record.receiveTime;
+
+		if (realTime)
+		{
+			RakNet::TimeUS due = replayStartTime + (record.receiveTime - firstReceiveTime);
+			RakNet::TimeUS now = RakNet::GetTimeUS();
+			// Sleep off most of the gap, then spin for the rest
+			if (due > now + 2000)
+				RakSleep((unsigned int) ((due - now) / 1000) - 1);
+			while (RakNet::GetTimeUS() < due)
+				;
+		}
+
+		SystemAddress sender;
+		sender.FromString(record.senderAddress);
+		incomingTimeStamp=record.senderTimestamp;
+		// The log keeps receive times relative to the capture only, so replayed calls are never expired
+		incomingReceiveTime=record.senderTimestamp;
+		incomingSystemAddress=sender;
+		OnRPC3Call(sender, (unsigned char*) record.payload, record.payloadBytes);
+		count++;
+		if (messageCount)
+			*messageCount=count;
+	}
+	return true;
+}
+
+void RPC3::ThawRegistry(void)
+{
+	registryFrozen=false;
+	frozenFunctions.Clear();
+	frozenSlots.Clear();
 }
 
 void RPC3::SetTimestamp(RakNet::Time timeStamp)
@@ -109,39 +622,59 @@ RakPeerInterface *RPC3::GetRakPeer(void) const
 	return rakPeerInterface;
 }
 
+// Types are compared by value, as type_info objects are not necessarily unique across modules
+static bool SameLocalArgsType(const std::type_info *handlerArgsType, const std::type_info *callerArgsType)
+{
+	return handlerArgsType!=0 && callerArgsType!=0 && *handlerArgsType==*callerArgsType;
+}
+
 const char *RPC3::GetCurrentExecution(void) const
 {
 	return (const char *) currentExecution;
 }
 
-bool RPC3::SendCallOrSignal(RakString uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall)
+bool RPC3::SendCallOrSignal(const char *uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall)
 {
 	SystemAddress systemAddr;
 
-	if (uniqueIdentifier.IsEmpty())
+	if (uniqueIdentifier==0 || uniqueIdentifier[0]==0)
+		return false;
+	if (outgoingBroadcast==false && outgoingSystemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS)
 		return false;
 
-	RakNet::BitStream bs;
-	if (outgoingTimestamp!=0)
-	{
-		bs.Write((MessageID)ID_TIMESTAMP);
-		bs.Write(outgoingTimestamp);
-	}
-	bs.Write((MessageID)ID_RPC_PLUGIN);
-	bs.Write(parameterCount);
-	if (outgoingNetworkID!=UNASSIGNED_NETWORK_ID && isCall)
-	{
-		bs.Write(true);
-		bs.Write(outgoingNetworkID);
-	}
-	else
+	// For this message only
+	PacketPriority lastPriority=outgoingPriority;
+	PacketReliability lastReliability=outgoingReliability;
+	char lastOrderingChannel=outgoingOrderingChannel;
+	ApplySendPolicy(uniqueIdentifier, isCall);
+	// Chunks of stream arguments follow the call on its ordering channel, which only keeps them behind it if it is ordered
+	if (outgoingCall && outgoingCall->streams.size() > 0 && outgoingReliability!=RELIABLE_ORDERED_WITH_ACK_RECEIPT)
+		outgoingReliability=RELIABLE_ORDERED;
+
+	_RPC3::PooledBitStream pooledBitStream;
+	RakNet::BitStream &bs = *pooledBitStream.bitStream;
+	// Room for the largest header, so writing the message does not reallocate. Large parameters are not copied into it.
+	BitSize_t copiedBits = serializedParameters->GetNumberOfBytesUsed() < RPC3_SEPARATE_PARAMETERS_MIN_BYTES ? serializedParameters->GetNumberOfBitsUsed() : 0;
+	bs.AddBitsAndReallocate(copiedBits + BYTES_TO_BITS(64 + strlen(uniqueIdentifier)));
+	bool traced = outgoingCall!=0 && outgoingCall->traceId!=0;
+	if (traced && outgoingTimestamp==0 && outgoingBroadcast==false)
 	{
-		bs.Write(false);
+		// Lets the recipient time the network stage, as RakNet converts the timestamp to its clock
+		RemoteSystem *remoteSystem = GetCompactRemoteSystem(outgoingSystemAddress);
+		outgoingCall->traceTimestamp = remoteSystem!=0 && (remoteSystem->features & RPC3_FEATURE_TRACE)!=0;
 	}
-	bs.Write(isCall);
-	// This is so the call SetWriteOffset works
-	bs.AlignWriteToByteBoundary();
-	BitSize_t writeOffset = bs.GetWriteOffset();
+	// A timestamp only added for the max age goes to recipients that read the max age, see SendToSystem()
+	RakNet::Time timestamp = outgoingTimestamp;
+	if (timestamp==0 && traced && outgoingCall->traceTimestamp)
+		timestamp=RakNet::GetTime();
+	RakNet::Time maxAgeTimestamp = timestamp;
+	if (maxAgeTimestamp==0 && outgoingMaxAge!=0)
+		maxAgeTimestamp=RakNet::GetTime();
+
+	// Compressed at most once, and only if some recipient can read it
+	CompressedParameters compressedParameters;
+	bool compressionTried=false, compressionUsed=false;
+
 	if (outgoingBroadcast)
 	{
 		unsigned systemIndex;
@@ -150,105 +683,590 @@ bool RPC3::SendCallOrSignal(RakString uniqueIdentifier, char parameterCount, Rak
 			systemAddr=rakPeerInterface->GetSystemAddressFromIndex(systemIndex);
 			if (systemAddr!=RakNet::UNASSIGNED_SYSTEM_ADDRESS && systemAddr!=outgoingSystemAddress)
 			{
-				StringCompressor::Instance()->EncodeString(uniqueIdentifier, 512, &bs, 0);
-
-				bs.WriteCompressed(serializedParameters->GetNumberOfBitsUsed());
-
-				bs.WriteAlignedBytes((const unsigned char*) serializedParameters->GetData(), serializedParameters->GetNumberOfBytesUsed());
-				SendUnified(&bs, outgoingPriority, outgoingReliability, outgoingOrderingChannel, systemAddr, false);
-
-				// Start writing again after ID_AUTO_RPC_CALL
-				bs.SetWriteOffset(writeOffset);
+				RemoteSystem *remoteSystem = GetCompactRemoteSystem(systemAddr);
+				if (remoteSystem && (remoteSystem->features & RPC3_FEATURE_COMPRESSION) && compressionTried==false)
+				{
+					compressionTried=true;
+					compressionUsed=CompressParameters(uniqueIdentifier, serializedParameters, &compressedParameters);
+				}
+				SendToSystem(&bs, timestamp, maxAgeTimestamp, systemAddr, remoteSystem, uniqueIdentifier, parameterCount, serializedParameters, isCall, compressionUsed ? &compressedParameters : 0);
 			}
 		}
 	}
 	else
 	{
 		systemAddr = outgoingSystemAddress;
-		if (systemAddr!=RakNet::UNASSIGNED_SYSTEM_ADDRESS)
-		{
-			StringCompressor::Instance()->EncodeString(uniqueIdentifier, 512, &bs, 0);
-
-			bs.WriteCompressed(serializedParameters->GetNumberOfBitsUsed());
-			bs.WriteAlignedBytes((const unsigned char*) serializedParameters->GetData(), serializedParameters->GetNumberOfBytesUsed());
-			SendUnified(&bs, outgoingPriority, outgoingReliability, outgoingOrderingChannel, systemAddr, false);
-		}
-		else
-			return false;
+		RemoteSystem *remoteSystem = GetCompactRemoteSystem(systemAddr);
+		if (remoteSystem && (remoteSystem->features & RPC3_FEATURE_COMPRESSION))
+			compressionUsed=CompressParameters(uniqueIdentifier, serializedParameters, &compressedParameters);
+		SendToSystem(&bs, timestamp, maxAgeTimestamp, systemAddr, remoteSystem, uniqueIdentifier, parameterCount, serializedParameters, isCall, compressionUsed ? &compressedParameters : 0);
 	}
-	return true;
-}
 
-void RPC3::OnAttach(void)
-{
-	outgoingSystemAddress=RakNet::UNASSIGNED_SYSTEM_ADDRESS;
-	outgoingNetworkID=UNASSIGNED_NETWORK_ID;
-	incomingSystemAddress=RakNet::UNASSIGNED_SYSTEM_ADDRESS;
+	if (traced && tracer)
+		AddOutgoingTrace(uniqueIdentifier, isCall, outgoingCall);
+
+	outgoingPriority=lastPriority;
+	outgoingReliability=lastReliability;
+	outgoingOrderingChannel=lastOrderingChannel;
+	return true;
 }
 
-PluginReceiveResult RPC3::OnReceive(Packet *packet)
+void RPC3::ApplySendPolicy(const char *uniqueIdentifier, bool isCall)
 {
-	RakNet::Time timestamp=0;
-	unsigned char packetIdentifier, packetDataOffset;
-	if ( ( unsigned char ) packet->data[ 0 ] == ID_TIMESTAMP )
+	RPC3 *registry = sharedRegistry ? sharedRegistry : this;
+	if (registry->sendPolicies.Size() > 0)
 	{
-		if ( packet->length > sizeof( unsigned char ) + sizeof( RakNet::Time ) )
+		DataStructures::HashIndex index = registry->sendPolicies.GetIndexOf(uniqueIdentifier);
+		if (index.IsInvalid()==false)
 		{
-			packetIdentifier = ( unsigned char ) packet->data[ sizeof( unsigned char ) + sizeof( RakNet::Time ) ];
-			// Required for proper endian swapping
-			RakNet::BitStream tsBs(packet->data+sizeof(MessageID),packet->length-1,false);
-			tsBs.Read(timestamp);
-			packetDataOffset=sizeof( unsigned char )*2 + sizeof( RakNet::Time );
+			const RPC3SendPolicy &sendPolicy = registry->sendPolicies.ItemAtIndex(index);
+			outgoingPriority=sendPolicy.priority;
+			outgoingReliability=sendPolicy.reliability;
+			outgoingOrderingChannel=sendPolicy.orderingChannel;
 		}
-		else
-			return RR_STOP_PROCESSING_AND_DEALLOCATE;
 	}
-	else
+
+	if (objectOrderingChannelCount==0 || isCall==false || outgoingNetworkID==UNASSIGNED_NETWORK_ID || outgoingNetworkIDCount > 1)
+		return;
+	if (outgoingReliability!=RELIABLE_ORDERED && outgoingReliability!=RELIABLE_ORDERED_WITH_ACK_RECEIPT &&
+		outgoingReliability!=RELIABLE_SEQUENCED && outgoingReliability!=UNRELIABLE_SEQUENCED)
+		return;
+	// Ids handed out in sequence land on different channels
+	uint64_t hash = (uint64_t) outgoingNetworkID * 0x9E3779B97F4A7C15ull;
+	outgoingOrderingChannel = (char) (objectOrderingChannel + (unsigned char) ((hash >> 32) % objectOrderingChannelCount));
+}
+
+void RPC3::SendToSystem(RakNet::BitStream *bs, RakNet::Time timestamp, RakNet::Time maxAgeTimestamp, const SystemAddress &systemAddress, RemoteSystem *remoteSystem, const char *uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall, const CompressedParameters *compressedParameters)
+{
+	// Others would pass the timestamp on to handlers that did not ask for one
+	if (remoteSystem && (remoteSystem->features & RPC3_FEATURE_MAX_AGE))
+		timestamp=maxAgeTimestamp;
+	bs->SetWriteOffset(0);
+	if (timestamp!=0)
 	{
-		packetIdentifier = ( unsigned char ) packet->data[ 0 ];
-		packetDataOffset=sizeof( unsigned char );
+		bs->Write((MessageID)ID_TIMESTAMP);
+		bs->Write(timestamp);
 	}
+	bs->Write((MessageID)ID_RPC_PLUGIN);
+	// The rest of the message depends on what the recipient reads
+	BitSize_t writeOffset = bs->GetWriteOffset();
 
-	switch (packetIdentifier)
+	// Only the compact layout carries compressed parameters
+	if (remoteSystem==0)
+		compressedParameters=0;
+	if (outgoingNetworkIDCount > 1 && isCall && (remoteSystem==0 || (remoteSystem->features & RPC3_FEATURE_MULTI_TARGET)==0))
 	{
-	case ID_RPC_PLUGIN:
-		incomingTimeStamp=timestamp;
-		incomingSystemAddress=packet->systemAddress;
-		OnRPC3Call(packet->systemAddress, packet->data+packetDataOffset, packet->length-packetDataOffset);
-		return RR_STOP_PROCESSING_AND_DEALLOCATE;
+		// The recipient reads one object per message
+		NetworkID lastNetworkID = outgoingNetworkID;
+		unsigned int networkIDCount = outgoingNetworkIDCount;
+		outgoingNetworkIDCount = 0;
+		unsigned int i;
+		for (i=0; i < networkIDCount; i++)
+		{
+			outgoingNetworkID = outgoingNetworkIDs[i];
+			bs->SetWriteOffset(writeOffset);
+			bool parametersLeftOut = WriteCallOrSignal(bs, uniqueIdentifier, parameterCount, serializedParameters, isCall, remoteSystem, compressedParameters);
+			SendCallOrSignalMessage(bs, parametersLeftOut, serializedParameters, compressedParameters, outgoingPriority, outgoingReliability, outgoingOrderingChannel, systemAddress);
+		}
+		outgoingNetworkID = lastNetworkID;
+		outgoingNetworkIDCount = networkIDCount;
+		return;
 	}
 
-	return RR_CONTINUE_PROCESSING;
+	bs->SetWriteOffset(writeOffset);
+	bool parametersLeftOut = WriteCallOrSignal(bs, uniqueIdentifier, parameterCount, serializedParameters, isCall, remoteSystem, compressedParameters);
+	SendCallOrSignalMessage(bs, parametersLeftOut, serializedParameters, compressedParameters, outgoingPriority, outgoingReliability, outgoingOrderingChannel, systemAddress);
+	if (outgoingCall && outgoingCall->streams.size() > 0 && remoteSystem && (remoteSystem->features & RPC3_FEATURE_STREAMS))
+		AddOutgoingStreams(systemAddress, outgoingPriority, outgoingOrderingChannel);
 }
 
-void RPC3::OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, unsigned int lengthInBytes)
+void RPC3::SendCallOrSignalMessage(RakNet::BitStream *bs, bool parametersLeftOut, RakNet::BitStream *serializedParameters, const CompressedParameters *compressedParameters,
+	PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress)
 {
-	RakNet::BitStream bs(data,lengthInBytes,false);
-
-	DataStructures::HashIndex functionIndex;
-	LocalRPCFunction *lrpcf;
-	bool hasParameterCount=false;
-	char parameterCount;
-	NetworkIDObject *networkIdObject;
-	NetworkID networkId;
-	bool hasNetworkId=false;
-	BitSize_t bitsOnStack;
-	char strIdentifier[512];
-	incomingExtraData.Reset();
-	bs.Read(parameterCount);
-	bs.Read(hasNetworkId);
-	if (hasNetworkId)
+	if (parametersLeftOut==false)
 	{
-		bool readSuccess = bs.Read(networkId);
-		RakAssert(readSuccess);
-		RakAssert(networkId!=UNASSIGNED_NETWORK_ID);
+		SendUnified(bs, priority, reliability, orderingChannel, systemAddress, false);
+		return;
+	}
+
+	// RakNet joins the two buffers into its own, which is the only copy of the parameters made after serializing them
+	const char *data[2];
+	int lengths[2];
+	data[0]=(const char*) bs->GetData();
+	lengths[0]=(int) bs->GetNumberOfBytesUsed();
+	if (compressedParameters)
+	{
+		data[1]=(const char*) compressedParameters->data.GetData();
+		lengths[1]=(int) compressedParameters->compressedBytes;
+	}
+	else
+	{
+		data[1]=(const char*) serializedParameters->GetData();
+		lengths[1]=(int) serializedParameters->GetNumberOfBytesUsed();
+	}
+	SendListUnified(data, lengths, 2, priority, reliability, orderingChannel, systemAddress, false);
+}
+
+bool RPC3::WriteCallOrSignal(RakNet::BitStream *bs, const char *uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall, RemoteSystem *remoteSystem, const CompressedParameters *compressedParameters)
+{
+	bool hasNetworkId = outgoingNetworkID!=UNASSIGNED_NETWORK_ID && isCall;
+	unsigned int parameterBytes = compressedParameters ? compressedParameters->compressedBytes : serializedParameters->GetNumberOfBytesUsed();
+	bool leaveOutParameters = parameterBytes >= RPC3_SEPARATE_PARAMETERS_MIN_BYTES;
+
+	if (remoteSystem==0)
+	{
+		bs->Write(parameterCount);
+		bs->Write(hasNetworkId);
+		if (hasNetworkId)
+			bs->Write(outgoingNetworkID);
+		bs->Write(isCall);
+		bs->AlignWriteToByteBoundary();
+		StringCompressor::Instance()->EncodeString(uniqueIdentifier, 512, bs, 0);
+		bs->WriteCompressed(serializedParameters->GetNumberOfBitsUsed());
+		// The parameters are byte aligned in this layout anyway
+		bs->AlignWriteToByteBoundary();
+		if (leaveOutParameters)
+			return true;
+		bs->WriteAlignedBytes((const unsigned char*) serializedParameters->GetData(), serializedParameters->GetNumberOfBytesUsed());
+		return false;
+	}
+
+	uint32_t options=0;
+	if (compressedParameters)
+		options|=CALL_OPTION_COMPRESSED;
+	if (outgoingReplyId!=0 && isCall)
+		options|=CALL_OPTION_REPLY_ID;
+	if (outgoingNetworkIDCount > 1 && isCall)
+	{
+		// The objects are listed after the identifier instead
+		options|=CALL_OPTION_MULTI_TARGET;
+		hasNetworkId=false;
+	}
+	DataStructures::List<unsigned int> stringDefinitions;
+	if (outgoingCall && outgoingCall->compactDeref)
+		options|=CALL_OPTION_COMPACT_DEREF;
+	if (outgoingCall && outgoingCall->traceId!=0 && (remoteSystem->features & RPC3_FEATURE_TRACE))
+		options|=CALL_OPTION_TRACE;
+	if (outgoingMaxAge!=0 && (remoteSystem->features & RPC3_FEATURE_MAX_AGE))
+		options|=CALL_OPTION_MAX_AGE;
+	// Started on a byte boundary like the BitStream they were serialized into, so the padding of aligned writes in them, such as those of RakString, is read back where it was written
+	bool alignParameters = (remoteSystem->features & RPC3_FEATURE_ALIGNED_PARAMETERS)!=0;
+	if (alignParameters)
+		options|=CALL_OPTION_ALIGNED_PARAMETERS;
+	else
+		leaveOutParameters=false;
+	if (outgoingCall && (remoteSystem->features & RPC3_FEATURE_INTERNED_STRINGS))
+	{
+		// A definition can be left out once an earlier message is sure to arrive first
+		bool ordered = outgoingReliability==RELIABLE_ORDERED || outgoingReliability==RELIABLE_ORDERED_WITH_ACK_RECEIPT;
+		while (remoteSystem->definedStringChannels.Size() < internedStrings.Size())
+			remoteSystem->definedStringChannels.Insert((unsigned char) STRING_NOT_DEFINED, _FILE_AND_LINE_);
+		unsigned int i;
+		for (i=0; i < outgoingCall->internedIds.Size(); i++)
+		{
+			unsigned int index = outgoingCall->internedIds[i];
+			if (ordered && remoteSystem->definedStringChannels[index]==(unsigned char) outgoingOrderingChannel)
+				continue;
+			stringDefinitions.Insert(index, _FILE_AND_LINE_);
+			if (ordered && remoteSystem->definedStringChannels[index]==STRING_NOT_DEFINED)
+				remoteSystem->definedStringChannels[index]=(unsigned char) outgoingOrderingChannel;
+		}
+		if (stringDefinitions.Size() > 0)
+			options|=CALL_OPTION_STRING_DEFINITIONS;
+	}
+	if (outgoingCall && outgoingCall->streams.size() > 0 && (remoteSystem->features & RPC3_FEATURE_STREAMS))
+		options|=CALL_OPTION_STREAMS;
+
+	// The first bit lands where the sign bit of the legacy parameter count is, which tells the layouts apart
+	bs->Write(true);
+	bs->Write(isCall);
+	bs->Write(hasNetworkId);
+	if ((unsigned char) parameterCount < 15)
+	{
+		unsigned char count = (unsigned char) parameterCount;
+		bs->WriteBits(&count, 4, true);
+	}
+	else
+	{
+		unsigned char escape = 15;
+		bs->WriteBits(&escape, 4, true);
+	}
+	bs->Write(options!=0);
+	if ((unsigned char) parameterCount >= 15)
+		bs->Write(parameterCount);
+	if (options!=0)
+		_RPC3::WriteVarInt(*bs, options);
+	if (hasNetworkId)
+		bs->WriteCompressed(outgoingNetworkID);
+	StringCompressor::Instance()->EncodeString(uniqueIdentifier, 512, bs, 0);
+
+	if (options & CALL_OPTION_MULTI_TARGET)
+	{
+		// Objects created together tend to have close ids, so each is sent as the difference to the one before
+		_RPC3::WriteVarInt(*bs, outgoingNetworkIDCount);
+		NetworkID previous=0;
+		unsigned int i;
+		for (i=0; i < outgoingNetworkIDCount; i++)
+		{
+			_RPC3::WriteVarInt(*bs, _RPC3::ZigZagEncode((int64_t) (outgoingNetworkIDs[i]-previous)));
+			previous=outgoingNetworkIDs[i];
+		}
+	}
+	if (options & CALL_OPTION_REPLY_ID)
+		_RPC3::WriteVarInt(*bs, outgoingReplyId);
+	if (options & CALL_OPTION_TRACE)
+		_RPC3::WriteVarInt(*bs, ((uint64_t) outgoingCall->traceId << 1) | (outgoingCall->traceTimestamp ? 1 : 0));
+	if (options & CALL_OPTION_MAX_AGE)
+		_RPC3::WriteVarInt(*bs, ((uint64_t) outgoingMaxAge << 1) | (outgoingTimestamp==0 ? 1 : 0));
+	if (options & CALL_OPTION_STRING_DEFINITIONS)
+	{
+		_RPC3::WriteVarInt(*bs, stringDefinitions.Size());
+		unsigned int i;
+		for (i=0; i < stringDefinitions.Size(); i++)
+		{
+			_RPC3::WriteVarInt(*bs, stringDefinitions[i]);
+			StringCompressor::Instance()->EncodeString(internedStrings[stringDefinitions[i]].C_String(), RPC3_MAX_INTERNED_STRING_LENGTH+1, bs, 0);
+		}
+	}
+	if (options & CALL_OPTION_STREAMS)
+	{
+		_RPC3::WriteVarInt(*bs, outgoingCall->streams.size());
+		size_t i;
+		for (i=0; i < outgoingCall->streams.size(); i++)
+		{
+			_RPC3::WriteVarInt(*bs, outgoingCall->streams[i].id);
+			_RPC3::WriteVarInt(*bs, outgoingCall->streams[i].state->length);
+		}
+	}
+
+	// Parameters run to the end of the packet
+	if (compressedParameters)
+		_RPC3::WriteVarInt(*bs, compressedParameters->uncompressedBits);
+	if (alignParameters)
+		bs->AlignWriteToByteBoundary();
+	if (leaveOutParameters)
+		return true;
+	if (compressedParameters)
+		bs->WriteBits(compressedParameters->data.GetData(), BYTES_TO_BITS(compressedParameters->compressedBytes), false);
+	else if (serializedParameters->GetNumberOfBitsUsed()>0)
+		bs->WriteBits(serializedParameters->GetData(), serializedParameters->GetNumberOfBitsUsed(), false);
+	return false;
+}
+
+bool RPC3::ReadCallHeader(RakNet::BitStream *bs, CallHeader *header)
+{
+	if (bs->GetNumberOfUnreadBits()<8)
+		return false;
+
+	header->options=0;
+	header->traceId=0;
+	header->traceTimestamp=false;
+	header->maxAge=0;
+	header->maxAgeTimestamp=false;
+	header->replyId=0;
+	header->targetIds.Clear(true, _FILE_AND_LINE_);
+	header->stringDefinitions.Clear(false, _FILE_AND_LINE_);
+	header->streams.Clear(true, _FILE_AND_LINE_);
+	bool isCompact;
+	bs->Read(isCompact);
+	if (isCompact==false)
+	{
+		// Legacy, the bit just read was the sign bit of the parameter count
+		bs->SetReadOffset(bs->GetReadOffset()-1);
+		bs->Read(header->parameterCount);
+		bs->Read(header->hasNetworkId);
+		if (header->hasNetworkId && bs->Read(header->networkId)==false)
+			return false;
+		if (bs->Read(header->isCall)==false)
+			return false;
+		bs->AlignReadToByteBoundary();
+		if (StringCompressor::Instance()->DecodeString(header->identifier,512,bs,0)==false)
+			return false;
+		BitSize_t bitsOnStack;
+		if (bs->ReadCompressed(bitsOnStack)==false)
+			return false;
+		bs->AlignReadToByteBoundary();
+		return bs->GetNumberOfUnreadBits()>=bitsOnStack;
+	}
+
+	bool hasOptions;
+	bs->Read(header->isCall);
+	bs->Read(header->hasNetworkId);
+	unsigned char count=0;
+	bs->ReadBits(&count, 4, true);
+	bs->Read(hasOptions);
+	if (count<15)
+		header->parameterCount=(char) count;
+	else if (bs->Read(header->parameterCount)==false)
+		return false;
+	if (hasOptions)
+	{
+		uint64_t options;
+		if (_RPC3::ReadVarInt(*bs, options)==false)
+			return false;
+		// Peers only use options we announced, anything else is a malformed message
+		if (options & ~(uint64_t) (CALL_OPTION_COMPRESSED | CALL_OPTION_REPLY_ID | CALL_OPTION_MULTI_TARGET | CALL_OPTION_STRING_DEFINITIONS | CALL_OPTION_COMPACT_DEREF | CALL_OPTION_ALIGNED_PARAMETERS | CALL_OPTION_TRACE | CALL_OPTION_MAX_AGE | CALL_OPTION_STREAMS))
+			return false;
+		header->options=(uint32_t) options;
+	}
+	if (header->hasNetworkId && bs->ReadCompressed(header->networkId)==false)
+		return false;
+	if (StringCompressor::Instance()->DecodeString(header->identifier,512,bs,0)==false)
+		return false;
+	if (header->options & CALL_OPTION_MULTI_TARGET)
+	{
+		uint64_t count;
+		// Every id takes at least 8 bits, which bounds the count before anything is allocated
+		if (header->hasNetworkId || header->isCall==false || _RPC3::ReadVarInt(*bs, count)==false || count==0 || count > bs->GetNumberOfUnreadBits()/8)
+			return false;
+		header->targetIds.Preallocate((unsigned int) count, _FILE_AND_LINE_);
+		NetworkID previous=0;
+		uint64_t i;
+		for (i=0; i < count; i++)
+		{
+			uint64_t delta;
+			if (_RPC3::ReadVarInt(*bs, delta)==false)
+				return false;
+			previous+=(NetworkID) _RPC3::ZigZagDecode(delta);
+			header->targetIds.Insert(previous, _FILE_AND_LINE_);
+		}
+	}
+	if (header->options & CALL_OPTION_REPLY_ID)
+	{
+		uint64_t replyId;
+		if (_RPC3::ReadVarInt(*bs, replyId)==false || replyId==0 || replyId > 0xFFFFFFFFu)
+			return false;
+		header->replyId=(uint32_t) replyId;
+	}
+	if (header->options & CALL_OPTION_TRACE)
+	{
+		uint64_t trace;
+		if (_RPC3::ReadVarInt(*bs, trace)==false || (trace>>1)==0 || (trace>>1) > 0xFFFFFFFFu)
+			return false;
+		header->traceId=(uint32_t) (trace>>1);
+		header->traceTimestamp=(trace & 1)!=0;
+	}
+	if (header->options & CALL_OPTION_MAX_AGE)
+	{
+		uint64_t maxAge;
+		if (_RPC3::ReadVarInt(*bs, maxAge)==false || (maxAge>>1)==0)
+			return false;
+		header->maxAge=(RakNet::Time) (maxAge>>1);
+		header->maxAgeTimestamp=(maxAge & 1)!=0;
+	}
+	if (header->options & CALL_OPTION_STRING_DEFINITIONS)
+	{
+		uint64_t count;
+		if (_RPC3::ReadVarInt(*bs, count)==false || count==0 || count > RPC3_MAX_INTERNED_STRINGS)
+			return false;
+		uint64_t i;
+		for (i=0; i < count; i++)
+		{
+			uint64_t index;
+			char string[RPC3_MAX_INTERNED_STRING_LENGTH+1];
+			if (_RPC3::ReadVarInt(*bs, index)==false || index >= RPC3_MAX_INTERNED_STRINGS ||
+				StringCompressor::Instance()->DecodeString(string, RPC3_MAX_INTERNED_STRING_LENGTH+1, bs, 0)==false)
+				return false;
+			StringDefinition definition;
+			definition.index=(uint32_t) index;
+			definition.string=string;
+			header->stringDefinitions.Insert(definition, _FILE_AND_LINE_);
+		}
+	}
+	if (header->options & CALL_OPTION_STREAMS)
+	{
+		uint64_t count;
+		// Every stream takes at least 16 bits, which bounds the count before anything is allocated
+		if (_RPC3::ReadVarInt(*bs, count)==false || count==0 || count > bs->GetNumberOfUnreadBits()/16)
+			return false;
+		uint64_t i;
+		for (i=0; i < count; i++)
+		{
+			uint64_t id, length;
+			if (_RPC3::ReadVarInt(*bs, id)==false || id==0 || id > 0xFFFFFFFFu || _RPC3::ReadVarInt(*bs, length)==false || length > 0xFFFFFFFFu)
+				return false;
+			StreamDefinition definition;
+			definition.id=(uint32_t) id;
+			definition.length=(uint32_t) length;
+			header->streams.Insert(definition, _FILE_AND_LINE_);
+		}
+	}
+	if (header->options & CALL_OPTION_COMPRESSED)
+	{
+		// Checked before DecompressParameters() allocates it, also against the most the bytes left can decompress to
+		uint64_t uncompressedBits;
+		if (_RPC3::ReadVarInt(*bs, uncompressedBits)==false || uncompressedBits > 0xFFFFFFFFu ||
+			uncompressedBits > BYTES_TO_BITS((uint64_t) RPC3_MAX_COMPRESSED_PARAMETER_BYTES) ||
+			BITS_TO_BYTES(uncompressedBits) > _RPC3::LZDecompressBound(BITS_TO_BYTES(bs->GetNumberOfUnreadBits())))
+			return false;
+		header->uncompressedBits=(BitSize_t) uncompressedBits;
+	}
+	if (header->options & CALL_OPTION_ALIGNED_PARAMETERS)
+		bs->AlignReadToByteBoundary();
+	return true;
+}
+
+bool RPC3::CompressParameters(const char *uniqueIdentifier, RakNet::BitStream *serializedParameters, CompressedParameters *compressedParameters)
+{
+	unsigned int inputBytes = serializedParameters->GetNumberOfBytesUsed();
+	if (inputBytes==0 || inputBytes > RPC3_MAX_COMPRESSED_PARAMETER_BYTES)
+		return false;
+	if (compressionThreshold==0 || inputBytes < compressionThreshold)
+	{
+		RPC3 *registry = sharedRegistry ? sharedRegistry : this;
+		if (registry->compressedIdentifiers.Size()==0 || registry->compressedIdentifiers.HasData(uniqueIdentifier)==false)
+			return false;
+	}
+
+	// Only worth it if the output is smaller, so the output buffer is never larger than the input
+	compressedParameters->data.AddBitsAndReallocate(BYTES_TO_BITS(inputBytes));
+	compressedParameters->compressedBytes = _RPC3::LZCompress(serializedParameters->GetData(), inputBytes, compressedParameters->data.GetData(), inputBytes-1);
+	if (compressedParameters->compressedBytes==0)
+	{
+		statistics.compressionSkipped++;
+		return false;
+	}
+	compressedParameters->uncompressedBits = serializedParameters->GetNumberOfBitsUsed();
+	statistics.compressedCalls++;
+	statistics.compressionBytesIn+=inputBytes;
+	statistics.compressionBytesOut+=compressedParameters->compressedBytes;
+	return true;
+}
+
+bool RPC3::DecompressParameters(RakNet::BitStream *bs, const CallHeader &header, RakNet::BitStream *decompressed)
+{
+	unsigned int compressedBytes = BITS_TO_BYTES(bs->GetNumberOfUnreadBits()+1)-1;
+	unsigned int uncompressedBytes = BITS_TO_BYTES(header.uncompressedBits);
+	if (compressedBytes==0 || uncompressedBytes==0)
+		return false;
+
+	// Unless the header aligned them, the compressed bytes follow it at any bit and are copied out first
+	RakNet::BitStream compressed;
+	const unsigned char *compressedData = bs->GetData() + BITS_TO_BYTES(bs->GetReadOffset());
+	if ((bs->GetReadOffset() & 7)!=0)
+	{
+		compressed.AddBitsAndReallocate(BYTES_TO_BITS(compressedBytes));
+		if (bs->ReadBits(compressed.GetData(), BYTES_TO_BITS(compressedBytes), false)==false)
+			return false;
+		compressedData=compressed.GetData();
+	}
+	else
+		bs->IgnoreBits(BYTES_TO_BITS(compressedBytes));
+
+	decompressed->AddBitsAndReallocate(header.uncompressedBits);
+	if (_RPC3::LZDecompress(compressedData, compressedBytes, decompressed->GetData(), uncompressedBytes)==false)
+		return false;
+	decompressed->SetWriteOffset(header.uncompressedBits);
+	return true;
+}
+
+void RPC3::OnAttach(void)
+{
+	outgoingSystemAddress=RakNet::UNASSIGNED_SYSTEM_ADDRESS;
+	outgoingNetworkID=UNASSIGNED_NETWORK_ID;
+	incomingSystemAddress=RakNet::UNASSIGNED_SYSTEM_ADDRESS;
+}
+
+PluginReceiveResult RPC3::OnReceive(Packet *packet)
+{
+	RakNet::Time timestamp=0;
+	unsigned char packetIdentifier, packetDataOffset;
+	if ( ( unsigned char ) packet->data[ 0 ] == ID_TIMESTAMP )
+	{
+		if ( packet->length > sizeof( unsigned char ) + sizeof( RakNet::Time ) )
+		{
+			packetIdentifier = ( unsigned char ) packet->data[ sizeof( unsigned char ) + sizeof( RakNet::Time ) ];
+			// Required for proper endian swapping
+			RakNet::BitStream tsBs(packet->data+sizeof(MessageID),packet->length-1,false);
+			tsBs.Read(timestamp);
+			packetDataOffset=sizeof( unsigned char )*2 + sizeof( RakNet::Time );
+		}
+		else
+			return RR_STOP_PROCESSING_AND_DEALLOCATE;
+	}
+	else
+	{
+		packetIdentifier = ( unsigned char ) packet->data[ 0 ];
+		packetDataOffset=sizeof( unsigned char );
+	}
+
+	switch (packetIdentifier)
+	{
+	case ID_RPC_PLUGIN:
+		if (wakeup)
+		{
+			// Already counted if Update() made the counts equal while the message was on its way
+			if ((int32_t) (receivedMessages-signalledMessages.load(std::memory_order_acquire)) < 0)
+				receivedMessages++;
+			ResetWakeup();
+		}
+		if (captureLog)
+			CaptureMessage(packet->systemAddress, timestamp, packet->data+packetDataOffset, packet->length-packetDataOffset);
+		incomingTimeStamp=timestamp;
+		incomingReceiveTime = timestamp!=0 ? RakNet::GetTime() : 0;
+		incomingSystemAddress=packet->systemAddress;
+		OnRPC3Call(packet->systemAddress, packet->data+packetDataOffset, packet->length-packetDataOffset);
+		return RR_STOP_PROCESSING_AND_DEALLOCATE;
+	case ID_RPC_REMOTE_ERROR:
+		// The original RPC3 plugin does not know the handshake. Its error reply means the legacy layout stays in use.
+		if (packet->length > 2 && strcmp((const char*) packet->data+2, RPC3_HANDSHAKE_IDENTIFIER)==0)
+			return RR_STOP_PROCESSING_AND_DEALLOCATE;
+		break;
+	}
+
+	return RR_CONTINUE_PROCESSING;
+}
+
+void RPC3::OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, unsigned int lengthInBytes)
+{
+	RakNet::BitStream bs(data,lengthInBytes,false);
+	RakNet::TimeUS receiveTime = tracer!=0 || slowHandlerThreshold!=0 ? RakNet::GetTimeUS() : 0;
+
+	LocalRPCFunction *lrpcf;
+	LocalSlot *localSlot;
+	NetworkIDObject *networkIdObject;
+	CallHeader header;
+	incomingExtraData.Reset();
+	if (ReadCallHeader(&bs, &header)==false)
+		return;
+	incomingReplyId = header.isCall ? header.replyId : 0;
+	incomingCompactDeref = (header.options & CALL_OPTION_COMPACT_DEREF)!=0;
+	RPC3TraceRecord traceRecord;
+	bool timed = (tracer!=0 && (header.options & CALL_OPTION_TRACE)) || slowHandlerThreshold!=0;
+	if (timed)
+	{
+		traceRecord = RPC3TraceRecord();
+		traceRecord.times[RPC3_TRACE_RECEIVED]=receiveTime;
+		if (header.traceTimestamp)
+			traceRecord.times[RPC3_TRACE_REMOTE_SENT]=(RakNet::TimeUS) incomingTimeStamp * 1000;
+	}
+	RakNet::Time senderTimestamp=incomingTimeStamp;
+	// The sender did not ask for a timestamp, so handlers do not see it
+	if (header.traceTimestamp || header.maxAgeTimestamp)
+		incomingTimeStamp=0;
+	// Applied before anything can fail, as later messages rely on the definitions
+	if (header.options & CALL_OPTION_STRING_DEFINITIONS)
+		OnStringDefinitions(systemAddress, header);
+	// Also before, so the chunks of a call that fails are cancelled like those of a stream its handler did not keep
+	if (header.options & CALL_OPTION_STREAMS)
+		OnStreamDefinitions(systemAddress, header);
+	// Before the objects are looked up and the parameters decompressed, so a backlog of stale calls costs little
+	if (IsCallExpired(header, senderTimestamp))
+	{
+		statistics.expiredCalls++;
+		SendErrorReply(systemAddress, RPC_ERROR_CALL_EXPIRED);
+		return;
+	}
+	if (header.hasNetworkId)
+	{
+		RakAssert(header.networkId!=UNASSIGNED_NETWORK_ID);
 		if (networkIdManager==0)
 		{
 			// Failed - Tried to call object member, however, networkIDManager system was never registered
 			SendError(systemAddress, RPC_ERROR_NETWORK_ID_MANAGER_UNAVAILABLE, "");
 			return;
 		}
-		networkIdObject = networkIdManager->GET_OBJECT_FROM_ID<NetworkIDObject*>(networkId);
+		networkIdObject = GetObjectFromID(header.networkId);
 		if (networkIdObject==0)
 		{
 			// Failed - Tried to call object member, object does not exist (deleted?)
@@ -260,29 +1278,57 @@ void RPC3::OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, u
 	{
 		networkIdObject=0;
 	}
-	bool isCall;
-	bs.Read(isCall);
-	bs.AlignReadToByteBoundary();
-		StringCompressor::Instance()->DecodeString(strIdentifier,512,&bs,0);
-	bs.ReadCompressed(bitsOnStack);
-	RakNet::BitStream serializedParameters;
-	if (bitsOnStack>0)
+	DataStructures::List<NetworkIDObject*> targetObjects;
+	if (header.options & CALL_OPTION_MULTI_TARGET)
+	{
+		if (GetTargetObjects(systemAddress, header.identifier, header.targetIds, targetObjects)==false)
+			return;
+		networkIdObject=targetObjects[0];
+	}
+	bool isCall = header.isCall;
+	const char *strIdentifier = header.identifier;
+	// Parameters are read in place, starting at the current read offset, unless they have to be decompressed first
+	RakNet::BitStream decompressedParameters;
+	RakNet::BitStream *parameters = &bs;
+	if (header.options & CALL_OPTION_COMPRESSED)
+	{
+		if (DecompressParameters(&bs, header, &decompressedParameters)==false)
+			return;
+		parameters = &decompressedParameters;
+	}
+	RakNet::BitStream &serializedParameters = *parameters;
+
+	if (isCall && strcmp(strIdentifier, RPC3_HANDSHAKE_IDENTIFIER)==0)
+	{
+		OnHandshake(systemAddress, &serializedParameters);
+		return;
+	}
+	if (isCall && strcmp(strIdentifier, RPC3_REPLY_IDENTIFIER)==0)
+	{
+		incomingReplyId=0;
+		OnReply(systemAddress, header.replyId, &serializedParameters);
+		return;
+	}
+	if (isCall && strcmp(strIdentifier, RPC3_STREAM_CHUNK_IDENTIFIER)==0)
+	{
+		OnStreamChunk(systemAddress, &serializedParameters);
+		return;
+	}
+	if (isCall && strcmp(strIdentifier, RPC3_STREAM_ACK_IDENTIFIER)==0)
 	{
-		serializedParameters.AddBitsAndReallocate(bitsOnStack);
-		bs.ReadAlignedBytes(serializedParameters.GetData(), BITS_TO_BYTES(bitsOnStack));
-		serializedParameters.SetWriteOffset(bitsOnStack);
+		OnStreamAck(systemAddress, &serializedParameters);
+		return;
 	}
 	
 	// Find the registered function with this str
 	if (isCall)
 	{
-		functionIndex = localFunctions.GetIndexOf(strIdentifier);
-		if (functionIndex.IsInvalid())
+		lrpcf = GetLocalFunction(strIdentifier);
+		if (lrpcf==0)
 		{
 			SendError(systemAddress, RPC_ERROR_FUNCTION_NOT_REGISTERED, strIdentifier);
 			return;
 		}
-		lrpcf = localFunctions.ItemAtIndex(functionIndex);
 
 		bool isObjectMember = std::get<0>(lrpcf->functionPointer);
 		if (isObjectMember==true && networkIdObject==0)
@@ -301,8 +1347,8 @@ void RPC3::OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, u
 	}
 	else
 	{
-		functionIndex = localSlots.GetIndexOf(strIdentifier);
-		if (functionIndex.IsInvalid())
+		localSlot = GetLocalSlot(strIdentifier);
+		if (localSlot==0)
 		{
 			SendError(systemAddress, RPC_ERROR_FUNCTION_NOT_REGISTERED, strIdentifier);
 			return;
@@ -312,7 +1358,7 @@ void RPC3::OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, u
 	if (isCall)
 	{
 		bool isObjectMember = std::get<0>(lrpcf->functionPointer);
-		std::function<_RPC3::InvokeResultCodes (_RPC3::InvokeArgs)> functionPtr = std::get<1>(lrpcf->functionPointer);
+		const std::function<_RPC3::InvokeResultCodes (_RPC3::InvokeArgs)> &functionPtr = std::get<1>(lrpcf->functionPointer);
 		int arity = std::get<2>(lrpcf->functionPointer);
 		//if (isObjectMember)
 		//	arity--; // this pointer
@@ -324,98 +1370,598 @@ void RPC3::OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, u
 		}
 
 		// Boost doesn't support this for class members
-		if (arity!=parameterCount)
+		if (arity!=header.parameterCount)
 		{
 			// Failed - The number of parameters that this function has was explicitly specified, and does not match up.
 			SendError(systemAddress, RPC_ERROR_INCORRECT_NUMBER_OF_PARAMETERS, strIdentifier);
 			return;
 		}
 
-		_RPC3::InvokeArgs functionArgs;
-		functionArgs.bitStream=&serializedParameters;
-		functionArgs.networkIDManager=networkIdManager;
-		functionArgs.caller=this;
-		functionArgs.thisPtr=networkIdObject;
-		
-		// serializedParameters.PrintBits();
+		RPC3 *registry = sharedRegistry ? sharedRegistry : this;
+		if (registry->deferredIdentifiers.Size() > 0)
+		{
+			DataStructures::HashIndex deferredIndex = registry->deferredIdentifiers.GetIndexOf(strIdentifier);
+			if (deferredIndex.IsInvalid()==false)
+			{
+				DeferCall(systemAddress, registry->deferredIdentifiers.KeyAtIndex(deferredIndex), registry->deferredIdentifiers.ItemAtIndex(deferredIndex),
+					header, &serializedParameters, targetObjects, timed ? &traceRecord : 0);
+				return;
+			}
+		}
 
-		_RPC3::InvokeResultCodes res2 = functionPtr(std::ref(functionArgs));
+		InvokeFunction(lrpcf, &serializedParameters, networkIdObject, targetObjects, timed ? &traceRecord.times[RPC3_TRACE_DECODED] : 0);
 	}
 	else
 	{
-		InvokeSignal(functionIndex, &serializedParameters, false);
+		incomingDecodedTime = timed ? &traceRecord.times[RPC3_TRACE_DECODED] : 0;
+		InvokeSignal(localSlot, strIdentifier, &serializedParameters, false);
+		incomingDecodedTime=0;
 	}
 
+	if (timed)
+		AddIncomingTrace(systemAddress, header, &traceRecord);
+
 }
-void RPC3::InterruptSignal(void)
+bool RPC3::GetTargetObjects(const SystemAddress &systemAddress, const char *functionName, const DataStructures::List<NetworkID> &targetIds, DataStructures::List<NetworkIDObject*> &targetObjects)
 {
-	interruptSignal=true;
+	if (networkIdManager==0)
+	{
+		SendError(systemAddress, RPC_ERROR_NETWORK_ID_MANAGER_UNAVAILABLE, "");
+		return false;
+	}
+	DataStructures::List<NetworkID> missingIds;
+	targetObjects.Preallocate(targetIds.Size(), _FILE_AND_LINE_);
+	unsigned int i;
+	for (i=0; i < targetIds.Size(); i++)
+	{
+		NetworkIDObject *targetObject = GetObjectFromID(targetIds[i]);
+		if (targetObject)
+			targetObjects.Insert(targetObject, _FILE_AND_LINE_);
+		else
+			missingIds.Insert(targetIds[i], _FILE_AND_LINE_);
+	}
+	if (missingIds.Size() > 0)
+		SendObjectsMissingError(systemAddress, functionName, missingIds);
+	return targetObjects.Size() > 0;
 }
-void RPC3::InvokeSignal(DataStructures::HashIndex functionIndex, RakNet::BitStream *serializedParameters, bool temporarilySetUSA)
+void RPC3::InvokeFunction(LocalRPCFunction *localFunction, RakNet::BitStream *serializedParameters, NetworkIDObject *networkIdObject, DataStructures::List<NetworkIDObject*> &targetObjects, RakNet::TimeUS *decodedTime)
 {
-	if (functionIndex.IsInvalid())
-		return;
-
-	SystemAddress lastIncomingAddress=incomingSystemAddress;
-	if (temporarilySetUSA)
-		incomingSystemAddress=RakNet::UNASSIGNED_SYSTEM_ADDRESS;
-	interruptSignal=false;
-	LocalSlot *localSlot = localSlots.ItemAtIndex(functionIndex);
-	unsigned int i;
 	_RPC3::InvokeArgs functionArgs;
 	functionArgs.bitStream=serializedParameters;
 	functionArgs.networkIDManager=networkIdManager;
 	functionArgs.caller=this;
-	i=0;
-	while (i < localSlot->slotObjects.Size())
-	{
-		if (localSlot->slotObjects[i].associatedObject!=UNASSIGNED_NETWORK_ID)
-		{
-			functionArgs.thisPtr = networkIdManager->GET_OBJECT_FROM_ID<NetworkIDObject*>(localSlot->slotObjects[i].associatedObject);
-			if (functionArgs.thisPtr==0)
-			{
-				localSlot->slotObjects.RemoveAtIndex(i);
-				continue;
-			}
-		}
-		else
-			functionArgs.thisPtr=0;
-		functionArgs.bitStream->ResetReadPointer();
+	functionArgs.thisPtr=networkIdObject;
+	functionArgs.thisPtrs = targetObjects.Size() > 0 ? &targetObjects[0] : 0;
+	functionArgs.thisPtrCount=targetObjects.Size();
+	functionArgs.compactDeref=incomingCompactDeref;
+	functionArgs.localArgs=0;
+	functionArgs.decodedTime=decodedTime;
 
-		bool isObjectMember = std::get<0>(localSlot->slotObjects[i].functionPointer);
-		std::function<_RPC3::InvokeResultCodes (_RPC3::InvokeArgs)> functionPtr = std::get<1>(localSlot->slotObjects[i].functionPointer);
-		if (functionPtr==0)
+	_RPC3::InvokeResultCodes res2 = std::get<1>(localFunction->functionPointer)(std::ref(functionArgs));
+}
+void RPC3::SetDeferredDispatch(const char *uniqueIdentifier, bool deferred)
+{
+	DataStructures::HashIndex index = deferredIdentifiers.GetIndexOf(uniqueIdentifier);
+	if (deferred && index.IsInvalid())
+		deferredIdentifiers.Push(uniqueIdentifier, nextDeferredGroup++, _FILE_AND_LINE_);
+	else if (deferred==false && index.IsInvalid()==false)
+		deferredIdentifiers.RemoveAtIndex(index, _FILE_AND_LINE_);
+}
+void RPC3::DeferCall(const SystemAddress &systemAddress, const RPCIdentifier &identifier, unsigned int group, const CallHeader &header, RakNet::BitStream *serializedParameters,
+	const DataStructures::List<NetworkIDObject*> &targetObjects, const RPC3TraceRecord *traceRecord)
+{
+	deferredCalls.push_back(DeferredCall());
+	DeferredCall &deferredCall = deferredCalls.back();
+	// Copying the key only adds a reference to its buffer
+	deferredCall.identifier=identifier;
+	deferredCall.group=group;
+	deferredCall.systemAddress=systemAddress;
+	deferredCall.timeStamp=incomingTimeStamp;
+	deferredCall.replyId=incomingReplyId;
+	deferredCall.compactDeref=incomingCompactDeref;
+	deferredCall.networkId = header.hasNetworkId ? header.networkId : UNASSIGNED_NETWORK_ID;
+	unsigned int i;
+	for (i=0; i < targetObjects.Size() && (header.options & CALL_OPTION_MULTI_TARGET); i++)
+		deferredCall.targetIds.Insert(targetObjects[i]->GetNetworkID(), _FILE_AND_LINE_);
+	// Sorted by the first object
+	if (deferredCall.targetIds.Size() > 0)
+		deferredCall.networkId=deferredCall.targetIds[0];
+	deferredCall.parameters=_RPC3::AcquireBitStream();
+	deferredCall.parameters->Write(serializedParameters, serializedParameters->GetNumberOfUnreadBits());
+	deferredCall.traceRecord=0;
+	for (i=0; i < header.streams.Size(); i++)
+	{
+		size_t j;
+		for (j=0; j < incomingStreams.size(); j++)
 		{
-			if (temporarilySetUSA==false)
-			{
-				// Failed - Function was previously registered, but isn't registered any longer
-				SendError(lastIncomingAddress, RPC_ERROR_FUNCTION_NO_LONGER_REGISTERED, localSlots.KeyAtIndex(functionIndex).C_String());
-			}
-			return;
+			if (incomingStreams[j].id==header.streams[i].id && incomingStreams[j].systemAddress==systemAddress)
+				deferredCall.streams.push_back(incomingStreams[j].state);
 		}
-		_RPC3::InvokeResultCodes res2 = functionPtr(std::ref(functionArgs));
-
-		// Not threadsafe
-		if (interruptSignal==true)
-			break;
-
-		i++;
 	}
-
-	if (temporarilySetUSA)
-		incomingSystemAddress=lastIncomingAddress;
+	if (traceRecord)
+	{
+		deferredCall.traceRecord=RakNet::OP_NEW<RPC3TraceRecord>(_FILE_AND_LINE_);
+		*deferredCall.traceRecord=*traceRecord;
+		DescribeIncomingTrace(systemAddress, header, deferredCall.traceRecord);
+	}
 }
-
-
-void RPC3::OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason )
+unsigned int RPC3::DispatchDeferredCalls(RPC3DispatchOrder order)
 {
-
+	// Not from a handler of a deferred call
+	if (deferredCalls.size()==0 || dispatchingCalls.size()!=0)
+		return 0;
+	dispatchingCalls.swap(deferredCalls);
+	unsigned int callCount = (unsigned int) dispatchingCalls.size();
+	dispatchOrder.resize(callCount);
+	unsigned int i;
+	for (i=0; i < callCount; i++)
+		dispatchOrder[i]=i;
+	if (order==RPC3_DISPATCH_GROUPED)
+	{
+		const std::vector<DeferredCall> &calls = dispatchingCalls;
+		std::sort(dispatchOrder.begin(), dispatchOrder.end(), [&calls](unsigned int a, unsigned int b) {
+			if (calls[a].group!=calls[b].group)
+				return calls[a].group < calls[b].group;
+			if (calls[a].networkId!=calls[b].networkId)
+				return calls[a].networkId < calls[b].networkId;
+			return a < b;
+		});
+	}
+
+	SystemAddress lastIncomingAddress=incomingSystemAddress;
+	RakNet::Time lastIncomingTimeStamp=incomingTimeStamp;
+	uint32_t lastIncomingReplyId=incomingReplyId;
+	bool lastIncomingCompactDeref=incomingCompactDeref;
+	LocalRPCFunction *localFunction=0;
+	const char *localFunctionIdentifier=0;
+	DataStructures::List<NetworkIDObject*> targetObjects;
+	for (i=0; i < callCount; i++)
+	{
+		DeferredCall &deferredCall = dispatchingCalls[dispatchOrder[i]];
+		incomingSystemAddress=deferredCall.systemAddress;
+		incomingTimeStamp=deferredCall.timeStamp;
+		incomingReplyId=deferredCall.replyId;
+		incomingCompactDeref=deferredCall.compactDeref;
+		// Calls of one identifier share its buffer, so grouped calls look the function up once
+		if (deferredCall.identifier.C_String()!=localFunctionIdentifier)
+		{
+			localFunctionIdentifier=deferredCall.identifier.C_String();
+			localFunction=GetLocalFunction(localFunctionIdentifier);
+		}
+		// Registration may have changed since the call was checked
+		NetworkIDObject *networkIdObject=0;
+		targetObjects.Clear(true, _FILE_AND_LINE_);
+		if (localFunction==0)
+			SendError(deferredCall.systemAddress, RPC_ERROR_FUNCTION_NOT_REGISTERED, localFunctionIdentifier);
+		else if (std::get<1>(localFunction->functionPointer)==0)
+			SendError(deferredCall.systemAddress, RPC_ERROR_FUNCTION_NO_LONGER_REGISTERED, localFunctionIdentifier);
+		else if (deferredCall.targetIds.Size() > 0)
+		{
+			if (GetTargetObjects(deferredCall.systemAddress, localFunctionIdentifier, deferredCall.targetIds, targetObjects))
+				networkIdObject=targetObjects[0];
+		}
+		else if (deferredCall.networkId!=UNASSIGNED_NETWORK_ID)
+		{
+			networkIdObject = GetObjectFromID(deferredCall.networkId);
+			if (networkIdObject==0)
+				SendError(deferredCall.systemAddress, RPC_ERROR_OBJECT_DOES_NOT_EXIST, "");
+		}
+		bool isObjectMember = localFunction!=0 && std::get<0>(localFunction->functionPointer);
+		if (localFunction!=0 && std::get<1>(localFunction->functionPointer)!=0 && (networkIdObject!=0 || isObjectMember==false))
+		{
+			RPC3TraceRecord *traceRecord = deferredCall.traceRecord;
+			InvokeFunction(localFunction, deferredCall.parameters, networkIdObject, targetObjects, traceRecord ? &traceRecord->times[RPC3_TRACE_DECODED] : 0);
+			if (traceRecord)
+				FinishIncomingTrace(traceRecord);
+		}
+		_RPC3::ReleaseBitStream(deferredCall.parameters);
+		if (deferredCall.traceRecord)
+			RakNet::OP_DELETE(deferredCall.traceRecord, _FILE_AND_LINE_);
+	}
+	incomingSystemAddress=lastIncomingAddress;
+	incomingTimeStamp=lastIncomingTimeStamp;
+	incomingReplyId=lastIncomingReplyId;
+	incomingCompactDeref=lastIncomingCompactDeref;
+	dispatchingCalls.clear();
+	return callCount;
+}
+unsigned int RPC3::GetDeferredCallCount(void) const
+{
+	return (unsigned int) deferredCalls.size();
+}
+void RPC3::EnableWakeup(void)
+{
+	if (wakeup==0)
+		wakeup = RakNet::OP_NEW<RPC3Wakeup>(_FILE_AND_LINE_);
+}
+bool RPC3::WaitForCalls(RakNet::TimeMS timeoutMs)
+{
+	if (wakeup==0)
+		return false;
+	return wakeup->Wait(timeoutMs);
+}
+void RPC3::Wake(void)
+{
+	if (wakeup==0)
+		return;
+	wakeRequested.store(true, std::memory_order_release);
+	wakeup->Signal();
+}
+int RPC3::GetWakeupFileDescriptor(void) const
+{
+	return wakeup ? wakeup->GetFileDescriptor() : -1;
+}
+bool RPC3::UsesReliabilityLayer(void) const
+{
+	return wakeup!=0;
+}
+void RPC3::OnInternalPacket(InternalPacket *internalPacket, unsigned frameNumber, SystemAddress remoteSystemAddress, RakNet::TimeMS time, int isSend)
+{
+	(void) frameNumber;
+	(void) remoteSystemAddress;
+	(void) time;
+
+	// Runs on the network thread, for every message sent or received, including each part of a split message
+	if (isSend || wakeup==0)
+		return;
+	// Only the first part of a split message has its identifier and is counted, but any part can be the one completing it
+	if (internalPacket->splitPacketCount!=0 && internalPacket->splitPacketIndex!=0)
+	{
+		wakeup->Signal();
+		return;
+	}
+	unsigned int lengthInBytes = (unsigned int) BITS_TO_BYTES(internalPacket->dataBitLength);
+	unsigned int offset=0;
+	if (lengthInBytes > 0 && internalPacket->data[0]==ID_TIMESTAMP)
+		offset=sizeof(MessageID)+sizeof(RakNet::Time);
+	if (offset < lengthInBytes && internalPacket->data[offset]==ID_RPC_PLUGIN)
+	{
+		signalledMessages.fetch_add(1, std::memory_order_release);
+		wakeup->Signal();
+	}
+}
+void RPC3::ResetWakeup(void)
+{
+	uint32_t signalled = signalledMessages.load(std::memory_order_acquire);
+	if ((int32_t) (receivedMessages-signalled) < 0 || wakeRequested.load(std::memory_order_acquire))
+		return;
+	wakeup->Reset();
+	// Set again if the network thread or Wake() got in between
+	if (signalledMessages.load(std::memory_order_acquire)!=signalled || wakeRequested.load(std::memory_order_acquire))
+		wakeup->Signal();
+}
+void RPC3::ClearDeferredCalls(const SystemAddress &systemAddress)
+{
+	size_t kept=0;
+	size_t i;
+	for (i=0; i < deferredCalls.size(); i++)
+	{
+		DeferredCall &deferredCall = deferredCalls[i];
+		if (systemAddress!=RakNet::UNASSIGNED_SYSTEM_ADDRESS && deferredCall.systemAddress!=systemAddress)
+		{
+			if (kept!=i)
+				deferredCalls[kept]=deferredCall;
+			kept++;
+			continue;
+		}
+		_RPC3::ReleaseBitStream(deferredCall.parameters);
+		if (deferredCall.traceRecord)
+			RakNet::OP_DELETE(deferredCall.traceRecord, _FILE_AND_LINE_);
+	}
+	deferredCalls.resize(kept);
+}
+void RPC3::InterruptSignal(void)
+{
+	interruptSignal=true;
+}
+void RPC3::InvokeSignal(DataStructures::HashIndex functionIndex, RakNet::BitStream *serializedParameters, bool temporarilySetUSA)
+{
+	if (functionIndex.IsInvalid())
+		return;
+
+	InvokeSignal(localSlots.ItemAtIndex(functionIndex), localSlots.KeyAtIndex(functionIndex).C_String(), serializedParameters, temporarilySetUSA);
+}
+void RPC3::InvokeSignal(LocalSlot *localSlot, const char *sharedIdentifier, RakNet::BitStream *serializedParameters, bool temporarilySetUSA,
+	const void *localArgs, const std::type_info *localArgsType)
+{
+	if (localSlot==0)
+		return;
+
+	SystemAddress lastIncomingAddress=incomingSystemAddress;
+	if (temporarilySetUSA)
+		incomingSystemAddress=RakNet::UNASSIGNED_SYSTEM_ADDRESS;
+	interruptSignal=false;
+	unsigned int i;
+	// Every slot reads the same parameters, which do not necessarily start at the beginning of the stream
+	BitSize_t parametersOffset = serializedParameters->GetReadOffset();
+	_RPC3::InvokeArgs functionArgs;
+	functionArgs.bitStream=serializedParameters;
+	functionArgs.networkIDManager=networkIdManager;
+	functionArgs.caller=this;
+	functionArgs.thisPtrs=0;
+	functionArgs.thisPtrCount=0;
+	// A local signal reads the parameters just serialized for sending
+	if (temporarilySetUSA)
+		functionArgs.compactDeref = outgoingCall!=0 && outgoingCall->compactDeref;
+	else
+		functionArgs.compactDeref = incomingCompactDeref;
+	functionArgs.decodedTime = temporarilySetUSA ? 0 : incomingDecodedTime;
+	bool slotsRemoved=false;
+	for (i=0; i < localSlot->objects.Size(); i++)
+	{
+		if (localSlot->invokerIndices[i]==REMOVED_SLOT_INVOKER)
+			continue;
+		if (localSlot->objects[i]!=UNASSIGNED_NETWORK_ID)
+		{
+			functionArgs.thisPtr = GetObjectFromID(localSlot->objects[i]);
+			if (functionArgs.thisPtr==0)
+			{
+				// A shared registry is only read by the shards, which may not all have the object
+				if (sharedRegistry==0)
+				{
+					localSlot->invokerIndices[i]=REMOVED_SLOT_INVOKER;
+					slotsRemoved=true;
+				}
+				continue;
+			}
+		}
+		else
+			functionArgs.thisPtr=0;
+		const _RPC3::FunctionPointer &functionPointer = localSlot->invokers[localSlot->invokerIndices[i]]->functionPointer;
+		functionArgs.bitStream->SetReadOffset(parametersOffset);
+		// Slots taking the same types as the caller skip the parameters, which are then not necessarily serialized
+		functionArgs.localArgs = SameLocalArgsType(std::get<3>(functionPointer), localArgsType) ? localArgs : 0;
+		if (functionArgs.localArgs)
+			statistics.localInvocations++;
+
+		const std::function<_RPC3::InvokeResultCodes (_RPC3::InvokeArgs)> &functionPtr = std::get<1>(functionPointer);
+		if (functionPtr==0)
+		{
+			if (temporarilySetUSA==false)
+			{
+				// Failed - Function was previously registered, but isn't registered any longer
+				SendError(lastIncomingAddress, RPC_ERROR_FUNCTION_NO_LONGER_REGISTERED, sharedIdentifier);
+			}
+			break;
+		}
+		_RPC3::InvokeResultCodes res2 = functionPtr(std::ref(functionArgs));
+
+		// Not threadsafe
+		if (interruptSignal==true)
+			break;
+	}
+
+	// Removed after the loop, so slots keep their index while a handler runs
+	if (slotsRemoved)
+		localSlot->RemoveMarkedSlots();
+
+	if (temporarilySetUSA)
+		incomingSystemAddress=lastIncomingAddress;
+}
+
+RPC3::LocalDelivery RPC3::GetLocalDelivery(const char *uniqueIdentifier, bool isCall, const std::type_info *localArgsType)
+{
+	LocalDelivery delivery;
+	delivery.localFunction=0;
+	delivery.localSlot=0;
+	delivery.send=false;
+	delivery.result=outgoingBroadcast;
+
+	bool toThisSystem = outgoingBroadcast==false && IsLocalSystem(outgoingSystemAddress);
+	if (outgoingBroadcast)
+		delivery.send = rakPeerInterface!=0 && rakPeerInterface->NumberOfConnections() > 0;
+	else if (outgoingSystemAddress!=RakNet::UNASSIGNED_SYSTEM_ADDRESS && toThisSystem==false)
+		delivery.send=true;
+
+	if (isCall==false)
+	{
+		// The local slots below already run the signal once on this system
+		if (toThisSystem)
+			delivery.result=true;
+		delivery.localSlot = GetLocalSlot(uniqueIdentifier);
+		delivery.serialize=delivery.send;
+		unsigned int i;
+		for (i=0; delivery.localSlot && delivery.serialize==false && i < delivery.localSlot->invokers.Size(); i++)
+		{
+			if (SameLocalArgsType(std::get<3>(delivery.localSlot->invokers[i]->functionPointer), localArgsType)==false)
+				delivery.serialize=true;
+		}
+		return delivery;
+	}
+
+	if (toThisSystem)
+	{
+		LocalRPCFunction *localFunction = GetLocalFunction(uniqueIdentifier);
+		if (CanInvokeLocalCall(localFunction, localArgsType))
+		{
+			delivery.localFunction=localFunction;
+			delivery.result=true;
+		}
+		else
+		{
+			// RakNet loops the message back, and any error is reported as for a remote caller
+			delivery.send=true;
+		}
+	}
+	delivery.serialize=delivery.send;
+	return delivery;
+}
+
+bool RPC3::IsLocalSystem(const SystemAddress &systemAddress) const
+{
+	if (rakPeerInterface==0 || systemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS)
+		return false;
+	SystemAddress boundAddress = rakPeerInterface->GetInternalID(RakNet::UNASSIGNED_SYSTEM_ADDRESS);
+	if (systemAddress==boundAddress)
+		return true;
+	// Loopback and external addresses with our port are delivered to us by RakNet too
+	if (systemAddress.GetPort()!=boundAddress.GetPort())
+		return false;
+	return systemAddress.IsLoopback() || systemAddress==rakPeerInterface->GetExternalID(RakNet::UNASSIGNED_SYSTEM_ADDRESS);
+}
+
+bool RPC3::CanInvokeLocalCall(LocalRPCFunction *localFunction, const std::type_info *localArgsType)
+{
+	if (localFunction==0 || std::get<1>(localFunction->functionPointer)==0)
+		return false;
+	if (SameLocalArgsType(std::get<3>(localFunction->functionPointer), localArgsType)==false)
+		return false;
+	// Replies are only sent over the network
+	if (outgoingReplyId!=0)
+		return false;
+	bool isObjectMember = std::get<0>(localFunction->functionPointer);
+	if (isObjectMember!=(outgoingNetworkID!=UNASSIGNED_NETWORK_ID))
+		return false;
+	if (isObjectMember==false)
+		return true;
+	DataStructures::List<NetworkIDObject*> targetObjects;
+	return GetLocalTargets(targetObjects);
+}
+
+bool RPC3::GetLocalTargets(DataStructures::List<NetworkIDObject*> &targetObjects)
+{
+	if (networkIdManager==0)
+		return false;
+	unsigned int count = outgoingNetworkIDCount > 1 ? outgoingNetworkIDCount : 1;
+	targetObjects.Preallocate(count, _FILE_AND_LINE_);
+	unsigned int i;
+	for (i=0; i < count; i++)
+	{
+		NetworkIDObject *targetObject = GetObjectFromID(outgoingNetworkIDCount > 1 ? outgoingNetworkIDs[i] : outgoingNetworkID);
+		if (targetObject==0)
+			return false;
+		targetObjects.Insert(targetObject, _FILE_AND_LINE_);
+	}
+	return true;
+}
+
+void RPC3::InvokeLocalCall(LocalRPCFunction *localFunction, const void *localArgs)
+{
+	_RPC3::InvokeArgs functionArgs;
+	functionArgs.bitStream=0;
+	functionArgs.networkIDManager=networkIdManager;
+	functionArgs.caller=this;
+	functionArgs.thisPtr=0;
+	functionArgs.thisPtrs=0;
+	functionArgs.thisPtrCount=0;
+	functionArgs.compactDeref=false;
+	functionArgs.localArgs=localArgs;
+	functionArgs.decodedTime=0;
+
+	DataStructures::List<NetworkIDObject*> targetObjects;
+	if (std::get<0>(localFunction->functionPointer))
+	{
+		if (GetLocalTargets(targetObjects)==false)
+			return;
+		functionArgs.thisPtr=targetObjects[0];
+		if (outgoingNetworkIDCount > 1)
+		{
+			functionArgs.thisPtrs=&targetObjects[0];
+			functionArgs.thisPtrCount=targetObjects.Size();
+		}
+	}
+
+	// Seen by the handler as a call received from this system
+	SystemAddress lastIncomingAddress=incomingSystemAddress;
+	RakNet::Time lastIncomingTimeStamp=incomingTimeStamp;
+	uint32_t lastIncomingReplyId=incomingReplyId;
+	incomingSystemAddress=outgoingSystemAddress;
+	incomingTimeStamp=outgoingTimestamp;
+	incomingReplyId=0;
+	statistics.localInvocations++;
+
+	std::get<1>(localFunction->functionPointer)(functionArgs);
+
+	incomingSystemAddress=lastIncomingAddress;
+	incomingTimeStamp=lastIncomingTimeStamp;
+	incomingReplyId=lastIncomingReplyId;
+}
+
+
+void RPC3::OnNewConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, bool isIncoming)
+{
+	(void) rakNetGUID;
+	(void) isIncoming;
+
+	GetRemoteSystem(systemAddress);
+	if (shardGroup)
+		shardGroup->OnShardConnection(shardIndex, systemAddress, rakNetGUID);
+	if (compactHeaderEnabled)
+		SendHandshake(systemAddress);
+}
+
+void RPC3::OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason )
+{
+	RemoteSystem *remoteSystem;
+	if (remoteSystems.Pop(remoteSystem, systemAddress, _FILE_AND_LINE_))
+		RakNet::OP_DELETE(remoteSystem,_FILE_AND_LINE_);
+	if (shardGroup)
+		shardGroup->OnShardDisconnection(shardIndex, rakNetGUID);
+	FailPendingReplies(systemAddress);
+	ClearDeferredCalls(systemAddress);
+	ClearStreams(systemAddress, true);
 }
 
 void RPC3::OnShutdown(void)
 {
 	// Not needed, and if the user calls Shutdown inadvertantly, it unregisters his functions
 	// Clear();
+	ClearRemoteSystems();
+	if (shardGroup)
+		shardGroup->OnShardShutdown(shardIndex);
+	FailPendingReplies(RakNet::UNASSIGNED_SYSTEM_ADDRESS);
+	ClearDeferredCalls(RakNet::UNASSIGNED_SYSTEM_ADDRESS);
+	ClearStreams(RakNet::UNASSIGNED_SYSTEM_ADDRESS, true);
+}
+
+void RPC3::OnRakPeerShutdown(void)
+{
+	OnShutdown();
+}
+
+void RPC3::Update(void)
+{
+	if (wakeup)
+	{
+		wakeRequested.store(false, std::memory_order_release);
+		uint32_t signalled = signalledMessages.load(std::memory_order_acquire);
+		if ((int32_t) (receivedMessages-signalled) < 0)
+		{
+			RakNet::TimeMS time = RakNet::GetTimeMS();
+			if (wakeupStalled==false || wakeupStallCount!=receivedMessages)
+			{
+				wakeupStalled=true;
+				wakeupStallCount=receivedMessages;
+				wakeupStallTime=time;
+			}
+			else if (time-wakeupStallTime >= WAKEUP_STALL_TIME)
+				receivedMessages=signalled;
+		}
+		else
+			wakeupStalled=false;
+		ResetWakeup();
+	}
+
+	if (shardGroup)
+		shardGroup->RunPostedCalls(shardIndex);
+
+	if (errorReportSystems.Size() > 0 && RakNet::GetTimeMS()-lastErrorReportTime >= errorReportInterval)
+		SendErrorReports();
+
+	// Handlers of the calls received since the last update had their chance to keep the streams
+	if (incomingStreams.size() > 0)
+		ReleaseUnusedStreams();
+
+	if (replyTimeout==0)
+		return;
+	// Reply ids grow with time, so the oldest calls are at the front
+	RakNet::TimeMS time = RakNet::GetTimeMS();
+	while (pendingReplies.Size() > 0 && time - pendingReplies[0]->sendTime >= replyTimeout)
+	{
+		PendingReply *pendingReply = pendingReplies[0];
+		pendingReplies.RemoveAtIndex(0);
+		CompletePendingReply(pendingReply, RPC3_REPLY_TIMEOUT, 0);
+	}
 }
 
 void RPC3::Clear(void)
@@ -438,17 +1984,83 @@ void RPC3::Clear(void)
 		RakNet::OP_DELETE(outputList2[j],_FILE_AND_LINE_);
 	}
 	localFunctions.Clear(_FILE_AND_LINE_);
+	ThawRegistry();
+	ClearRemoteSystems();
+	ClearPendingReplies();
+	ClearDeferredCalls(RakNet::UNASSIGNED_SYSTEM_ADDRESS);
+	ClearStreams(RakNet::UNASSIGNED_SYSTEM_ADDRESS, false);
+	internedStrings.Clear(false, _FILE_AND_LINE_);
+	internedStringIndices.Clear(_FILE_AND_LINE_);
 	outgoingExtraData.Reset();
 	incomingExtraData.Reset();
 }
 
+void RPC3::CaptureMessage(const SystemAddress &systemAddress, RakNet::Time timestamp, unsigned char *data, unsigned int lengthInBytes)
+{
+	// The identifier is stored next to the raw message, so logs can be filtered without decoding them
+	CallHeader header;
+	RakNet::BitStream bs(data,lengthInBytes,false);
+	if (ReadCallHeader(&bs, &header)==false)
+		header.identifier[0]=0;
+
+	char address[128];
+	systemAddress.ToString(true, address, '|');
+
+	_RPC3::CaptureRecord record;
+	record.receiveTime=RakNet::GetTimeUS()-captureStartTime;
+	record.senderTimestamp=timestamp;
+	record.senderAddress=address;
+	record.identifier=header.identifier;
+	record.payload=data;
+	record.payloadBytes=lengthInBytes;
+	captureLog->Append(record);
+}
+
 void RPC3::SendError(SystemAddress target, unsigned char errorCode, const char *functionName)
 {
-	RakNet::BitStream bs;
-	bs.Write((MessageID)ID_RPC_REMOTE_ERROR);
-	bs.Write(errorCode);
-	bs.WriteAlignedBytes((const unsigned char*) functionName,(const unsigned int) strlen(functionName)+1);
-	SendUnified(&bs, HIGH_PRIORITY, RELIABLE_ORDERED, 0, target, false);
+	statistics.reportedErrors++;
+	if (errorReportInterval==0 || QueueErrorReport(target, errorCode, functionName, 0)==false)
+	{
+		RakNet::BitStream bs;
+		bs.Write((MessageID)ID_RPC_REMOTE_ERROR);
+		bs.Write(errorCode);
+		bs.WriteAlignedBytes((const unsigned char*) functionName,(const unsigned int) strlen(functionName)+1);
+		SendUnified(&bs, HIGH_PRIORITY, RELIABLE_ORDERED, 0, target, false);
+		statistics.errorReportsSent++;
+	}
+
+	// A caller waiting for a reply learns about the error as well
+	SendErrorReply(target, errorCode);
+}
+
+void RPC3::SendErrorReply(const SystemAddress &target, unsigned char errorCode)
+{
+	if (incomingReplyId==0)
+		return;
+	RPC3ReplyToken replyToken;
+	replyToken.systemAddress=target;
+	replyToken.replyId=incomingReplyId;
+	incomingReplyId=0;
+	RakNet::BitStream reply;
+	reply.Write((unsigned char) RPC3_REPLY_REMOTE_ERROR);
+	reply.Write(errorCode);
+	SendReply(replyToken, &reply);
+}
+
+bool RPC3::IsCallExpired(const CallHeader &header, RakNet::Time senderTimestamp)
+{
+	if (senderTimestamp==0)
+		return false;
+	RakNet::Time maxAge = header.maxAge;
+	RPC3 *registry = sharedRegistry ? sharedRegistry : this;
+	if (registry->handlerMaxAges.Size() > 0)
+	{
+		DataStructures::HashIndex index = registry->handlerMaxAges.GetIndexOf(header.identifier);
+		if (index.IsInvalid()==false && (maxAge==0 || registry->handlerMaxAges.ItemAtIndex(index) < maxAge))
+			maxAge=registry->handlerMaxAges.ItemAtIndex(index);
+	}
+	// RakNet converted the timestamp to our clock, but a sender ahead of the estimate can still look like it sent from the future
+	return maxAge!=0 && incomingReceiveTime > senderTimestamp && incomingReceiveTime - senderTimestamp > maxAge;
 }
 
 DataStructures::HashIndex RPC3::GetLocalSlotIndex(const char *sharedIdentifier)
@@ -457,5 +2069,946 @@ DataStructures::HashIndex RPC3::GetLocalSlotIndex(const char *sharedIdentifier)
 }
 DataStructures::HashIndex RPC3::GetLocalFunctionIndex(RPC3::RPCIdentifier identifier)
 {
-	return localFunctions.GetIndexOf(identifier.C_String());
+	return localFunctions.GetIndexOf(identifier);
+}
+RPC3::LocalRPCFunction *RPC3::GetLocalFunction(const char *uniqueIdentifier)
+{
+	if (sharedRegistry)
+		return sharedRegistry->frozenFunctions.Get(uniqueIdentifier);
+	if (registryFrozen)
+		return frozenFunctions.Get(uniqueIdentifier);
+	DataStructures::HashIndex idx = localFunctions.GetIndexOf(uniqueIdentifier);
+	if (idx.IsInvalid())
+		return 0;
+	return localFunctions.ItemAtIndex(idx);
+}
+RPC3::LocalSlot *RPC3::GetLocalSlot(const char *sharedIdentifier)
+{
+	if (sharedRegistry)
+		return sharedRegistry->frozenSlots.Get(sharedIdentifier);
+	if (registryFrozen)
+		return frozenSlots.Get(sharedIdentifier);
+	DataStructures::HashIndex idx = localSlots.GetIndexOf(sharedIdentifier);
+	if (idx.IsInvalid())
+		return 0;
+	return localSlots.ItemAtIndex(idx);
+}
+RPC3::LocalSlot *RPC3::AddLocalSlot(const char *sharedIdentifier)
+{
+	DataStructures::HashIndex idx = localSlots.GetIndexOf(sharedIdentifier);
+	if (idx.IsInvalid()==false)
+		return localSlots.ItemAtIndex(idx);
+	ThawRegistry();
+	LocalSlot *localSlot = RakNet::OP_NEW<LocalSlot>(_FILE_AND_LINE_);
+	localSlots.Push(sharedIdentifier, localSlot,_FILE_AND_LINE_);
+	return localSlot;
+}
+RPC3::RemoteSystem *RPC3::GetRemoteSystem(const SystemAddress &systemAddress)
+{
+	RemoteSystem **existing = remoteSystems.Peek(systemAddress);
+	if (existing)
+		return *existing;
+	RemoteSystem *remoteSystem = RakNet::OP_NEW<RemoteSystem>(_FILE_AND_LINE_);
+	remoteSystems.Push(systemAddress, remoteSystem, _FILE_AND_LINE_);
+	return remoteSystem;
+}
+RPC3::RemoteSystem *RPC3::GetCompactRemoteSystem(const SystemAddress &systemAddress)
+{
+	RemoteSystem **remoteSystem = remoteSystems.Peek(systemAddress);
+	if (remoteSystem==0 || compactHeaderEnabled==false || (*remoteSystem)->protocolVersion < RPC3_PROTOCOL_COMPACT)
+		return 0;
+	return *remoteSystem;
+}
+BitSize_t RPC3::GetParameterBitsEstimate(const char *uniqueIdentifier) const
+{
+	const ParameterBitsEstimate &estimate = parameterBitsEstimates[((size_t) uniqueIdentifier >> 3) % PARAMETER_BITS_ESTIMATES];
+	return estimate.uniqueIdentifier==uniqueIdentifier ? estimate.bits : 0;
+}
+void RPC3::UpdateParameterBitsEstimate(const char *uniqueIdentifier, BitSize_t bitsUsed)
+{
+	ParameterBitsEstimate &estimate = parameterBitsEstimates[((size_t) uniqueIdentifier >> 3) % PARAMETER_BITS_ESTIMATES];
+	if (estimate.uniqueIdentifier!=uniqueIdentifier)
+	{
+		estimate.uniqueIdentifier=uniqueIdentifier;
+		estimate.bits=bitsUsed;
+	}
+	else if (bitsUsed >= estimate.bits)
+		estimate.bits=bitsUsed;
+	else
+	{
+		// Follow a shrinking size slowly, so one small call does not undersize the next large one
+		estimate.bits-=(estimate.bits-bitsUsed)/8;
+	}
+}
+uint32_t RPC3::GetRecipientFeatures(void)
+{
+	if (outgoingCall && outgoingCall->recipientFeaturesKnown)
+		return outgoingCall->recipientFeatures;
+
+	// Local slots read with this plugin, which supports everything
+	uint32_t features=0xFFFFFFFF;
+	RemoteSystem *remoteSystem;
+	if (outgoingBroadcast)
+	{
+		unsigned systemIndex;
+		for (systemIndex=0; systemIndex < rakPeerInterface->GetMaximumNumberOfPeers() && features!=0; systemIndex++)
+		{
+			SystemAddress systemAddr=rakPeerInterface->GetSystemAddressFromIndex(systemIndex);
+			if (systemAddr!=RakNet::UNASSIGNED_SYSTEM_ADDRESS && systemAddr!=outgoingSystemAddress)
+			{
+				remoteSystem = GetCompactRemoteSystem(systemAddr);
+				features &= remoteSystem ? remoteSystem->features : 0;
+			}
+		}
+	}
+	else if (outgoingSystemAddress!=RakNet::UNASSIGNED_SYSTEM_ADDRESS)
+	{
+		remoteSystem = GetCompactRemoteSystem(outgoingSystemAddress);
+		features = remoteSystem ? remoteSystem->features : 0;
+	}
+
+	if (outgoingCall)
+	{
+		outgoingCall->recipientFeatures=features;
+		outgoingCall->recipientFeaturesKnown=true;
+	}
+	return features;
+}
+bool RPC3::CanUseCompactDeref(void)
+{
+	return outgoingCall!=0 && (GetRecipientFeatures() & RPC3_FEATURE_COMPACT_DEREF)!=0;
+}
+bool RPC3::InternString(const RakNet::RakString &string, unsigned int *index)
+{
+	if (string.GetLength() > RPC3_MAX_INTERNED_STRING_LENGTH)
+		return false;
+	unsigned int *existing = internedStringIndices.Peek(string);
+	if (existing)
+	{
+		*index=*existing;
+		return true;
+	}
+	if (internedStrings.Size() >= internedStringLimit)
+		return false;
+	*index=internedStrings.Size();
+	internedStrings.Insert(string, _FILE_AND_LINE_);
+	internedStringIndices.Push(string, *index, _FILE_AND_LINE_);
+	return true;
+}
+void RPC3::WriteInternedString(RakNet::BitStream &bitStream, const RakNet::RakString &string)
+{
+	// 0 is followed by the string itself, anything else is the index plus one
+	unsigned int index;
+	if (outgoingCall==0 || (GetRecipientFeatures() & RPC3_FEATURE_INTERNED_STRINGS)==0 || InternString(string, &index)==false)
+	{
+		_RPC3::WriteVarInt(bitStream, 0);
+		bitStream.Write(string);
+		return;
+	}
+	_RPC3::WriteVarInt(bitStream, (uint64_t) index+1);
+	if (outgoingCall->internedIds.GetIndexOf(index)==MAX_UNSIGNED_LONG)
+		outgoingCall->internedIds.Insert(index, _FILE_AND_LINE_);
+}
+bool RPC3::ReadInternedString(RakNet::BitStream &bitStream, RakNet::RakString &string)
+{
+	uint64_t index;
+	if (_RPC3::ReadVarInt(bitStream, index)==false)
+		return false;
+	if (index==0)
+		return bitStream.Read(string);
+	index--;
+	if (incomingSystemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS)
+	{
+		// Local signal, the parameters were written with our own table
+		if (index >= internedStrings.Size())
+			return false;
+		string=internedStrings[(unsigned int) index];
+		return true;
+	}
+	RemoteSystem **remoteSystem = remoteSystems.Peek(incomingSystemAddress);
+	if (remoteSystem==0 || index >= (*remoteSystem)->receivedStrings.Size())
+	{
+		string.Clear();
+		return false;
+	}
+	string=(*remoteSystem)->receivedStrings[(unsigned int) index];
+	return true;
+}
+void RPC3::OnStringDefinitions(const SystemAddress &systemAddress, const CallHeader &header)
+{
+	RemoteSystem *remoteSystem = GetRemoteSystem(systemAddress);
+	unsigned int i;
+	for (i=0; i < header.stringDefinitions.Size(); i++)
+	{
+		const StringDefinition &definition = header.stringDefinitions[i];
+		while (remoteSystem->receivedStrings.Size() <= definition.index)
+			remoteSystem->receivedStrings.Insert(RakNet::RakString(), _FILE_AND_LINE_);
+		remoteSystem->receivedStrings[definition.index]=definition.string;
+	}
+}
+void RPC3::SendHandshake(const SystemAddress &systemAddress)
+{
+	// Sent as an ordinary legacy call, so the original plugin answers with RPC_ERROR_FUNCTION_NOT_REGISTERED instead of misreading it
+	RakNet::BitStream parameters;
+	parameters.Write((unsigned char) RPC3_PROTOCOL_COMPACT);
+	parameters.Write((uint32_t) (RPC3_FEATURE_COMPRESSION | RPC3_FEATURE_REPLIES | RPC3_FEATURE_MULTI_TARGET | RPC3_FEATURE_INTERNED_STRINGS | RPC3_FEATURE_COMPACT_DEREF | RPC3_FEATURE_ALIGNED_PARAMETERS | RPC3_FEATURE_TRACE | RPC3_FEATURE_MAX_AGE | RPC3_FEATURE_STREAMS));
+
+	RakNet::BitStream bs;
+	bs.Write((MessageID)ID_RPC_PLUGIN);
+	NetworkID lastNetworkID = outgoingNetworkID;
+	outgoingNetworkID = UNASSIGNED_NETWORK_ID;
+	bool parametersLeftOut = WriteCallOrSignal(&bs, RPC3_HANDSHAKE_IDENTIFIER, 2, &parameters, true, 0, 0);
+	outgoingNetworkID = lastNetworkID;
+	SendCallOrSignalMessage(&bs, parametersLeftOut, &parameters, 0, HIGH_PRIORITY, RELIABLE_ORDERED, 0, systemAddress);
+}
+void RPC3::OnHandshake(const SystemAddress &systemAddress, RakNet::BitStream *parameters)
+{
+	unsigned char protocolVersion;
+	if (parameters->Read(protocolVersion)==false)
+		return;
+	if (protocolVersion > RPC3_PROTOCOL_COMPACT)
+		protocolVersion = RPC3_PROTOCOL_COMPACT;
+	// Optional, a peer announcing only the protocol version reads no optional features
+	uint32_t features;
+	if (parameters->Read(features)==false)
+		features=0;
+	RemoteSystem *remoteSystem = GetRemoteSystem(systemAddress);
+	remoteSystem->protocolVersion=protocolVersion;
+	remoteSystem->features=features;
+}
+void RPC3::SendObjectsMissingError(const SystemAddress &target, const char *functionName, const DataStructures::List<NetworkID> &missingIds)
+{
+	statistics.reportedErrors++;
+	if (errorReportInterval!=0 && QueueErrorReport(target, RPC_ERROR_OBJECTS_DO_NOT_EXIST, functionName, &missingIds))
+		return;
+	RakNet::BitStream bs;
+	bs.Write((MessageID)ID_RPC_REMOTE_ERROR);
+	bs.Write((unsigned char) RPC_ERROR_OBJECTS_DO_NOT_EXIST);
+	bs.WriteAlignedBytes((const unsigned char*) functionName,(const unsigned int) strlen(functionName)+1);
+	bs.Write((uint32_t) missingIds.Size());
+	unsigned int i;
+	for (i=0; i < missingIds.Size(); i++)
+		bs.Write(missingIds[i]);
+	SendUnified(&bs, HIGH_PRIORITY, RELIABLE_ORDERED, 0, target, false);
+	statistics.errorReportsSent++;
+}
+bool RPC3::QueueErrorReport(const SystemAddress &target, unsigned char errorCode, const char *functionName, const DataStructures::List<NetworkID> *missingIds)
+{
+	RemoteSystem **existing = remoteSystems.Peek(target);
+	if (existing==0)
+		return false;
+	RemoteSystem *remoteSystem = *existing;
+	DataStructures::List<ErrorReport> &errorReports = remoteSystem->errorReports;
+	unsigned int index = remoteSystem->lastErrorReport;
+	if (index >= errorReports.Size() || errorReports[index].errorCode!=errorCode || strcmp(errorReports[index].functionName.C_String(), functionName)!=0)
+	{
+		// At most maxErrorReports entries, so a linear search is enough
+		for (index=0; index < errorReports.Size(); index++)
+		{
+			if (errorReports[index].errorCode==errorCode && strcmp(errorReports[index].functionName.C_String(), functionName)==0)
+				break;
+		}
+		if (index==errorReports.Size())
+		{
+			if (errorReports.Size() >= maxErrorReports)
+			{
+				statistics.errorReportsDropped++;
+				return true;
+			}
+			if (errorReports.Size()==0)
+				errorReportSystems.Insert(target, _FILE_AND_LINE_);
+			ErrorReport errorReport;
+			errorReport.errorCode=errorCode;
+			errorReport.functionName=functionName;
+			errorReport.callCount=0;
+			errorReports.Insert(errorReport, _FILE_AND_LINE_);
+		}
+		remoteSystem->lastErrorReport=index;
+	}
+	ErrorReport &errorReport = errorReports[index];
+	errorReport.callCount++;
+	if (missingIds)
+	{
+		unsigned int i, j;
+		for (i=0; i < missingIds->Size() && errorReport.missingIds.Size() < RPC3_MAX_ERROR_REPORT_OBJECTS; i++)
+		{
+			for (j=0; j < errorReport.missingIds.Size(); j++)
+			{
+				if (errorReport.missingIds[j]==(*missingIds)[i])
+					break;
+			}
+			if (j==errorReport.missingIds.Size())
+				errorReport.missingIds.Insert((*missingIds)[i], _FILE_AND_LINE_);
+		}
+	}
+	return true;
+}
+void RPC3::SendErrorReports(void)
+{
+	RakNet::BitStream bs;
+	unsigned int i, j, k;
+	for (i=0; i < errorReportSystems.Size(); i++)
+	{
+		// The system may have disconnected since
+		RemoteSystem **remoteSystem = remoteSystems.Peek(errorReportSystems[i]);
+		if (remoteSystem==0)
+			continue;
+		DataStructures::List<ErrorReport> &errorReports = (*remoteSystem)->errorReports;
+		for (j=0; j < errorReports.Size(); j++)
+		{
+			const ErrorReport &errorReport = errorReports[j];
+			bs.Reset();
+			bs.Write((MessageID)ID_RPC_REMOTE_ERROR);
+			bs.Write(errorReport.errorCode);
+			bs.WriteAlignedBytes((const unsigned char*) errorReport.functionName.C_String(),(const unsigned int) strlen(errorReport.functionName.C_String())+1);
+			if (errorReport.errorCode==RPC_ERROR_OBJECTS_DO_NOT_EXIST)
+			{
+				bs.Write((uint32_t) errorReport.missingIds.Size());
+				for (k=0; k < errorReport.missingIds.Size(); k++)
+					bs.Write(errorReport.missingIds[k]);
+			}
+			else
+				bs.Write(errorReport.callCount);
+			// Unreliable, as a later report says the same again
+			SendUnified(&bs, HIGH_PRIORITY, UNRELIABLE, 0, errorReportSystems[i], false);
+			statistics.errorReportsSent++;
+		}
+		errorReports.Clear(false, _FILE_AND_LINE_);
+		(*remoteSystem)->lastErrorReport=0;
+	}
+	errorReportSystems.Clear(true, _FILE_AND_LINE_);
+	lastErrorReportTime=RakNet::GetTimeMS();
+}
+RPC3ReplyToken RPC3::GetReplyToken(void) const
+{
+	RPC3ReplyToken replyToken;
+	if (incomingReplyId!=0)
+	{
+		replyToken.systemAddress=incomingSystemAddress;
+		replyToken.replyId=incomingReplyId;
+	}
+	return replyToken;
+}
+void RPC3::SetReplyTimeout(RakNet::TimeMS timeoutMS)
+{
+	replyTimeout=timeoutMS;
+}
+bool RPC3::BeginCallWithReply(const ReplyCallback &callback)
+{
+	SystemAddress systemAddress = outgoingSystemAddress;
+	if (outgoingBroadcast)
+	{
+		// Broadcasting is fine as long as it reaches exactly one system
+		systemAddress = RakNet::UNASSIGNED_SYSTEM_ADDRESS;
+		unsigned systemIndex;
+		for (systemIndex=0; rakPeerInterface && systemIndex < rakPeerInterface->GetMaximumNumberOfPeers(); systemIndex++)
+		{
+			SystemAddress candidate = rakPeerInterface->GetSystemAddressFromIndex(systemIndex);
+			if (candidate==RakNet::UNASSIGNED_SYSTEM_ADDRESS || candidate==outgoingSystemAddress)
+				continue;
+			if (systemAddress!=RakNet::UNASSIGNED_SYSTEM_ADDRESS)
+			{
+				systemAddress = RakNet::UNASSIGNED_SYSTEM_ADDRESS;
+				break;
+			}
+			systemAddress = candidate;
+		}
+	}
+
+	RemoteSystem *remoteSystem = systemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS ? 0 : GetCompactRemoteSystem(systemAddress);
+	if (remoteSystem==0 || (remoteSystem->features & RPC3_FEATURE_REPLIES)==0)
+	{
+		callback(RPC3_REPLY_NOT_SENT, 0);
+		return false;
+	}
+
+	PendingReply *pendingReply = RakNet::OP_NEW<PendingReply>(_FILE_AND_LINE_);
+	pendingReply->replyId=nextReplyId++;
+	if (nextReplyId==0)
+		nextReplyId=1;
+	pendingReply->systemAddress=systemAddress;
+	pendingReply->sendTime=RakNet::GetTimeMS();
+	pendingReply->callback=callback;
+	pendingReplies.Insert(pendingReply->replyId, pendingReply, true, _FILE_AND_LINE_);
+
+	outgoingReplyId=pendingReply->replyId;
+	outgoingSystemAddress=systemAddress;
+	outgoingBroadcast=false;
+	return true;
+}
+void RPC3::EndCallWithReply(bool sent)
+{
+	uint32_t replyId = outgoingReplyId;
+	outgoingReplyId=0;
+	if (sent)
+		return;
+	bool objectExists;
+	unsigned int index = pendingReplies.GetIndexFromKey(replyId, &objectExists);
+	if (objectExists)
+	{
+		PendingReply *pendingReply = pendingReplies[index];
+		pendingReplies.RemoveAtIndex(index);
+		CompletePendingReply(pendingReply, RPC3_REPLY_NOT_SENT, 0);
+	}
+}
+bool RPC3::SendReply(const RPC3ReplyToken &replyToken, RakNet::BitStream *parameters)
+{
+	if (replyToken.IsValid()==false)
+		return false;
+	RemoteSystem *remoteSystem = GetCompactRemoteSystem(replyToken.systemAddress);
+	if (remoteSystem==0 || (remoteSystem->features & RPC3_FEATURE_REPLIES)==0)
+		return false;
+
+	CompressedParameters compressedParameters;
+	bool compressionUsed = (remoteSystem->features & RPC3_FEATURE_COMPRESSION) && CompressParameters(RPC3_REPLY_IDENTIFIER, parameters, &compressedParameters);
+
+	RakNet::BitStream bs;
+	bs.Write((MessageID)ID_RPC_PLUGIN);
+	NetworkID lastNetworkID = outgoingNetworkID;
+	uint32_t lastReplyId = outgoingReplyId;
+	RakNet::Time lastMaxAge = outgoingMaxAge;
+	outgoingNetworkID = UNASSIGNED_NETWORK_ID;
+	outgoingReplyId = replyToken.replyId;
+	// Replies have no ID_TIMESTAMP
+	outgoingMaxAge = 0;
+	bool parametersLeftOut = WriteCallOrSignal(&bs, RPC3_REPLY_IDENTIFIER, 1, parameters, true, remoteSystem, compressionUsed ? &compressedParameters : 0);
+	outgoingNetworkID = lastNetworkID;
+	outgoingReplyId = lastReplyId;
+	outgoingMaxAge = lastMaxAge;
+	SendCallOrSignalMessage(&bs, parametersLeftOut, parameters, compressionUsed ? &compressedParameters : 0, outgoingPriority, outgoingReliability, outgoingOrderingChannel, replyToken.systemAddress);
+	return true;
+}
+void RPC3::OnReply(const SystemAddress &systemAddress, uint32_t replyId, RakNet::BitStream *parameters)
+{
+	bool objectExists;
+	unsigned int index = pendingReplies.GetIndexFromKey(replyId, &objectExists);
+	// Unknown ids belong to calls that already timed out
+	if (objectExists==false || pendingReplies[index]->systemAddress!=systemAddress)
+		return;
+	PendingReply *pendingReply = pendingReplies[index];
+	pendingReplies.RemoveAtIndex(index);
+
+	unsigned char status;
+	if (parameters->Read(status)==false || status!=RPC3_REPLY_OK)
+		status=RPC3_REPLY_REMOTE_ERROR;
+	CompletePendingReply(pendingReply, (RPC3ReplyStatus) status, parameters);
+}
+void RPC3::CompletePendingReply(PendingReply *pendingReply, RPC3ReplyStatus status, RakNet::BitStream *reply)
+{
+	// The callback may start new calls, so it runs after the bookkeeping is done
+	ReplyCallback callback;
+	callback.swap(pendingReply->callback);
+	RakNet::OP_DELETE(pendingReply,_FILE_AND_LINE_);
+	callback(status, reply);
+}
+void RPC3::FailPendingReplies(const SystemAddress &systemAddress)
+{
+	DataStructures::List<PendingReply*> failed;
+	unsigned int i=0;
+	while (i < pendingReplies.Size())
+	{
+		if (systemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS || pendingReplies[i]->systemAddress==systemAddress)
+		{
+			failed.Insert(pendingReplies[i], _FILE_AND_LINE_);
+			pendingReplies.RemoveAtIndex(i);
+		}
+		else
+			i++;
+	}
+	for (i=0; i < failed.Size(); i++)
+		CompletePendingReply(failed[i], RPC3_REPLY_DISCONNECTED, 0);
+}
+void RPC3::ClearPendingReplies(void)
+{
+	// Used on destruction, where running callbacks could reach back into a dying plugin
+	unsigned int i;
+	for (i=0; i < pendingReplies.Size(); i++)
+		RakNet::OP_DELETE(pendingReplies[i],_FILE_AND_LINE_);
+	pendingReplies.Clear(false, _FILE_AND_LINE_);
+}
+void RPC3::ClearRemoteSystems(void)
+{
+	unsigned j;
+	DataStructures::List<SystemAddress> keyList;
+	DataStructures::List<RemoteSystem*> outputList;
+	remoteSystems.GetAsList(outputList,keyList,_FILE_AND_LINE_);
+	for (j=0; j < outputList.Size(); j++)
+	{
+		RakNet::OP_DELETE(outputList[j],_FILE_AND_LINE_);
+	}
+	remoteSystems.Clear(_FILE_AND_LINE_);
+	errorReportSystems.Clear(false, _FILE_AND_LINE_);
+}
+void RPC3::WriteStream(RakNet::BitStream &bitStream, const _RPC3::Stream &stream)
+{
+	// Only bytes held can be sent on, so a stream whose chunk handler took them is sent empty
+	const _RPC3::StreamState *state = stream.state.get();
+	bool hasData = state!=0 && state->status==_RPC3::STREAM_COMPLETE && state->data.size()==state->length;
+	if (hasData==false || state->length <= streamChunkBytes || outgoingCall==0 || (GetRecipientFeatures() & RPC3_FEATURE_STREAMS)==0)
+	{
+		_RPC3::WriteStream(0, bitStream, stream);
+		return;
+	}
+	if (++nextStreamId==0)
+		nextStreamId=1;
+	OutgoingStream outgoingStream;
+	outgoingStream.state=stream.state;
+	outgoingStream.id=nextStreamId;
+	outgoingCall->streams.push_back(outgoingStream);
+	bitStream.Write(true);
+	_RPC3::WriteVarInt(bitStream, nextStreamId);
+}
+bool RPC3::ReadStream(RakNet::BitStream &bitStream, _RPC3::Stream &stream)
+{
+	bool streamed;
+	uint64_t value;
+	if (bitStream.Read(streamed) && _RPC3::ReadVarInt(bitStream, value))
+	{
+		if (streamed==false)
+		{
+			// Every byte takes 8 bits, which bounds the length before anything is allocated
+			if (value > bitStream.GetNumberOfUnreadBits()/8)
+				value=0;
+			stream.state=std::make_shared<_RPC3::StreamState>();
+			stream.state->data.resize((size_t) value);
+			if (value > 0)
+				bitStream.Read((char*) &stream.state->data[0], (unsigned int) value);
+			stream.state->length=(uint32_t) value;
+			stream.state->received=(uint32_t) value;
+			return true;
+		}
+		size_t i;
+		if (incomingSystemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS)
+		{
+			// Local slots read the stream of the call being sent
+			for (i=0; outgoingCall && i < outgoingCall->streams.size(); i++)
+			{
+				if (outgoingCall->streams[i].id==value)
+				{
+					stream.state=outgoingCall->streams[i].state;
+					return true;
+				}
+			}
+		}
+		else
+		{
+			for (i=0; i < incomingStreams.size(); i++)
+			{
+				if (incomingStreams[i].id==value && incomingStreams[i].systemAddress==incomingSystemAddress)
+				{
+					stream.state=incomingStreams[i].state;
+					return true;
+				}
+			}
+		}
+	}
+	stream.state=std::make_shared<_RPC3::StreamState>();
+	stream.state->status=_RPC3::STREAM_CANCELLED;
+	return false;
+}
+void RPC3::OnStreamDefinitions(const SystemAddress &systemAddress, const CallHeader &header)
+{
+	unsigned int i;
+	for (i=0; i < header.streams.Size(); i++)
+	{
+		const StreamDefinition &definition = header.streams[i];
+		size_t j;
+		for (j=0; j < incomingStreams.size(); j++)
+		{
+			if (incomingStreams[j].id==definition.id && incomingStreams[j].systemAddress==systemAddress)
+				break;
+		}
+		if (j < incomingStreams.size() || definition.length==0)
+			continue;
+		IncomingStream incomingStream;
+		incomingStream.state=std::make_shared<_RPC3::StreamState>();
+		incomingStream.state->length=definition.length;
+		incomingStream.state->status=_RPC3::STREAM_RECEIVING;
+		incomingStream.state->incoming=true;
+		incomingStream.state->rpc=this;
+		incomingStream.id=definition.id;
+		incomingStream.systemAddress=systemAddress;
+		incomingStreams.push_back(incomingStream);
+	}
+}
+void RPC3::AddOutgoingStreams(const SystemAddress &systemAddress, PacketPriority priority, char orderingChannel)
+{
+	size_t i;
+	for (i=0; i < outgoingCall->streams.size(); i++)
+	{
+		OutgoingStream outgoingStream = outgoingCall->streams[i];
+		outgoingStream.systemAddress=systemAddress;
+		outgoingStream.priority=priority;
+		outgoingStream.orderingChannel=orderingChannel;
+		outgoingStream.state->rpc=this;
+		outgoingStreams.push_back(outgoingStream);
+	}
+	SendStreams(systemAddress);
+}
+void RPC3::SendStreams(const SystemAddress &systemAddress)
+{
+	unsigned int inFlight=0;
+	size_t i;
+	for (i=0; i < outgoingStreams.size(); i++)
+	{
+		if (outgoingStreams[i].systemAddress==systemAddress)
+			inFlight+=outgoingStreams[i].sent-outgoingStreams[i].acknowledged;
+	}
+	// A chunk per stream and round, so a stream sent later is not stuck behind a long one
+	bool sent=true;
+	while (sent)
+	{
+		sent=false;
+		for (i=0; i < outgoingStreams.size(); i++)
+		{
+			OutgoingStream &outgoingStream = outgoingStreams[i];
+			if (outgoingStream.systemAddress!=systemAddress || outgoingStream.sent==outgoingStream.state->length)
+				continue;
+			unsigned int length = outgoingStream.state->length-outgoingStream.sent;
+			if (length > streamChunkBytes)
+				length=streamChunkBytes;
+			// One chunk always goes out, so a window smaller than a chunk still moves
+			if (inFlight > 0 && inFlight+length > streamWindow)
+				return;
+			SendStreamChunk(outgoingStream, length, false);
+			outgoingStream.sent+=length;
+			inFlight+=length;
+			statistics.streamBytesSent+=length;
+			sent=true;
+		}
+	}
+}
+void RPC3::SendStreamChunk(const OutgoingStream &outgoingStream, unsigned int length, bool cancelled)
+{
+	RakNet::BitStream parameters;
+	_RPC3::WriteVarInt(parameters, outgoingStream.id);
+	parameters.Write(cancelled);
+	if (cancelled==false)
+		_RPC3::WriteVarInt(parameters, outgoingStream.sent);
+	const unsigned char *data = cancelled ? 0 : &outgoingStream.state->data[outgoingStream.sent];
+	SendStreamMessage(RPC3_STREAM_CHUNK_IDENTIFIER, &parameters, data, cancelled ? 0 : length,
+		outgoingStream.priority, RELIABLE_ORDERED, outgoingStream.orderingChannel, outgoingStream.systemAddress);
+}
+void RPC3::SendStreamAck(const SystemAddress &systemAddress, uint32_t id, bool cancelled, uint32_t received)
+{
+	RakNet::BitStream parameters;
+	_RPC3::WriteVarInt(parameters, id);
+	parameters.Write(cancelled);
+	if (cancelled==false)
+		_RPC3::WriteVarInt(parameters, received);
+	// Unordered, as each acknowledgement covers those before it
+	SendStreamMessage(RPC3_STREAM_ACK_IDENTIFIER, &parameters, 0, 0, HIGH_PRIORITY, RELIABLE, 0, systemAddress);
+}
+void RPC3::SendStreamMessage(const char *identifier, RakNet::BitStream *parameters, const unsigned char *data, unsigned int dataLength,
+	PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress)
+{
+	RemoteSystem *remoteSystem = GetCompactRemoteSystem(systemAddress);
+	if (remoteSystem==0)
+		return;
+	RakNet::BitStream bs;
+	bs.Write((MessageID)ID_RPC_PLUGIN);
+	// Nothing of a call being serialized goes into the header
+	NetworkID lastNetworkID = outgoingNetworkID;
+	unsigned int lastNetworkIDCount = outgoingNetworkIDCount;
+	uint32_t lastReplyId = outgoingReplyId;
+	RakNet::Time lastMaxAge = outgoingMaxAge;
+	OutgoingCall *lastOutgoingCall = outgoingCall;
+	outgoingNetworkID = UNASSIGNED_NETWORK_ID;
+	outgoingNetworkIDCount = 0;
+	outgoingReplyId = 0;
+	outgoingMaxAge = 0;
+	outgoingCall = 0;
+	bool parametersLeftOut = WriteCallOrSignal(&bs, identifier, 1, parameters, true, remoteSystem, 0);
+	outgoingNetworkID = lastNetworkID;
+	outgoingNetworkIDCount = lastNetworkIDCount;
+	outgoingReplyId = lastReplyId;
+	outgoingMaxAge = lastMaxAge;
+	outgoingCall = lastOutgoingCall;
+	if (dataLength==0)
+	{
+		SendCallOrSignalMessage(&bs, parametersLeftOut, parameters, 0, priority, reliability, orderingChannel, systemAddress);
+		return;
+	}
+	// The parameters are a few bytes, so they are always in the header. RakNet copies the bytes behind it.
+	RakAssert(parametersLeftOut==false);
+	bs.AlignWriteToByteBoundary();
+	const char *buffers[2];
+	int lengths[2];
+	buffers[0]=(const char*) bs.GetData();
+	lengths[0]=(int) bs.GetNumberOfBytesUsed();
+	buffers[1]=(const char*) data;
+	lengths[1]=(int) dataLength;
+	SendListUnified(buffers, lengths, 2, priority, reliability, orderingChannel, systemAddress, false);
+}
+void RPC3::OnStreamChunk(const SystemAddress &systemAddress, RakNet::BitStream *parameters)
+{
+	uint64_t id, offset=0;
+	bool cancelled;
+	if (_RPC3::ReadVarInt(*parameters, id)==false || parameters->Read(cancelled)==false || (cancelled==false && _RPC3::ReadVarInt(*parameters, offset)==false))
+		return;
+	size_t index;
+	for (index=0; index < incomingStreams.size(); index++)
+	{
+		if (incomingStreams[index].id==id && incomingStreams[index].systemAddress==systemAddress)
+			break;
+	}
+	if (index==incomingStreams.size())
+	{
+		// Cancelled here, or the call was lost
+		if (cancelled==false)
+			SendStreamAck(systemAddress, (uint32_t) id, true, 0);
+		return;
+	}
+	if (cancelled)
+	{
+		FinishIncomingStream(index, _RPC3::STREAM_CANCELLED);
+		return;
+	}
+
+	std::shared_ptr<_RPC3::StreamState> state = incomingStreams[index].state;
+	parameters->AlignReadToByteBoundary();
+	unsigned int length = (unsigned int) BITS_TO_BYTES(parameters->GetNumberOfUnreadBits());
+	if (offset!=state->received || length==0 || length > state->length-state->received)
+	{
+		SendStreamAck(systemAddress, (uint32_t) id, true, 0);
+		FinishIncomingStream(index, _RPC3::STREAM_CANCELLED);
+		return;
+	}
+	// Unused, see ReleaseUnusedStreams(). Also checked here, so the first window is not acknowledged before Update() runs.
+	if (state.use_count()==2 && !state->chunkHandler && !state->completeHandler)
+	{
+		SendStreamAck(systemAddress, (uint32_t) id, true, 0);
+		FinishIncomingStream(index, _RPC3::STREAM_CANCELLED);
+		return;
+	}
+	const unsigned char *data = parameters->GetData()+BITS_TO_BYTES(parameters->GetReadOffset());
+	state->received+=length;
+	statistics.streamBytesReceived+=length;
+	if (state->chunkHandler)
+	{
+		// The handler may cancel the stream, which clears it
+		_RPC3::StreamChunkHandler chunkHandler(state->chunkHandler);
+		chunkHandler(data, length, (unsigned int) offset);
+	}
+	else
+		state->data.insert(state->data.end(), data, data+length);
+
+	// Acknowledged once handled, so a slow chunk handler slows the sender down
+	for (index=0; index < incomingStreams.size(); index++)
+	{
+		if (incomingStreams[index].state==state)
+			break;
+	}
+	if (index==incomingStreams.size())
+		return;
+	SendStreamAck(systemAddress, (uint32_t) id, false, state->received);
+	if (state->received==state->length)
+		FinishIncomingStream(index, _RPC3::STREAM_COMPLETE);
+}
+void RPC3::OnStreamAck(const SystemAddress &systemAddress, RakNet::BitStream *parameters)
+{
+	uint64_t id, received=0;
+	bool cancelled;
+	if (_RPC3::ReadVarInt(*parameters, id)==false || parameters->Read(cancelled)==false || (cancelled==false && _RPC3::ReadVarInt(*parameters, received)==false))
+		return;
+	size_t index;
+	for (index=0; index < outgoingStreams.size(); index++)
+	{
+		if (outgoingStreams[index].id==id && outgoingStreams[index].systemAddress==systemAddress)
+			break;
+	}
+	if (index==outgoingStreams.size())
+		return;
+	OutgoingStream &outgoingStream = outgoingStreams[index];
+	if (cancelled || received > outgoingStream.sent)
+		EraseOutgoingStream(index);
+	else if (received > outgoingStream.acknowledged)
+	{
+		outgoingStream.acknowledged=(uint32_t) received;
+		if (outgoingStream.acknowledged==outgoingStream.state->length)
+			EraseOutgoingStream(index);
+	}
+	SendStreams(systemAddress);
+}
+void RPC3::FinishIncomingStream(size_t index, _RPC3::StreamStatus status)
+{
+	std::shared_ptr<_RPC3::StreamState> state = incomingStreams[index].state;
+	incomingStreams.erase(incomingStreams.begin()+index);
+	state->status=status;
+	state->rpc=0;
+	if (status==_RPC3::STREAM_CANCELLED)
+		statistics.cancelledStreams++;
+	// The handler may start new calls, so it runs after the bookkeeping is done
+	_RPC3::StreamCompleteHandler completeHandler;
+	completeHandler.swap(state->completeHandler);
+	state->chunkHandler=nullptr;
+	if (completeHandler)
+	{
+		bool hasData = status==_RPC3::STREAM_COMPLETE && state->data.size()==state->length;
+		completeHandler(status, hasData ? &state->data[0] : 0, hasData ? state->length : 0);
+	}
+}
+void RPC3::EraseOutgoingStream(size_t index)
+{
+	std::shared_ptr<_RPC3::StreamState> state = outgoingStreams[index].state;
+	outgoingStreams.erase(outgoingStreams.begin()+index);
+	size_t i;
+	for (i=0; i < outgoingStreams.size(); i++)
+	{
+		if (outgoingStreams[i].state==state)
+			return;
+	}
+	// Nothing left to cancel through this plugin
+	if (state->rpc==this)
+		state->rpc=0;
+}
+void RPC3::CancelStream(const std::shared_ptr<_RPC3::StreamState> &state)
+{
+	size_t i;
+	if (state->incoming)
+	{
+		for (i=0; i < incomingStreams.size(); i++)
+		{
+			if (incomingStreams[i].state==state)
+			{
+				SendStreamAck(incomingStreams[i].systemAddress, incomingStreams[i].id, true, 0);
+				FinishIncomingStream(i, _RPC3::STREAM_CANCELLED);
+				return;
+			}
+		}
+		return;
+	}
+	i=0;
+	while (i < outgoingStreams.size())
+	{
+		if (outgoingStreams[i].state!=state)
+		{
+			i++;
+			continue;
+		}
+		SendStreamChunk(outgoingStreams[i], 0, true);
+		EraseOutgoingStream(i);
+	}
+	state->status=_RPC3::STREAM_CANCELLED;
+}
+void RPC3::ReleaseUnusedStreams(void)
+{
+	size_t i=0;
+	while (i < incomingStreams.size())
+	{
+		const IncomingStream &incomingStream = incomingStreams[i];
+		// Only referred to from here, so nothing could ever read the bytes
+		if (incomingStream.state.use_count()==1 && !incomingStream.state->chunkHandler && !incomingStream.state->completeHandler)
+		{
+			SendStreamAck(incomingStream.systemAddress, incomingStream.id, true, 0);
+			FinishIncomingStream(i, _RPC3::STREAM_CANCELLED);
+		}
+		else
+			i++;
+	}
+}
+void RPC3::ClearStreams(const SystemAddress &systemAddress, bool runHandlers)
+{
+	size_t i=0;
+	while (i < outgoingStreams.size())
+	{
+		if (systemAddress==RakNet::UNASSIGNED_SYSTEM_ADDRESS || outgoingStreams[i].systemAddress==systemAddress)
+			EraseOutgoingStream(i);
+		else
+			i++;
+	}
+	i=0;
+	while (i < incomingStreams.size())
+	{
+		if (systemAddress!=RakNet::UNASSIGNED_SYSTEM_ADDRESS && incomingStreams[i].systemAddress!=systemAddress)
+		{
+			i++;
+			continue;
+		}
+		if (runHandlers==false)
+		{
+			incomingStreams[i].state->completeHandler=nullptr;
+			incomingStreams[i].state->chunkHandler=nullptr;
+		}
+		FinishIncomingStream(i, _RPC3::STREAM_CANCELLED);
+	}
+}
+
+namespace RakNet
+{
+namespace _RPC3
+{
+NetworkIDObject *GetObjectFromID(const InvokeArgs &args, NetworkID networkId)
+{
+	if (args.caller)
+		return args.caller->GetObjectFromID(networkId);
+	return args.networkIDManager ? args.networkIDManager->GET_OBJECT_FROM_ID<NetworkIDObject*>(networkId) : 0;
+}
+void WriteInternedString(RPC3 *rpc, RakNet::BitStream &bitStream, const RakNet::RakString &string)
+{
+	if (rpc)
+	{
+		rpc->WriteInternedString(bitStream, string);
+		return;
+	}
+	WriteVarInt(bitStream, 0);
+	bitStream.Write(string);
+}
+bool ReadInternedString(RPC3 *rpc, RakNet::BitStream &bitStream, RakNet::RakString &string)
+{
+	return rpc->ReadInternedString(bitStream, string);
+}
+void WriteStream(RPC3 *rpc, RakNet::BitStream &bitStream, const Stream &stream)
+{
+	if (rpc)
+	{
+		rpc->WriteStream(bitStream, stream);
+		return;
+	}
+	const StreamState *state = stream.state.get();
+	unsigned int length = state!=0 && state->data.size()==state->length ? state->length : 0;
+	bitStream.Write(false);
+	WriteVarInt(bitStream, length);
+	if (length > 0)
+		bitStream.Write((const char*) &state->data[0], length);
+}
+bool ReadStream(RPC3 *rpc, RakNet::BitStream &bitStream, Stream &stream)
+{
+	return rpc->ReadStream(bitStream, stream);
+}
+
+// Streams kept by a thread for reuse. More than this are only needed by nested calls, and are freed.
+static const unsigned int BITSTREAM_POOL_SIZE=16;
+// A stream that grew past this for an unusual call gives its memory back
+static const BitSize_t BITSTREAM_POOL_MAX_BITS=BYTES_TO_BITS(1<<20);
+
+struct BitStreamPool
+{
+	~BitStreamPool()
+	{
+		for (unsigned int i=0; i < bitStreams.Size(); i++)
+			RakNet::OP_DELETE(bitStreams[i], _FILE_AND_LINE_);
+	}
+	DataStructures::List<RakNet::BitStream*> bitStreams;
+};
+static thread_local BitStreamPool bitStreamPool;
+
+RakNet::BitStream *AcquireBitStream(void)
+{
+	if (bitStreamPool.bitStreams.Size()==0)
+		return RakNet::OP_NEW<RakNet::BitStream>(_FILE_AND_LINE_);
+	return bitStreamPool.bitStreams.Pop();
+}
+void ReleaseBitStream(RakNet::BitStream *bitStream)
+{
+	if (bitStreamPool.bitStreams.Size() >= BITSTREAM_POOL_SIZE || bitStream->GetNumberOfBitsAllocated() > BITSTREAM_POOL_MAX_BITS)
+	{
+		RakNet::OP_DELETE(bitStream, _FILE_AND_LINE_);
+		return;
+	}
+	// Reset() keeps the allocation
+	bitStream->Reset();
+	bitStreamPool.bitStreams.Push(bitStream, _FILE_AND_LINE_);
 }
+} // namespace _RPC3
+} // namespace RakNet
@@ -17,6 +17,9 @@
 #define __RPC_3_H
 
 #include "RPC3_STD.h"
+#include "RPC3_FrozenRegistry.h"
+#include "RPC3_Trace.h"
+#include "RPC3_Wakeup.h"
 #include "PluginInterface2.h"
 #include "PacketPriority.h"
 #include "RakNetTypes.h"
@@ -39,13 +42,68 @@ namespace RakNet
 {
 class RakPeerInterface;
 class NetworkIDManager;
+class RPC3ShardGroup;
+namespace _RPC3
+{
+class CaptureLog;
+}
+
+/// \ingroup RPC_3_GROUP
+/// Identifier of the call RPC3 sends when a connection opens to announce which message layout it reads
+#define RPC3_HANDSHAKE_IDENTIFIER "RPC3::Handshake"
+
+/// \ingroup RPC_3_GROUP
+/// Identifier of the call carrying the answer to RPC3::CallWithReply()
+#define RPC3_REPLY_IDENTIFIER "RPC3::Reply"
+
+/// \ingroup RPC_3_GROUP
+/// Identifier of the calls carrying the bytes of a _RPC3::Stream argument, and of those acknowledging them
+#define RPC3_STREAM_CHUNK_IDENTIFIER "RPC3::StreamChunk"
+#define RPC3_STREAM_ACK_IDENTIFIER "RPC3::StreamAck"
+
+/// \ingroup RPC_3_GROUP
+/// Bytes of _RPC3::Stream arguments sent to one system and not acknowledged yet, when RPC3::SetStreamWindow() was not called
+#define RPC3_DEFAULT_STREAM_WINDOW 65536
+
+/// \ingroup RPC_3_GROUP
+/// Bytes in one chunk of a _RPC3::Stream argument when none are given. Streams no longer than one chunk are sent inside the call.
+#define RPC3_DEFAULT_STREAM_CHUNK_BYTES 8192
+
+/// \ingroup RPC_3_GROUP
+/// Most strings one system defines for _RPC3::InternedString arguments, and accepts from each peer
+#define RPC3_MAX_INTERNED_STRINGS 1024
+
+/// \ingroup RPC_3_GROUP
+/// Longer _RPC3::InternedString arguments are always sent in full
+#define RPC3_MAX_INTERNED_STRING_LENGTH 255
+
+/// \ingroup RPC_3_GROUP
+/// Ordering channels RakNet has, NUMBER_OF_ORDERED_STREAMS in ReliabilityLayer.h
+#define RPC3_ORDERING_CHANNELS 32
+
+/// \ingroup RPC_3_GROUP
+/// Reports one system gets per interval of RPC3::SetErrorReportInterval() when no limit is given
+#define RPC3_DEFAULT_MAX_ERROR_REPORTS 16
+
+/// \ingroup RPC_3_GROUP
+/// Most missing objects one coalesced RPC_ERROR_OBJECTS_DO_NOT_EXIST report lists
+#define RPC3_MAX_ERROR_REPORT_OBJECTS 64
+
+/// \ingroup RPC_3_GROUP
+/// Parameters at least this many bytes are sent from the buffer they were serialized into, instead of being copied behind the header
+#define RPC3_SEPARATE_PARAMETERS_MIN_BYTES 128
+
+/// \ingroup RPC_3_GROUP
+/// Largest parameters that are compressed, and that a compressed call received may decompress to
+#define RPC3_MAX_COMPRESSED_PARAMETER_BYTES (16*1024*1024)
 
 /// \ingroup RPC_3_GROUP
 #define RPC3_REGISTER_FUNCTION(RPC3Instance, _FUNCTION_PTR_) (RPC3Instance)->RegisterFunction((#_FUNCTION_PTR_), (_FUNCTION_PTR_))
 
 /// \brief Error codes returned by a remote system as to why an RPC function call cannot execute
 /// \details Error code follows packet ID ID_RPC_REMOTE_ERROR, that is packet->data[1]<BR>
-/// Name of the function will be appended starting at packet->data[2]
+/// Name of the function will be appended starting at packet->data[2]<BR>
+/// If the sender coalesces errors, see RPC3::SetErrorReportInterval(), the name is followed by the uint32_t number of calls that failed, written with RakNet::BitStream.
 /// \ingroup RPC_3_GROUP
 enum RPCErrorCodes
 {
@@ -73,6 +131,138 @@ enum RPCErrorCodes
 	RPC_ERROR_CALLING_C_AS_CPP,
 	
 	RPC_ERROR_INCORRECT_NUMBER_OF_PARAMETERS,
+
+	/// Some objects passed to RPC3::CallCPPMulti() do not exist on this system. The member was still called on the others.
+	/// The function name is followed by a uint32_t count and that many NetworkIDs, written with RakNet::BitStream.
+	/// A coalesced report lists the distinct objects missing in any of its calls, up to RPC3_MAX_ERROR_REPORT_OBJECTS, instead of a number of calls.
+	RPC_ERROR_OBJECTS_DO_NOT_EXIST,
+
+	/// The call was older than its max age when it arrived, see RPC3::SetMaxAge() and RPC3::SetHandlerMaxAge()
+	/// Only sent as the reply of RPC3::CallWithReply(), as an error message per dropped call would add to the load that delayed it.
+	RPC_ERROR_CALL_EXPIRED,
+};
+
+/// \brief Layouts of the ID_RPC_PLUGIN message, negotiated per connection
+/// \details Both sides announce the newest layout they read with a handshake call when the connection opens.
+/// A peer that never announces itself, such as the original RPC3 plugin, keeps getting RPC3_PROTOCOL_LEGACY.
+/// \ingroup RPC_3_GROUP
+enum RPC3ProtocolVersion
+{
+	/// Layout of the original RPC3 plugin: byte sized parameter count, aligned identifier and an explicit parameter length
+	RPC3_PROTOCOL_LEGACY=1,
+
+	/// Bit packed flags and parameter count, compressed NetworkID, no parameter length, and no alignment padding except before the parameters
+	RPC3_PROTOCOL_COMPACT=2,
+};
+
+/// \brief Optional parts of the compact layout a peer can read, announced in the handshake next to the protocol version
+/// \ingroup RPC_3_GROUP
+enum RPC3Features
+{
+	/// Parameters may be LZ compressed, see RPC3::SetCompressionThreshold()
+	RPC3_FEATURE_COMPRESSION=1<<0,
+	/// Calls may carry a reply id, answered with RPC3::Reply()
+	RPC3_FEATURE_REPLIES=1<<1,
+	/// One call may name several objects, see RPC3::CallCPPMulti()
+	RPC3_FEATURE_MULTI_TARGET=1<<2,
+	/// _RPC3::InternedString arguments may be sent as an index, see RPC3::SetStringInterningLimit()
+	RPC3_FEATURE_INTERNED_STRINGS=1<<3,
+	/// Objects passed with _RPC3::Deref() may be framed with a varint length instead of an aligned 32 bit length
+	RPC3_FEATURE_COMPACT_DEREF=1<<4,
+	/// Parameters start on a byte boundary after the header, as they did when serialized, and large ones are sent without being copied behind it
+	RPC3_FEATURE_ALIGNED_PARAMETERS=1<<5,
+	/// Calls may carry a trace id, see RPC3::EnableTracing()
+	RPC3_FEATURE_TRACE=1<<6,
+	/// Calls may carry a max age, see RPC3::SetMaxAge()
+	RPC3_FEATURE_MAX_AGE=1<<7,
+	/// _RPC3::Stream arguments may be sent in chunks after the call, see RPC3::SetStreamWindow()
+	RPC3_FEATURE_STREAMS=1<<8,
+};
+
+/// \brief Outcome of a call made with RPC3::CallWithReply()
+/// \ingroup RPC_3_GROUP
+enum RPC3ReplyStatus
+{
+	/// The remote handler answered with RPC3::Reply()
+	RPC3_REPLY_OK,
+	/// The call failed on the remote system. The reply holds one byte, the RPCErrorCodes value.
+	RPC3_REPLY_REMOTE_ERROR,
+	/// No reply within the time given to RPC3::SetReplyTimeout()
+	RPC3_REPLY_TIMEOUT,
+	/// The connection closed, or the plugin shut down, before the reply arrived
+	RPC3_REPLY_DISCONNECTED,
+	/// The call was not sent. There was no single recipient, the recipient does not support replies, or sending failed.
+	RPC3_REPLY_NOT_SENT,
+};
+
+/// \brief Identifies a call made with RPC3::CallWithReply() on the system handling it
+/// \ingroup RPC_3_GROUP
+struct RPC3ReplyToken
+{
+	RPC3ReplyToken() : replyId(0) {}
+	SystemAddress systemAddress;
+	uint32_t replyId;
+	/// \return false if the call being handled did not ask for a reply
+	bool IsValid(void) const {return replyId!=0;}
+};
+
+/// \brief Counters kept by RPC3, see RPC3::GetStatistics()
+/// \ingroup RPC_3_GROUP
+struct RPC3Statistics
+{
+	RPC3Statistics() : compressedCalls(0), compressionBytesIn(0), compressionBytesOut(0), compressionSkipped(0), localInvocations(0), expiredCalls(0),
+		reportedErrors(0), errorReportsSent(0), errorReportsDropped(0), streamBytesSent(0), streamBytesReceived(0), cancelledStreams(0) {}
+
+	/// Calls and signals whose parameters were sent compressed
+	uint64_t compressedCalls;
+	/// Parameter bytes of compressed calls before compression
+	uint64_t compressionBytesIn;
+	/// Parameter bytes of compressed calls after compression
+	uint64_t compressionBytesOut;
+	/// Calls that were eligible for compression but sent as is, because compression did not make them smaller
+	uint64_t compressionSkipped;
+	/// Functions and slots on this system that took the caller's arguments directly, without serializing them
+	uint64_t localInvocations;
+	/// Received calls and signals dropped unread because they were older than their max age
+	uint64_t expiredCalls;
+	/// Received calls that failed on this system with one of RPCErrorCodes, whether or not their sender was told
+	uint64_t reportedErrors;
+	/// ID_RPC_REMOTE_ERROR messages sent, one per error when they are not coalesced
+	uint64_t errorReportsSent;
+	/// Errors not sent because the limit of SetErrorReportInterval() was reached for their sender
+	uint64_t errorReportsDropped;
+	/// Bytes of _RPC3::Stream arguments sent in chunks, counted once per recipient
+	uint64_t streamBytesSent;
+	/// Bytes of _RPC3::Stream arguments received in chunks
+	uint64_t streamBytesReceived;
+	/// Streams this system was receiving that ended before their last byte, for whatever reason
+	uint64_t cancelledStreams;
+
+	/// \return compressionBytesOut / compressionBytesIn, or 1 if nothing was compressed
+	float GetCompressionRatio(void) const {return compressionBytesIn ? (float) compressionBytesOut / (float) compressionBytesIn : 1.0f;}
+};
+
+/// \brief Send parameters for one function or slot identifier, see RPC3::SetSendPolicy()
+/// \ingroup RPC_3_GROUP
+struct RPC3SendPolicy
+{
+	RPC3SendPolicy(PacketPriority _priority=HIGH_PRIORITY, PacketReliability _reliability=RELIABLE_ORDERED, char _orderingChannel=0)
+		: priority(_priority), reliability(_reliability), orderingChannel(_orderingChannel) {}
+
+	PacketPriority priority;
+	PacketReliability reliability;
+	char orderingChannel;
+};
+
+/// \brief Order in which RPC3::DispatchDeferredCalls() runs the queued calls
+/// \ingroup RPC_3_GROUP
+enum RPC3DispatchOrder
+{
+	/// As they were received
+	RPC3_DISPATCH_ARRIVAL,
+	/// Grouped by function, in the order SetDeferredDispatch() was first called for them, then sorted by target object
+	/// Calls of the same function on the same object stay in the order they were received.
+	RPC3_DISPATCH_GROUPED,
 };
 
 /// \brief The RPC3 plugin allows you to call remote functions as if they were local functions, using the standard function call syntax
@@ -98,6 +288,26 @@ public:
 	/// \param[in] idMan Pointer to the network ID manager to use
 	void SetNetworkIDManager(NetworkIDManager *idMan);
 
+	/// Gives \a object a NetworkID that this plugin resolves with one array index, instead of a NetworkIDManager lookup
+	/// The id is set with NetworkIDObject::SetNetworkID(), so the object stays known to the NetworkIDManager and is sent and replicated like any NetworkID.
+	/// Handles are assigned by one system, usually the server. Other systems pass the id they received to the overload below.
+	/// Call UnregisterObject() before deleting the object. Calls still in flight to its handle are then rejected by a generation compare.
+	/// \return The new NetworkID of \a object
+	NetworkID RegisterObject(NetworkIDObject *object);
+
+	/// Sets \a networkId, assigned by RegisterObject() on another system, on \a object, and resolves it with one array index on this plugin too
+	/// \return false if \a networkId is not a handle or its slot holds another object. The id is set anyway and resolved with the NetworkIDManager.
+	bool RegisterObject(NetworkIDObject *object, NetworkID networkId);
+
+	/// Frees the handle of \a object, which keeps its NetworkID. Does nothing if \a object was not registered.
+	void UnregisterObject(NetworkIDObject *object);
+
+	/// \return The object with \a networkId, from the handle table if it is a handle, otherwise from the NetworkIDManager. 0 if there is none.
+	NetworkIDObject *GetObjectFromID(NetworkID networkId);
+
+	/// \return True if \a networkId has the layout of the ids given by RegisterObject()
+	static bool IsObjectHandle(NetworkID networkId);
+
 	/// Register a function pointer as callable using RPC()
 	/// \param[in] uniqueIdentifier String identifying the function. Recommended that this is the name of the function
 	/// \param[in] functionPtr Pointer to the function. For C, just pass the name of the function. For C++, use ARPC_REGISTER_CPP_FUNCTION
@@ -105,38 +315,54 @@ public:
 	template<typename Function>
 	bool RegisterFunction(const char *uniqueIdentifier, Function functionPtr)
 	{
-		if (IsFunctionRegistered(uniqueIdentifier)) return false;
+		RPCIdentifier identifier(uniqueIdentifier);
+		if (localFunctions.GetIndexOf(identifier).IsInvalid()==false) return false;
+		ThawRegistry();
 		_RPC3::FunctionPointer fp;
 		fp= _RPC3::GetBoundPointer(functionPtr);
-		localFunctions.Push(uniqueIdentifier,RakNet::OP_NEW_1<LocalRPCFunction>( _FILE_AND_LINE_, fp ),_FILE_AND_LINE_);
+		localFunctions.Push(identifier,RakNet::OP_NEW_1<LocalRPCFunction>( _FILE_AND_LINE_, fp ),_FILE_AND_LINE_);
 		return true;
 	}
 
-	/// \internal
-	// Callable object, along with priority to call relative to other objects
-	struct LocalSlotObject
+	/// Same as RegisterFunction(), and calls to \a uniqueIdentifier sent from this system use \a sendPolicy, see SetSendPolicy()
+	/// Meant for code shared by both ends, which registers the functions it also calls.
+	template<typename Function>
+	bool RegisterFunction(const char *uniqueIdentifier, Function functionPtr, const RPC3SendPolicy &sendPolicy)
 	{
-		LocalSlotObject() {}
-		LocalSlotObject(NetworkID _associatedObject,unsigned int _registrationCount,int _callPriority,_RPC3::FunctionPointer _functionPointer)
-		{associatedObject=_associatedObject;registrationCount=_registrationCount;callPriority=_callPriority;functionPointer=_functionPointer;}
-		~LocalSlotObject() {}
-
-		// Used so slots are called in the order they are registered
-		NetworkID associatedObject;
-		unsigned int registrationCount;
-		int callPriority;
-		_RPC3::FunctionPointer functionPointer;
-	};
-	
+		if (RegisterFunction(uniqueIdentifier, functionPtr)==false)
+			return false;
+		SetSendPolicy(uniqueIdentifier, sendPolicy);
+		return true;
+	}
+
 	/// \internal
 	/// Identifies an RPC function, by string identifier and if it is a C or C++ function
 	typedef RakString RPCIdentifier;
-	static int LocalSlotObjectComp( const LocalSlotObject &key, const LocalSlotObject &data );
 	/// \internal
+	/// Invoker shared by every slot of one identifier that registered the same function
+	struct SlotInvoker
+	{
+		_RPC3::FunctionKey functionKey;
+		_RPC3::FunctionPointer functionPointer;
+	};
+	/// \internal
+	/// Slots of one identifier, as parallel arrays sorted by highest callPriority first, then by registration order
 	struct LocalSlot
 	{
-//		RPCIdentifier identifier;
-		DataStructures::OrderedList<LocalSlotObject,LocalSlotObject,LocalSlotObjectComp> slotObjects;
+		~LocalSlot();
+		/// \return Index of the invoker bound to the function with \a functionKey, or invokers.Size() if there is none
+		unsigned int GetInvokerIndex(const _RPC3::FunctionKey &functionKey) const;
+		/// Inserts \a count slots calling invoker \a invokerIndex, after every slot with at least \a callPriority
+		void AddSlots(unsigned short invokerIndex, const NetworkID *objectInstanceIds, unsigned int count, int callPriority);
+		/// Drops the slots InvokeSignal() marked as removed, because their object was gone
+		void RemoveMarkedSlots(void);
+
+		DataStructures::List<SlotInvoker*> invokers;
+		/// Per slot, the object to call, or UNASSIGNED_NETWORK_ID for a C function
+		DataStructures::List<NetworkID> objects;
+		DataStructures::List<int> callPriorities;
+		/// Per slot, index into invokers
+		DataStructures::List<unsigned short> invokerIndices;
 	};
 	
 	/// Register a slot, which is a function pointer to one or more instances of a class that supports this function signature
@@ -148,21 +374,34 @@ public:
 	template<typename Function>
 	void RegisterSlot(const char *sharedIdentifier, Function functionPtr, NetworkID objectInstanceId, int callPriority)
 	{
-		_RPC3::FunctionPointer fp;
-		fp= _RPC3::GetBoundPointer(functionPtr);
-		LocalSlotObject lso(objectInstanceId, nextSlotRegistrationCount++, callPriority, _RPC3::GetBoundPointer(functionPtr));
-		DataStructures::HashIndex idx = GetLocalSlotIndex(sharedIdentifier);
-		LocalSlot *localSlot;
-		if (idx.IsInvalid())
-		{
-			localSlot = RakNet::OP_NEW<LocalSlot>(_FILE_AND_LINE_);
-			localSlots.Push(sharedIdentifier, localSlot,_FILE_AND_LINE_);
-		}
-		else
+		RegisterSlots(sharedIdentifier, functionPtr, &objectInstanceId, 1, callPriority);
+	}
+
+	/// Same as RegisterSlot(), and signals of \a sharedIdentifier sent from this system use \a sendPolicy, see SetSendPolicy()
+	template<typename Function>
+	void RegisterSlot(const char *sharedIdentifier, Function functionPtr, NetworkID objectInstanceId, int callPriority, const RPC3SendPolicy &sendPolicy)
+	{
+		RegisterSlot(sharedIdentifier, functionPtr, objectInstanceId, callPriority);
+		SetSendPolicy(sharedIdentifier, sendPolicy);
+	}
+
+	/// Same as calling RegisterSlot() for each of \a objectInstanceIds in turn, but the slots of \a sharedIdentifier are only reordered once
+	/// Slots registering the same function share one invoker, so each slot only stores its NetworkID, callPriority and the index of the invoker.
+	/// \param[in] objectInstanceIds \a count objects, in the order their slots run
+	template<typename Function>
+	void RegisterSlots(const char *sharedIdentifier, Function functionPtr, const NetworkID *objectInstanceIds, unsigned int count, int callPriority)
+	{
+		LocalSlot *localSlot = AddLocalSlot(sharedIdentifier);
+		_RPC3::FunctionKey functionKey = _RPC3::GetFunctionKey(functionPtr);
+		unsigned int invokerIndex = localSlot->GetInvokerIndex(functionKey);
+		if (invokerIndex==localSlot->invokers.Size())
 		{
-			localSlot=localSlots.ItemAtIndex(idx);
+			SlotInvoker *slotInvoker = RakNet::OP_NEW<SlotInvoker>(_FILE_AND_LINE_);
+			slotInvoker->functionKey=functionKey;
+			slotInvoker->functionPointer=_RPC3::GetBoundPointer(functionPtr);
+			localSlot->invokers.Push(slotInvoker,_FILE_AND_LINE_);
 		}
-		localSlot->slotObjects.Insert(lso,lso,true,_FILE_AND_LINE_);
+		localSlot->AddSlots((unsigned short) invokerIndex, objectInstanceIds, count, callPriority);
 	}
 
 	/// Unregisters a function pointer to be callable given an identifier for the pointer
@@ -175,11 +414,194 @@ public:
 	/// \return True if the function was registered, false otherwise
 	bool IsFunctionRegistered(const char *uniqueIdentifier);
 
+	/// Builds a read-only perfect-hash index over all functions and slots registered so far
+	/// Incoming calls are then resolved with a single probe and without allocating a RakString.
+	/// Call once after startup registration. Registering a new function or slot identifier afterwards drops the index until this is called again.
+	void FreezeRegistry(void);
+
+	/// \return True if FreezeRegistry() was called and no new identifier was registered since
+	bool IsRegistryFrozen(void) const;
+
+	/// Looks up functions, slots, send policies and compressed identifiers in \a registry instead of this instance
+	/// Lets several RPC3 instances, one per RakPeerInterface and thread, share one set of registrations. See RPC3ShardGroup.
+	/// \a registry is only read, so it must be frozen with FreezeRegistry() and left unchanged while it is shared.
+	/// Member function slots registered on \a registry find their objects in the NetworkIDManager of this instance.
+	/// \param[in] registry Instance the registrations were made on, or 0 to use the registrations of this instance again
+	/// \return false if \a registry is not frozen
+	bool SetSharedRegistry(RPC3 *registry);
+
+	/// \return The instance passed to SetSharedRegistry(), or 0
+	RPC3 *GetSharedRegistry(void) const;
+
+	/// Enables or disables the compact message header for connections opened after this call
+	/// When enabled, RPC3 offers RPC3_PROTOCOL_COMPACT in a handshake when a connection opens and uses it with peers that offer it too.
+	/// Defaults to true. Peers running the original RPC3 plugin are detected and keep the legacy layout.
+	/// \param[in] enable True to offer the compact header
+	void SetCompactHeaderEnabled(bool enable);
+
+	/// \return The message layout used when sending to \a systemAddress, one of RPC3ProtocolVersion
+	unsigned char GetProtocolVersion(const SystemAddress &systemAddress);
+
+	/// Compress the parameters of calls and signals that serialize to at least \a thresholdBytes
+	/// Compression is only used with peers on the compact header, and is skipped for a call when it does not make the parameters smaller.
+	/// \param[in] thresholdBytes Minimum serialized parameter size in bytes. 0 to disable, which is the default.
+	void SetCompressionThreshold(unsigned int thresholdBytes);
+
+	/// Compress the parameters of \a uniqueIdentifier regardless of their size, or stop doing so
+	/// \param[in] uniqueIdentifier Identifier of the function or slot as passed to Call() or Signal()
+	/// \param[in] compress True to always try compressing, false to fall back to SetCompressionThreshold()
+	void SetCompressionForIdentifier(const char *uniqueIdentifier, bool compress);
+
+	/// Sets how many distinct strings passed as _RPC3::InternedString are sent as an index
+	/// The first call using a string defines it in its header. Later calls send just the index, once the definition went out RELIABLE_ORDERED on the same ordering channel.
+	/// The table is shared by all connections and never forgets a string, so strings beyond the limit are sent in full.
+	/// Interning is only used when every recipient of a call is on the compact header.
+	/// \param[in] maxStrings Up to RPC3_MAX_INTERNED_STRINGS, which is the default. 0 sends every string in full.
+	void SetStringInterningLimit(unsigned int maxStrings);
+
+	/// \return Counters collected since this plugin was created
+	const RPC3Statistics &GetStatistics(void) const;
+
+	/// Coalesce the ID_RPC_REMOTE_ERROR messages sent to each system over \a interval, instead of sending one RELIABLE_ORDERED message per failed call
+	/// Failed calls from one system with the same error and function become one UNRELIABLE report, see RPCErrorCodes for its layout.
+	/// A system calling an unregistered function in a loop then costs a few reports per interval, instead of one reliable message per call.
+	/// Callers waiting with CallWithReply() still get their error reply at once.
+	/// \param[in] interval Milliseconds between two rounds of reports. 0, the default, sends every error at once, as the original RPC3 plugin does.
+	/// \param[in] maxReports Reports sent to one system per interval. Errors needing more are counted in RPC3Statistics::errorReportsDropped.
+	void SetErrorReportInterval(RakNet::TimeMS interval, unsigned int maxReports=RPC3_DEFAULT_MAX_ERROR_REPORTS);
+
+	/// Sets how _RPC3::Stream arguments are sent from this system, see RPC3_Stream.h
+	/// A stream longer than one chunk is sent after its call, in chunks on the call's ordering channel. A system is sent at most \a windowBytes it did not acknowledge yet, over all streams to it.
+	/// Calls made meanwhile go out between the chunks, so they wait behind at most one window instead of the whole stream.
+	/// A call with such a stream is sent RELIABLE_ORDERED, so its chunks arrive after it. Recipients without RPC3_FEATURE_STREAMS get every stream of a call inside it.
+	/// \param[in] windowBytes Defaults to RPC3_DEFAULT_STREAM_WINDOW. One chunk is always sent, even if it is larger.
+	/// \param[in] chunkBytes Defaults to RPC3_DEFAULT_STREAM_CHUNK_BYTES
+	void SetStreamWindow(unsigned int windowBytes, unsigned int chunkBytes=RPC3_DEFAULT_STREAM_CHUNK_BYTES);
+
+	/// Records the lifecycle of sampled calls and signals in a ring of RPC3TraceRecord, see RPC3Tracer
+	/// One in \a sampleInterval calls sent from this system gets a trace id, which recipients on the compact header record too, if tracing is enabled there.
+	/// A traced call to a single system also carries an ID_TIMESTAMP, unless SetTimestamp() already set one, so the recipient can measure the network stage.
+	/// Handlers still see GetLastSenderTimestamp() as 0 for such calls.
+	/// \param[in] sampleInterval 1 to trace every call. 0 to only record calls traced by their sender.
+	/// \param[in] capacity Records kept, oldest overwritten first
+	void EnableTracing(unsigned int sampleInterval, unsigned int capacity=RPC3_DEFAULT_TRACE_CAPACITY);
+
+	/// Stops tracing and frees the records. Other threads must not be reading GetTracer() at the time.
+	void DisableTracing(void);
+
+	/// \return The records kept since EnableTracing(), or 0 if not tracing. Can be read from any thread.
+	RPC3Tracer *GetTracer(void) const;
+
+	/// Called on this system after a received call or signal whose handlers took at least the threshold to run
+	typedef std::function<void(const RPC3TraceRecord &record)> SlowHandlerCallback;
+
+	/// Times every received call and signal, and passes those whose handlers took at least \a thresholdUS to \a callback
+	/// Works without EnableTracing(). The record has a trace id if the sender traced the call.
+	/// \param[in] thresholdUS Microseconds from decoding the arguments until the handler returns. 0 to stop timing handlers.
+	/// \param[in] callback Runs in RakPeerInterface::Receive(), after the handler
+	void SetSlowHandlerCallback(RakNet::TimeUS thresholdUS, const SlowHandlerCallback &callback);
+
+	/// Append every incoming ID_RPC_PLUGIN message, with its sender, timestamp and identifier, to a memory-mapped log at \a path
+	/// A running capture is stopped first. The log can be fed back with ReplayCapture().
+	/// \return false if the log could not be created
+	bool StartCapture(const char *path);
+
+	/// Stops capturing and trims the log to its used size
+	void StopCapture(void);
+
+	/// \return True between StartCapture() and StopCapture()
+	bool IsCapturing(void) const;
+
+	/// Dispatches every message in the log at \a path as if it had just been received, without any network
+	/// Functions, slots and objects must be registered as they were on the capturing system. Errors are sent to the recorded senders as usual, if connected.
+	/// \param[in] path Log written by StartCapture()
+	/// \param[in] realTime True to keep the recorded spacing between messages, false to dispatch as fast as possible
+	/// \param[out] messageCount If not 0, receives the number of messages dispatched
+	/// \return false if the log could not be opened, or ended with a malformed record
+	bool ReplayCapture(const char *path, bool realTime, unsigned int *messageCount=0);
+
 	/// Send or stop sending a timestamp with all following calls to Call()
 	/// Use GetLastSenderTimestamp() to read the timestamp.
 	/// \param[in] timeStamp Non-zero to pass this timestamp using the ID_TIMESTAMP system. 0 to clear passing a timestamp.
 	void SetTimestamp(RakNet::Time timeStamp);
 
+	/// Send calls and signals of \a uniqueIdentifier with \a sendPolicy, instead of whatever was last passed to SetSendParams()
+	/// Lets unimportant traffic, such as chat, use its own ordering channel or no ordering, so a lost packet does not hold back everything sent after it.
+	/// \param[in] uniqueIdentifier Identifier passed to Call() or Signal()
+	/// \param[in] sendPolicy Priority, reliability and ordering channel to send with
+	void SetSendPolicy(const char *uniqueIdentifier, const RPC3SendPolicy &sendPolicy);
+
+	/// Send \a uniqueIdentifier with SetSendParams() again
+	void ClearSendPolicy(const char *uniqueIdentifier);
+
+	/// Give all following calls and signals a max age, after which recipients drop them without running them
+	/// The age is the time between the sender's ID_TIMESTAMP, which is added unless SetTimestamp() already set one, and this plugin getting the message out of RakPeerInterface::Receive().
+	/// Handlers still see GetLastSenderTimestamp() as 0 if the timestamp was only added for the max age.
+	/// Recipients on the original RPC3 plugin, or with the compact header disabled, ignore the max age and do not get the added timestamp.
+	/// \param[in] maxAge Milliseconds. 0, the default, sends calls without a max age.
+	void SetMaxAge(RakNet::Time maxAge);
+
+	/// Drop calls and signals of \a uniqueIdentifier received on this system when they are older than \a maxAge, before their arguments are read
+	/// Meant for state that is resent anyway, such as movement, so a backlog after a stall is skipped instead of delaying everything behind it.
+	/// Applies to messages with an ID_TIMESTAMP, see SetTimestamp() and SetMaxAge(). When the sender also gave a max age, the shorter one is used.
+	/// Dropped calls are counted in RPC3Statistics::expiredCalls. A caller waiting with CallWithReply() gets RPC_ERROR_CALL_EXPIRED.
+	/// \param[in] uniqueIdentifier Identifier passed to RegisterFunction() or RegisterSlot()
+	/// \param[in] maxAge Milliseconds. 0 to run calls of \a uniqueIdentifier whatever their age, which is the default.
+	void SetHandlerMaxAge(const char *uniqueIdentifier, RakNet::Time maxAge);
+
+	/// Queue received calls of \a uniqueIdentifier until DispatchDeferredCalls(), instead of running them in RakPeerInterface::Receive()
+	/// Only for functions that do not need to run in order with calls of other functions, such as movement or aim updates.
+	/// The header is read, the function and objects checked and errors sent when the call arrives. The parameters are copied out of the packet, and read when the call runs.
+	/// Signals always run when they arrive.
+	/// \param[in] uniqueIdentifier Identifier passed to RegisterFunction()
+	/// \param[in] deferred False to run calls of \a uniqueIdentifier when they arrive again. Calls already queued still wait for DispatchDeferredCalls().
+	void SetDeferredDispatch(const char *uniqueIdentifier, bool deferred);
+
+	/// Runs the calls queued since the last dispatch, see SetDeferredDispatch()
+	/// Grouping runs each handler over all of its calls in a row, which keeps its code and data in the cache. Objects deleted meanwhile get RPC_ERROR_OBJECT_DOES_NOT_EXIST, as on arrival.
+	/// Calls received while handlers run wait for the next dispatch. Traces and the slow handler callback count the time queued as decoding.
+	/// \param[in] order See RPC3DispatchOrder
+	/// \return The number of calls run
+	unsigned int DispatchDeferredCalls(RPC3DispatchOrder order=RPC3_DISPATCH_GROUPED);
+
+	/// \return The number of calls waiting for DispatchDeferredCalls()
+	unsigned int GetDeferredCallCount(void) const;
+
+	/// Signal a RPC3Wakeup from RakNet's network thread as soon as an ID_RPC_PLUGIN message is received, so the thread pumping RakPeerInterface::Receive() can block in between
+	/// Call before RakPeerInterface::AttachPlugin(). RakNet only runs the network thread callbacks of plugins that asked for them when attached, and such plugins cannot be detached while RakPeerInterface is started.
+	/// The event stays set until RakPeerInterface::Receive() has passed every signalled message to this plugin. Other messages, such as connection notifications, do not set it.
+	/// \code
+	/// rpc3.EnableWakeup();
+	/// rakPeer->AttachPlugin(&rpc3);
+	/// while (running)
+	/// {
+	/// 	rpc3.WaitForCalls(100); // Or epoll on rpc3.GetWakeupFileDescriptor()
+	/// 	for (packet=rakPeer->Receive(); packet; rakPeer->DeallocatePacket(packet), packet=rakPeer->Receive())
+	/// 		HandlePacket(packet);
+	/// }
+	/// \endcode
+	void EnableWakeup(void);
+
+	/// Blocks until a call may be waiting in RakPeerInterface::Receive(), or until Wake() is called
+	/// Wakeups can be spurious, so keep a timeout short enough for messages that do not set the event.
+	/// \param[in] timeoutMs Longest wait in milliseconds
+	/// \return True if woken, false on timeout or if EnableWakeup() was not called
+	bool WaitForCalls(RakNet::TimeMS timeoutMs);
+
+	/// Sets the event until the next RakPeerInterface::Receive(). Threadsafe.
+	/// RPC3ShardGroup wakes a shard this way when a call is posted to it.
+	void Wake(void);
+
+	/// \return Descriptor to add to epoll, poll or select, readable while WaitForCalls() would return at once. -1 on Windows or without EnableWakeup().
+	int GetWakeupFileDescriptor(void) const;
+
+	/// Spread ordered and sequenced calls with a recipient object over several ordering channels, picked by hashing the NetworkID
+	/// Calls on the same object stay in order. Calls on different objects no longer wait for each other's lost packets.
+	/// The channel from SetSendParams() or SetSendPolicy() is replaced. Calls made with CallCPPMulti() keep it.
+	/// \param[in] firstChannel First ordering channel to use
+	/// \param[in] channelCount Number of channels from \a firstChannel, limited to the channels RakNet has. 0, the default, disables this.
+	void SetObjectOrderingChannels(char firstChannel, unsigned char channelCount);
+
 	/// Set parameters to pass to RakPeer::Send() for all following calls to Call()
 	/// Deafults to HIGH_PRIORITY, RELIABLE_ORDERED, ordering channel 0
 	/// \param[in] priority See RakPeer::Send()
@@ -236,6 +658,7 @@ public:
 	///
 	/// \note If you need endian swapping (Mac talking to PC for example), you pretty much need to define operator << and operator >> for all classes you want to serialize. Otherwise the member variables will not be endian swapped.
 	/// \note If the call fails on the remote system, you will get back ID_RPC_REMOTE_ERROR. packet->data[1] will contain one of the values of RPCErrorCodes. packet->data[2] and on will contain the name of the function.
+	/// \note A call addressed to this system runs before Call() returns, without serializing, if the registered function takes exactly the types passed and none of them is a pointer other than to a NetworkIDObject or RPC3. Otherwise it goes through RakNet and runs when received.
 	///
 	/// \param[in] uniqueIdentifier parameter of the same name passed to RegisterFunction() on the remote system
 	template<typename... Args>
@@ -294,6 +717,93 @@ public:
 		return Call(uniqueIdentifier, args...);
 	}
 
+	/// Calls a C++ member function on several objects with one message, like calling CallCPP() once per object
+	/// The arguments are serialized and sent once, and the NetworkIDs are delta coded. The receiver decodes the arguments once and calls the member on each object in the order given, so pointer arguments are shared between the calls.
+	/// Objects missing on the receiver are skipped and reported together with RPC_ERROR_OBJECTS_DO_NOT_EXIST.
+	/// Recipients on the legacy layout get one message per object instead.
+	/// \param[in] uniqueIdentifier parameter of the same name passed to RegisterFunction() on the remote system
+	/// \param[in] networkIDs Objects to call the member on
+	/// \param[in] networkIDCount Number of elements in \a networkIDs
+	template<typename... Args>
+	bool CallCPPMulti(const char *uniqueIdentifier, const NetworkID *networkIDs, unsigned int networkIDCount, const Args&... args) {
+		if (networkIDCount==0)
+			return false;
+		SetRecipientObject(networkIDs[0]);
+		if (networkIDCount > 1)
+		{
+			outgoingNetworkIDs = networkIDs;
+			outgoingNetworkIDCount = networkIDCount;
+		}
+		bool result = Call(uniqueIdentifier, args...);
+		outgoingNetworkIDs = 0;
+		outgoingNetworkIDCount = 0;
+		return result;
+	}
+
+	template<typename... Args>
+	bool CallCPPMulti(const char *uniqueIdentifier, const std::vector<NetworkID> &networkIDs, const Args&... args) {
+		if (networkIDs.empty())
+			return false;
+		return CallCPPMulti(uniqueIdentifier, &networkIDs[0], (unsigned int) networkIDs.size(), args...);
+	}
+
+	/// \param[in] status How the call ended
+	/// \param[in] reply With RPC3_REPLY_OK, positioned at the first value passed to Reply(). With RPC3_REPLY_REMOTE_ERROR, holds the error code. Otherwise 0. Only valid during the callback.
+	typedef std::function<void(RPC3ReplyStatus status, RakNet::BitStream *reply)> ReplyCallback;
+
+	/// Same as Call(), and runs \a callback once with the outcome of the call
+	/// The remote handler answers with Reply(), using the token from GetReplyToken(). Waiting for the answer takes no thread, \a callback runs from RakPeerInterface::Receive() like any incoming call.
+	/// \a callback runs exactly once: with the reply, a remote error, a timeout, a disconnect, or right away if the call could not be sent.
+	/// The call goes to one system, the one passed to SetRecipientAddress(), or when broadcasting the only connected system. Requires the compact header on both ends.
+	/// \param[in] uniqueIdentifier parameter of the same name passed to RegisterFunction() on the remote system
+	/// \param[in] callback Receives the outcome
+	/// \return True if the call was sent
+	template<typename... Args>
+	bool CallWithReply(const char *uniqueIdentifier, const ReplyCallback &callback, const Args&... args) {
+		SystemAddress lastSystemAddress = outgoingSystemAddress;
+		bool lastBroadcast = outgoingBroadcast;
+		if (BeginCallWithReply(callback)==false)
+			return false;
+		bool result = Call(uniqueIdentifier, args...);
+		EndCallWithReply(result);
+		outgoingSystemAddress = lastSystemAddress;
+		outgoingBroadcast = lastBroadcast;
+		return result;
+	}
+
+	template<typename... Args>
+	bool CallCWithReply(const char *uniqueIdentifier, const ReplyCallback &callback, const Args&... args) {
+		SetRecipientObject(UNASSIGNED_NETWORK_ID);
+		return CallWithReply(uniqueIdentifier, callback, args...);
+	}
+
+	template<typename... Args>
+	bool CallCPPWithReply(const char *uniqueIdentifier, NetworkID nid, const ReplyCallback &callback, const Args&... args) {
+		SetRecipientObject(nid);
+		return CallWithReply(uniqueIdentifier, callback, args...);
+	}
+
+	/// Returns the token to answer the call currently being handled with Reply()
+	/// Only meaningful inside a registered function. Keep the token to reply later, for example from a resumed coroutine.
+	/// \return Invalid token if the caller did not use CallWithReply()
+	RPC3ReplyToken GetReplyToken(void) const;
+
+	/// Answers a call made with CallWithReply()
+	/// Values are serialized like the parameters of Call(), and are sent with whatever was last passed to SetSendParams()
+	/// \param[in] replyToken From GetReplyToken() while handling the call. A token can be answered once.
+	/// \return false if the token is invalid or the caller is no longer connected
+	template<typename... Args>
+	bool Reply(const RPC3ReplyToken &replyToken, const Args&... args) {
+		RakNet::BitStream bitStream;
+		bitStream.Write((unsigned char) RPC3_REPLY_OK);
+		_RPC3::RpcCall::Serialize(bitStream, args...);
+		return SendReply(replyToken, &bitStream);
+	}
+
+	/// Fail calls made with CallWithReply() with RPC3_REPLY_TIMEOUT if no reply arrives within \a timeoutMS
+	/// \param[in] timeoutMS Milliseconds to wait. 0, the default, waits until the connection closes.
+	void SetReplyTimeout(RakNet::TimeMS timeoutMS);
+
 
 	// ---------------------------- Signals and slots ----------------------------------
 
@@ -302,6 +812,7 @@ public:
 	/// You can use CallExplicit() instead of Call() to force yourself not to forget to set parameters
 	///
 	/// See the Call() function for a description of parameters
+	/// Slots on this system run first. Those taking exactly the types passed get the arguments without serializing, as for a call addressed to this system. A signal addressed to this system runs its slots once.
 	///
 	/// \param[in] sharedIdentifier parameter of the same name passed to RegisterSlot() on the remote system
 	
@@ -347,12 +858,41 @@ public:
 		_RPC3::FunctionPointer functionPointer;
 	};
 
+	/// \internal
+	/// Replaces the send parameters with the policy of \a uniqueIdentifier and the channel of the recipient object, if any
+	void ApplySendPolicy(const char *uniqueIdentifier, bool isCall);
+
 	/// \internal
 	/// Sends the RPC call, with a given serialized function
-	bool SendCallOrSignal(RakString uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall);
+	bool SendCallOrSignal(const char *uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall);
+
+	/// \internal
+	/// Where a call or signal goes, decided before its parameters are serialized
+	struct LocalDelivery
+	{
+		/// Function on this system to run with the caller's arguments, for a call addressed to this system
+		LocalRPCFunction *localFunction;
+		/// Slots on this system, for a signal
+		LocalSlot *localSlot;
+		/// Parameters are needed serialized, for other systems or for local slots that cannot take the arguments as they are
+		bool serialize;
+		/// A message goes out, and SendCallOrSignal() gives the result
+		bool send;
+		/// Result when nothing is sent
+		bool result;
+	};
+	/// \internal
+	/// \param[in] localArgsType Argument types of the caller, from _RPC3::GetLocalArgsType()
+	LocalDelivery GetLocalDelivery(const char *uniqueIdentifier, bool isCall, const std::type_info *localArgsType);
+	/// \internal
+	/// Runs a call addressed to this system with the caller's arguments, as if it had been received from this system
+	void InvokeLocalCall(LocalRPCFunction *localFunction, const void *localArgs);
 
 	/// Call a given signal with a bitstream representing the parameter list
+	/// Slots whose parameter types are \a localArgsType take \a localArgs instead of reading \a serializedParameters
 	void InvokeSignal(DataStructures::HashIndex functionIndex, RakNet::BitStream *serializedParameters, bool temporarilySetUSA);
+	void InvokeSignal(LocalSlot *localSlot, const char *sharedIdentifier, RakNet::BitStream *serializedParameters, bool temporarilySetUSA,
+		const void *localArgs=0, const std::type_info *localArgsType=0);
 
 
 	protected:
@@ -363,40 +903,484 @@ public:
 	void OnAttach(void);
 	virtual PluginReceiveResult OnReceive(Packet *packet);
 	virtual void OnRPC3Call(const SystemAddress &systemAddress, unsigned char *data, unsigned int lengthInBytes);
+	virtual void OnNewConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, bool isIncoming);
 	virtual void OnClosedConnection(const SystemAddress &systemAddress, RakNetGUID rakNetGUID, PI2_LostConnectionReason lostConnectionReason );
 	virtual void OnShutdown(void);
+	virtual void OnRakPeerShutdown(void);
+
+	virtual void Update(void);
+
+	/// True after EnableWakeup(), for RakNet to call OnInternalPacket() from its network thread
+	virtual bool UsesReliabilityLayer(void) const;
+	virtual void OnInternalPacket(InternalPacket *internalPacket, unsigned frameNumber, SystemAddress remoteSystemAddress, RakNet::TimeMS time, int isSend);
 
 	void Clear(void);
 
+	/// Appends one incoming message to the capture log
+	void CaptureMessage(const SystemAddress &systemAddress, RakNet::Time timestamp, unsigned char *data, unsigned int lengthInBytes);
+
+	/// \internal
+	/// Failed calls waiting to be reported together, see SetErrorReportInterval()
+	struct ErrorReport
+	{
+		unsigned char errorCode;
+		RakNet::RakString functionName;
+		uint32_t callCount;
+		/// Only for RPC_ERROR_OBJECTS_DO_NOT_EXIST
+		DataStructures::List<NetworkID> missingIds;
+	};
+
+	/// \internal
+	/// What we know about a connected system
+	struct RemoteSystem
+	{
+		RemoteSystem() : protocolVersion(RPC3_PROTOCOL_LEGACY), features(0), lastErrorReport(0) {}
+		unsigned char protocolVersion;
+		/// Combination of RPC3Features
+		uint32_t features;
+		/// Strings this system defined for _RPC3::InternedString arguments, by index
+		DataStructures::List<RakNet::RakString> receivedStrings;
+		/// For each of our interned strings, the ordering channel its definition was sent on with RELIABLE_ORDERED, or STRING_NOT_DEFINED
+		DataStructures::List<unsigned char> definedStringChannels;
+		/// Errors of this interval, and the one last added to, which a misbehaving system usually repeats
+		DataStructures::List<ErrorReport> errorReports;
+		unsigned int lastErrorReport;
+	};
+	enum {STRING_NOT_DEFINED=0xFF};
+
+	/// \internal
+	/// A _RPC3::Stream argument being sent to one system, or to be sent with the call being serialized
+	struct OutgoingStream
+	{
+		OutgoingStream() : id(0), sent(0), acknowledged(0), priority(HIGH_PRIORITY), orderingChannel(0) {}
+		std::shared_ptr<_RPC3::StreamState> state;
+		uint32_t id;
+		SystemAddress systemAddress;
+		/// Bytes handed to RakNet, and bytes the recipient acknowledged
+		uint32_t sent;
+		uint32_t acknowledged;
+		/// Of the call, which the chunks are sent with
+		PacketPriority priority;
+		char orderingChannel;
+	};
+	/// \internal
+	/// A _RPC3::Stream argument being received
+	struct IncomingStream
+	{
+		std::shared_ptr<_RPC3::StreamState> state;
+		uint32_t id;
+		SystemAddress systemAddress;
+	};
+
+	/// \internal
+	/// Optional parts of a compact message, flagged in its options field
+	enum CallOptions
+	{
+		CALL_OPTION_COMPRESSED=1<<0,
+		CALL_OPTION_REPLY_ID=1<<1,
+		CALL_OPTION_MULTI_TARGET=1<<2,
+		CALL_OPTION_STRING_DEFINITIONS=1<<3,
+		CALL_OPTION_COMPACT_DEREF=1<<4,
+		CALL_OPTION_ALIGNED_PARAMETERS=1<<5,
+		CALL_OPTION_TRACE=1<<6,
+		CALL_OPTION_MAX_AGE=1<<7,
+		CALL_OPTION_STREAMS=1<<8,
+	};
+
+	/// \internal
+	/// Interned string defined in the header of a call
+	struct StringDefinition
+	{
+		uint32_t index;
+		RakNet::RakString string;
+	};
+
+	/// \internal
+	/// Stream argument of a call, announced in its header
+	struct StreamDefinition
+	{
+		uint32_t id;
+		uint32_t length;
+	};
+
+	/// \internal
+	/// Fixed part of an ID_RPC_PLUGIN message, in either layout
+	struct CallHeader
+	{
+		char parameterCount;
+		bool isCall;
+		bool hasNetworkId;
+		NetworkID networkId;
+		uint32_t options;
+		char identifier[512];
+		/// Size of the parameters before compression, with CALL_OPTION_COMPRESSED
+		BitSize_t uncompressedBits;
+		/// With CALL_OPTION_REPLY_ID, the id to answer with
+		uint32_t replyId;
+		/// With CALL_OPTION_MULTI_TARGET, the objects to call
+		DataStructures::List<NetworkID> targetIds;
+		/// With CALL_OPTION_STRING_DEFINITIONS, strings the parameters refer to by index
+		DataStructures::List<StringDefinition> stringDefinitions;
+		/// With CALL_OPTION_TRACE, the id the sender traces the call with
+		uint32_t traceId;
+		/// With CALL_OPTION_TRACE, the ID_TIMESTAMP of the message was only added for the trace
+		bool traceTimestamp;
+		/// With CALL_OPTION_MAX_AGE, milliseconds after which the call is dropped unread
+		RakNet::Time maxAge;
+		/// With CALL_OPTION_MAX_AGE, the ID_TIMESTAMP of the message was only added for the max age
+		bool maxAgeTimestamp;
+		/// With CALL_OPTION_STREAMS, the streams whose chunks follow the call
+		DataStructures::List<StreamDefinition> streams;
+	};
+
+	/// \internal
+	/// Parameters of one call compressed once, for all recipients that read compression
+	struct CompressedParameters
+	{
+		BitSize_t uncompressedBits;
+		unsigned int compressedBytes;
+		RakNet::BitStream data;
+	};
+
+	/// Writes and sends one message to \a systemAddress, from the start of \a bs
+	/// Splits a CallCPPMulti() call into one message per object if \a remoteSystem cannot read the object list.
+	/// \param[in] timestamp ID_TIMESTAMP to send, or 0 for none
+	/// \param[in] maxAgeTimestamp ID_TIMESTAMP to send instead if \a remoteSystem reads the max age
+	void SendToSystem(RakNet::BitStream *bs, RakNet::Time timestamp, RakNet::Time maxAgeTimestamp, const SystemAddress &systemAddress, RemoteSystem *remoteSystem, const char *uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall, const CompressedParameters *compressedParameters);
+	void SendObjectsMissingError(const SystemAddress &target, const char *functionName, const DataStructures::List<NetworkID> &missingIds);
+	/// Adds a failed call to the report for \a target, see SetErrorReportInterval()
+	/// \return false if \a target is not connected, to send the error at once
+	bool QueueErrorReport(const SystemAddress &target, unsigned char errorCode, const char *functionName, const DataStructures::List<NetworkID> *missingIds);
+	/// Sends and clears the reports of every system with queued errors
+	void SendErrorReports(void);
+	/// Looks up the objects of a CallCPPMulti() call, reporting those that do not exist
+	/// \return false if none exist
+	bool GetTargetObjects(const SystemAddress &systemAddress, const char *functionName, const DataStructures::List<NetworkID> &targetIds, DataStructures::List<NetworkIDObject*> &targetObjects);
+	/// Runs a call of \a localFunction on \a networkIdObject, or on each of \a targetObjects if there are any
+	void InvokeFunction(LocalRPCFunction *localFunction, RakNet::BitStream *serializedParameters, NetworkIDObject *networkIdObject, DataStructures::List<NetworkIDObject*> &targetObjects, RakNet::TimeUS *decodedTime);
+	/// Answers the call being handled with RPC3_REPLY_REMOTE_ERROR, if its caller waits for a reply
+	void SendErrorReply(const SystemAddress &target, unsigned char errorCode);
+	/// \return True if the message \a header belongs to, sent at \a senderTimestamp, is older than its max age
+	bool IsCallExpired(const CallHeader &header, RakNet::Time senderTimestamp);
+	/// Writes the header and the parameters of one message for \a remoteSystem, 0 for the legacy layout
+	/// \return true if the header ends on a byte boundary and large parameters were left out, for SendCallOrSignalMessage() to send from their own buffer
+	bool WriteCallOrSignal(RakNet::BitStream *bs, const char *uniqueIdentifier, char parameterCount, RakNet::BitStream *serializedParameters, bool isCall, RemoteSystem *remoteSystem, const CompressedParameters *compressedParameters);
+	/// Sends a message written by WriteCallOrSignal(), gathering the parameters it left out behind the header
+	void SendCallOrSignalMessage(RakNet::BitStream *bs, bool parametersLeftOut, RakNet::BitStream *serializedParameters, const CompressedParameters *compressedParameters,
+		PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress);
+	/// \return True if \a compressedParameters now holds a compressed copy worth sending
+	bool CompressParameters(const char *uniqueIdentifier, RakNet::BitStream *serializedParameters, CompressedParameters *compressedParameters);
+	/// Replaces the parameters read from \a bs with their decompressed form in \a decompressed
+	bool DecompressParameters(RakNet::BitStream *bs, const CallHeader &header, RakNet::BitStream *decompressed);
+	/// Reads the header of one message and leaves \a bs at the first parameter bit
+	/// \return false if the message is malformed
+	bool ReadCallHeader(RakNet::BitStream *bs, CallHeader *header);
+
+	RemoteSystem *GetRemoteSystem(const SystemAddress &systemAddress);
+	/// \return The remote system if it reads the compact layout, otherwise 0
+	RemoteSystem *GetCompactRemoteSystem(const SystemAddress &systemAddress);
+	/// \internal
+	/// State of the call being serialized by _RPC3::RpcCall
+	struct OutgoingCall
+	{
+		OutgoingCall() : recipientFeatures(0), recipientFeaturesKnown(false), compactDeref(false), traceId(0), traceTimestamp(false) {}
+		/// Interned strings used by the parameters, defined in the header for recipients that do not know them yet
+		DataStructures::List<unsigned int> internedIds;
+		/// RPC3Features every recipient supports, looked up once per call
+		uint32_t recipientFeatures;
+		bool recipientFeaturesKnown;
+		/// Objects were written with the compact Deref framing
+		bool compactDeref;
+		/// Non-zero if the call is sampled for tracing, see EnableTracing()
+		uint32_t traceId;
+		RakNet::TimeUS traceTimes[RPC3_TRACE_SENT];
+		/// An ID_TIMESTAMP was added to the message for the recipient to time the network
+		bool traceTimestamp;
+		/// Stream arguments to send in chunks, given to each recipient once the call went out
+		std::vector<OutgoingStream> streams;
+	};
+
+	/// Gives \a call a trace id if it is sampled
+	void BeginCallTrace(OutgoingCall *call)
+	{
+		if (traceSampleInterval==0 || ++traceSampleCounter < traceSampleInterval)
+			return;
+		traceSampleCounter=0;
+		if (++lastTraceId==0)
+			lastTraceId=1;
+		call->traceId=lastTraceId;
+		call->traceTimes[RPC3_TRACE_CALL]=RakNet::GetTimeUS();
+	}
+	/// Records the sending side of a traced call
+	void AddOutgoingTrace(const char *uniqueIdentifier, bool isCall, const OutgoingCall *call);
+	/// Records the handling side of a received call, and runs the slow handler callback
+	void AddIncomingTrace(const SystemAddress &systemAddress, const CallHeader &header, RPC3TraceRecord *record);
+	/// First half of AddIncomingTrace(), filling in what the record needs from the header
+	void DescribeIncomingTrace(const SystemAddress &systemAddress, const CallHeader &header, RPC3TraceRecord *record);
+	/// Second half of AddIncomingTrace(), once the handler returned
+	void FinishIncomingTrace(RPC3TraceRecord *record);
+
+	/// \return Bits to reserve for the parameters of \a uniqueIdentifier, from the calls sent with it before
+	BitSize_t GetParameterBitsEstimate(const char *uniqueIdentifier) const;
+	void UpdateParameterBitsEstimate(const char *uniqueIdentifier, BitSize_t bitsUsed);
+
+	/// \return The RPC3Features every recipient of the call being serialized supports. All of them when the call is only handled locally.
+	uint32_t GetRecipientFeatures(void);
+	/// \return True if objects passed with _RPC3::Deref() can be framed compactly in the call being serialized
+	bool CanUseCompactDeref(void);
+	/// Looks up \a string in the interning table, adding it if there is room
+	bool InternString(const RakNet::RakString &string, unsigned int *index);
+	void WriteInternedString(RakNet::BitStream &bitStream, const RakNet::RakString &string);
+	bool ReadInternedString(RakNet::BitStream &bitStream, RakNet::RakString &string);
+	void OnStringDefinitions(const SystemAddress &systemAddress, const CallHeader &header);
+	void SendHandshake(const SystemAddress &systemAddress);
+	void OnHandshake(const SystemAddress &systemAddress, RakNet::BitStream *parameters);
+	void ClearRemoteSystems(void);
+
+	void WriteStream(RakNet::BitStream &bitStream, const _RPC3::Stream &stream);
+	bool ReadStream(RakNet::BitStream &bitStream, _RPC3::Stream &stream);
+	/// Starts receiving the streams announced in \a header
+	void OnStreamDefinitions(const SystemAddress &systemAddress, const CallHeader &header);
+	/// Gives the streams of the call just sent to \a systemAddress, and starts sending their chunks
+	void AddOutgoingStreams(const SystemAddress &systemAddress, PacketPriority priority, char orderingChannel);
+	/// Sends chunks to \a systemAddress while its window allows, one stream after the other
+	void SendStreams(const SystemAddress &systemAddress);
+	/// Sends \a length bytes of \a outgoingStream from where it is, or tells the recipient it was cancelled
+	void SendStreamChunk(const OutgoingStream &outgoingStream, unsigned int length, bool cancelled);
+	void SendStreamAck(const SystemAddress &systemAddress, uint32_t id, bool cancelled, uint32_t received);
+	/// Writes an internal call with \a parameters, followed by \a dataLength bytes on a byte boundary
+	void SendStreamMessage(const char *identifier, RakNet::BitStream *parameters, const unsigned char *data, unsigned int dataLength,
+		PacketPriority priority, PacketReliability reliability, char orderingChannel, const SystemAddress &systemAddress);
+	void OnStreamChunk(const SystemAddress &systemAddress, RakNet::BitStream *parameters);
+	void OnStreamAck(const SystemAddress &systemAddress, RakNet::BitStream *parameters);
+	/// Removes incoming stream \a index, then runs its complete handler with \a status
+	void FinishIncomingStream(size_t index, _RPC3::StreamStatus status);
+	void EraseOutgoingStream(size_t index);
+	/// Called through _RPC3::Stream::Cancel()
+	void CancelStream(const std::shared_ptr<_RPC3::StreamState> &state);
+	/// Cancels incoming streams that no handler kept or set a handler on
+	void ReleaseUnusedStreams(void);
+	/// Drops the streams from and to \a systemAddress, or all of them if UNASSIGNED_SYSTEM_ADDRESS
+	/// \param[in] runHandlers False on destruction, where complete handlers could reach back into a dying plugin
+	void ClearStreams(const SystemAddress &systemAddress, bool runHandlers);
+
+	/// \internal
+	/// A call made with CallWithReply() waiting for its answer
+	struct PendingReply
+	{
+		uint32_t replyId;
+		SystemAddress systemAddress;
+		RakNet::TimeMS sendTime;
+		ReplyCallback callback;
+	};
+	static int PendingReplyComp( const uint32_t &key, PendingReply * const &data );
+
+	/// Picks the recipient and registers \a callback under a new reply id, which the following Call() sends
+	bool BeginCallWithReply(const ReplyCallback &callback);
+	void EndCallWithReply(bool sent);
+	bool SendReply(const RPC3ReplyToken &replyToken, RakNet::BitStream *parameters);
+	void OnReply(const SystemAddress &systemAddress, uint32_t replyId, RakNet::BitStream *parameters);
+	/// Deletes \a pendingReply, then runs its callback
+	void CompletePendingReply(PendingReply *pendingReply, RPC3ReplyStatus status, RakNet::BitStream *reply);
+	/// Completes the pending replies from \a systemAddress, or all of them if UNASSIGNED_SYSTEM_ADDRESS, with RPC3_REPLY_DISCONNECTED
+	void FailPendingReplies(const SystemAddress &systemAddress);
+	void ClearPendingReplies(void);
+
 	void SendError(SystemAddress target, unsigned char errorCode, const char *functionName);
 	DataStructures::HashIndex GetLocalFunctionIndex(RPCIdentifier identifier);
 	DataStructures::HashIndex GetLocalSlotIndex(const char *sharedIdentifier);
+	/// Uses the frozen index if available, otherwise the registration hash
+	LocalRPCFunction *GetLocalFunction(const char *uniqueIdentifier);
+	LocalSlot *GetLocalSlot(const char *sharedIdentifier);
+	/// Returns the slots of \a sharedIdentifier registered on this instance, adding them if there are none yet
+	LocalSlot *AddLocalSlot(const char *sharedIdentifier);
+	void ThawRegistry(void);
+	/// \return True if sending to \a systemAddress loops back to this system
+	bool IsLocalSystem(const SystemAddress &systemAddress) const;
+	/// \return True if a call with the current recipient object can run \a localFunction directly
+	bool CanInvokeLocalCall(LocalRPCFunction *localFunction, const std::type_info *localArgsType);
+	/// Resolves the recipient objects of a call addressed to this system
+	/// \return false if one of them does not exist
+	bool GetLocalTargets(DataStructures::List<NetworkIDObject*> &targetObjects);
 
 	DataStructures::Hash<RakNet::RakString, LocalSlot*,256, RakNet::RakString::ToInteger> localSlots;
 	DataStructures::Hash<RakNet::RakString, LocalRPCFunction*,256, RakNet::RakString::ToInteger> localFunctions;
 
+	/// Filled by FreezeRegistry(), empty otherwise
+	_RPC3::FrozenRegistry<LocalSlot*> frozenSlots;
+	_RPC3::FrozenRegistry<LocalRPCFunction*> frozenFunctions;
+	bool registryFrozen;
+	/// Set by SetSharedRegistry(), lookups go there instead of the tables above
+	RPC3 *sharedRegistry;
+	/// Set by RPC3ShardGroup::AddShard()
+	RPC3ShardGroup *shardGroup;
+	unsigned int shardIndex;
+	friend class RPC3ShardGroup;
+
 	RakNet::Time outgoingTimestamp;
+	/// See SetMaxAge()
+	RakNet::Time outgoingMaxAge;
 	PacketPriority outgoingPriority;
 	PacketReliability outgoingReliability;
 	char outgoingOrderingChannel;
 	SystemAddress outgoingSystemAddress;
 	bool outgoingBroadcast;
 	NetworkID outgoingNetworkID;
+	/// Set during CallCPPMulti() to more than one object
+	const NetworkID *outgoingNetworkIDs;
+	unsigned int outgoingNetworkIDCount;
 	RakNet::BitStream outgoingExtraData;
 
 	RakNet::Time incomingTimeStamp;
+	/// When the message being handled came out of RakPeerInterface::Receive(), on the clock of incomingTimeStamp
+	RakNet::Time incomingReceiveTime;
 	SystemAddress incomingSystemAddress;
 	RakNet::BitStream incomingExtraData;
+	/// The message being handled uses the compact Deref framing
+	bool incomingCompactDeref;
 
 	NetworkIDManager *networkIdManager;
 	char currentExecution[512];
 
-	/// Used so slots are called in the order they are registered
-	unsigned int nextSlotRegistrationCount;
+	DataStructures::Hash<SystemAddress, RemoteSystem*, 2048, SystemAddress::ToInteger> remoteSystems;
+	bool compactHeaderEnabled;
+
+	unsigned int compressionThreshold;
+	DataStructures::Hash<RakNet::RakString, bool, 64, RakNet::RakString::ToInteger> compressedIdentifiers;
+	DataStructures::Hash<RakNet::RakString, RPC3SendPolicy, 64, RakNet::RakString::ToInteger> sendPolicies;
+	/// See SetHandlerMaxAge()
+	DataStructures::Hash<RakNet::RakString, RakNet::Time, 64, RakNet::RakString::ToInteger> handlerMaxAges;
+
+	/// \internal
+	/// A received call waiting for DispatchDeferredCalls()
+	struct DeferredCall
+	{
+		/// Shares the buffer of the key in deferredIdentifiers
+		RPCIdentifier identifier;
+		/// Value of \a identifier in deferredIdentifiers
+		unsigned int group;
+		SystemAddress systemAddress;
+		RakNet::Time timeStamp;
+		uint32_t replyId;
+		bool compactDeref;
+		/// Object to call, UNASSIGNED_NETWORK_ID for a C function or a CallCPPMulti() call
+		NetworkID networkId;
+		/// Objects of a CallCPPMulti() call
+		DataStructures::List<NetworkID> targetIds;
+		/// Parameters, from _RPC3::AcquireBitStream()
+		RakNet::BitStream *parameters;
+		/// Set if the call is timed, see EnableTracing() and SetSlowHandlerCallback()
+		RPC3TraceRecord *traceRecord;
+		/// Stream arguments, kept from being cancelled as unused until the call runs
+		std::vector<std::shared_ptr<_RPC3::StreamState> > streams;
+	};
+	/// Identifiers passed to SetDeferredDispatch(), with the group their calls are sorted by
+	DataStructures::Hash<RakNet::RakString, unsigned int, 64, RakNet::RakString::ToInteger> deferredIdentifiers;
+	unsigned int nextDeferredGroup;
+	std::vector<DeferredCall> deferredCalls;
+	/// Calls being run by DispatchDeferredCalls(), and the order to run them in
+	std::vector<DeferredCall> dispatchingCalls;
+	std::vector<unsigned int> dispatchOrder;
+	/// Queues the call being handled, whose header and objects were checked
+	void DeferCall(const SystemAddress &systemAddress, const RPCIdentifier &identifier, unsigned int group, const CallHeader &header, RakNet::BitStream *serializedParameters,
+		const DataStructures::List<NetworkIDObject*> &targetObjects, const RPC3TraceRecord *traceRecord);
+	/// Frees the queued calls, all of them if \a systemAddress is UNASSIGNED_SYSTEM_ADDRESS
+	void ClearDeferredCalls(const SystemAddress &systemAddress);
+
+	/// Set by EnableWakeup()
+	RPC3Wakeup *wakeup;
+	/// ID_RPC_PLUGIN messages seen by the network thread, and how many of them reached OnReceive()
+	std::atomic<uint32_t> signalledMessages;
+	uint32_t receivedMessages;
+	/// Set by Wake(), cleared by the next Update()
+	std::atomic<bool> wakeRequested;
+	/// RakNet may report a message that never reaches OnReceive(), such as a resent duplicate.
+	/// The counts are made equal again once receivedMessages stalls behind for a while, and receivedMessages is never counted past signalledMessages.
+	bool wakeupStalled;
+	uint32_t wakeupStallCount;
+	RakNet::TimeMS wakeupStallTime;
+	/// Clears the event once every signalled message was received and no Wake() is pending
+	void ResetWakeup(void);
+
+	/// \internal
+	/// One entry of the table behind RegisterObject()
+	struct ObjectHandle
+	{
+		NetworkIDObject *object;
+		/// The full id, which includes the generation, or UNASSIGNED_NETWORK_ID if the entry is free
+		NetworkID networkId;
+		/// Of the last object in the entry, incremented when the entry is reused
+		uint32_t generation;
+	};
+	DataStructures::List<ObjectHandle> objectHandles;
+	/// Entries freed by UnregisterObject(), reused last in first out
+	DataStructures::List<uint32_t> freeObjectHandles;
+
+	/// See SetErrorReportInterval()
+	RakNet::TimeMS errorReportInterval;
+	unsigned int maxErrorReports;
+	RakNet::TimeMS lastErrorReportTime;
+	/// Systems with queued errors
+	DataStructures::List<SystemAddress> errorReportSystems;
+
+	/// See SetStreamWindow()
+	unsigned int streamWindow;
+	unsigned int streamChunkBytes;
+	uint32_t nextStreamId;
+	/// In the order the calls were sent, which is the order their chunks go out in
+	std::vector<OutgoingStream> outgoingStreams;
+	std::vector<IncomingStream> incomingStreams;
+	char objectOrderingChannel;
+	unsigned char objectOrderingChannelCount;
+	RPC3Statistics statistics;
+
+	DataStructures::OrderedList<uint32_t, PendingReply*, PendingReplyComp> pendingReplies;
+	uint32_t nextReplyId;
+	/// Sent with the next call when not 0
+	uint32_t outgoingReplyId;
+	/// Reply id of the call being handled, 0 if none
+	uint32_t incomingReplyId;
+	RakNet::TimeMS replyTimeout;
+
+	/// Strings sent as _RPC3::InternedString, by index, and the index of each
+	DataStructures::List<RakNet::RakString> internedStrings;
+	DataStructures::Hash<RakNet::RakString, unsigned int, 256, RakNet::RakString::ToInteger> internedStringIndices;
+	unsigned int internedStringLimit;
+	/// Set by _RPC3::RpcCall while serializing and sending, 0 otherwise
+	OutgoingCall *outgoingCall;
+
+	/// \internal
+	/// Recent parameter size of one outgoing identifier
+	struct ParameterBitsEstimate
+	{
+		const char *uniqueIdentifier;
+		BitSize_t bits;
+	};
+	/// Direct mapped by the address of the identifier, which is normally a string literal.
+	/// A collision only costs a badly sized reservation.
+	enum {PARAMETER_BITS_ESTIMATES=64};
+	ParameterBitsEstimate parameterBitsEstimates[PARAMETER_BITS_ESTIMATES];
+
+	_RPC3::CaptureLog *captureLog;
+	RakNet::TimeUS captureStartTime;
+
+	RPC3Tracer *tracer;
+	unsigned int traceSampleInterval;
+	unsigned int traceSampleCounter;
+	uint32_t lastTraceId;
+	RakNet::TimeUS slowHandlerThreshold;
+	SlowHandlerCallback slowHandlerCallback;
+	/// Set while the handlers of a timed message run, for the first one to store when its arguments are read
+	RakNet::TimeUS *incomingDecodedTime;
 
 	bool interruptSignal;
 	
 	friend _RPC3::RpcCall;
+	friend void _RPC3::WriteInternedString(RPC3 *rpc, RakNet::BitStream &bitStream, const RakNet::RakString &string);
+	friend bool _RPC3::ReadInternedString(RPC3 *rpc, RakNet::BitStream &bitStream, RakNet::RakString &string);
+	friend void _RPC3::WriteStream(RPC3 *rpc, RakNet::BitStream &bitStream, const _RPC3::Stream &stream);
+	friend bool _RPC3::ReadStream(RPC3 *rpc, RakNet::BitStream &bitStream, _RPC3::Stream &stream);
+	friend struct _RPC3::Stream;
 };
 
 } // End namespace
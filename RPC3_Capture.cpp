@@ -0,0 +1,238 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#include "RPC3_Capture.h"
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace RakNet
+{
+namespace _RPC3
+{
+
+static const char CAPTURE_MAGIC[8] = {'R','P','C','3','C','A','P','\0'};
+static const uint32_t CAPTURE_VERSION=1;
+static const uint64_t CAPTURE_INITIAL_BYTES=1<<20;
+
+// uint32 record size, uint64 receive time, uint64 sender timestamp, uint32 payload size,
+// then the sender address and identifier as null terminated strings, then the payload
+static const unsigned int RECORD_FIXED_BYTES=4+8+8+4;
+
+CaptureLog::CaptureLog() : fileDescriptor(-1), base(0), mappedBytes(0), readOffset(0), writable(false)
+{
+}
+
+CaptureLog::~CaptureLog()
+{
+	Close();
+}
+
+#if defined(_WIN32)
+
+// Capture needs mmap, and is not available on this platform yet
+bool CaptureLog::Create(const char *path) {(void) path; return false;}
+bool CaptureLog::Open(const char *path) {(void) path; return false;}
+void CaptureLog::Close(void) {}
+bool CaptureLog::Map(uint64_t bytes) {(void) bytes; return false;}
+
+#else
+
+bool CaptureLog::Create(const char *path)
+{
+	Close();
+	fileDescriptor = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fileDescriptor < 0)
+		return false;
+	writable=true;
+	if (Map(CAPTURE_INITIAL_BYTES)==false)
+	{
+		Close();
+		return false;
+	}
+	Header *header = GetHeader();
+	memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+	header->version=CAPTURE_VERSION;
+	header->headerBytes=sizeof(Header);
+	header->usedBytes=sizeof(Header);
+	header->recordCount=0;
+	return true;
+}
+
+bool CaptureLog::Open(const char *path)
+{
+	Close();
+	fileDescriptor = open(path, O_RDONLY);
+	if (fileDescriptor < 0)
+		return false;
+	struct stat fileStat;
+	if (fstat(fileDescriptor, &fileStat)!=0 || (uint64_t) fileStat.st_size < sizeof(Header) || Map((uint64_t) fileStat.st_size)==false)
+	{
+		Close();
+		return false;
+	}
+	Header *header = GetHeader();
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic))!=0 || header->version!=CAPTURE_VERSION ||
+		header->headerBytes < sizeof(Header) || header->usedBytes < header->headerBytes || header->usedBytes > mappedBytes)
+	{
+		Close();
+		return false;
+	}
+	Rewind();
+	return true;
+}
+
+void CaptureLog::Close(void)
+{
+	if (base)
+	{
+		uint64_t usedBytes = GetHeader()->usedBytes;
+		munmap(base, (size_t) mappedBytes);
+		base=0;
+		if (writable)
+		{
+			// If trimming fails the trailing space is harmless, Open() stops at usedBytes
+			int result = ftruncate(fileDescriptor, (off_t) usedBytes);
+			(void) result;
+		}
+	}
+	if (fileDescriptor >= 0)
+	{
+		close(fileDescriptor);
+		fileDescriptor=-1;
+	}
+	mappedBytes=0;
+	readOffset=0;
+	writable=false;
+}
+
+bool CaptureLog::Map(uint64_t bytes)
+{
+	if (writable && ftruncate(fileDescriptor, (off_t) bytes)!=0)
+		return false;
+	// Replay hands the payload to code taking non-const buffers, so reading maps private pages that may be written
+	void *mapped = mmap(0, (size_t) bytes, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fileDescriptor, 0);
+	if (mapped==MAP_FAILED)
+		return false;
+	base=(unsigned char*) mapped;
+	mappedBytes=bytes;
+	return true;
+}
+
+#endif
+
+bool CaptureLog::IsOpen(void) const
+{
+	return base!=0;
+}
+
+bool CaptureLog::Grow(uint64_t minimumBytes)
+{
+	uint64_t bytes = mappedBytes;
+	while (bytes < minimumBytes)
+		bytes*=2;
+	if (bytes==mappedBytes)
+		return true;
+#if defined(_WIN32)
+	return false;
+#else
+	munmap(base, (size_t) mappedBytes);
+	base=0;
+	return Map(bytes);
+#endif
+}
+
+bool CaptureLog::Append(const CaptureRecord &record)
+{
+	if (base==0 || writable==false)
+		return false;
+
+	size_t addressBytes = strlen(record.senderAddress)+1;
+	size_t identifierBytes = strlen(record.identifier)+1;
+	uint64_t recordBytes = RECORD_FIXED_BYTES + addressBytes + identifierBytes + record.payloadBytes;
+	if (recordBytes > 0xFFFFFFFFu)
+		return false;
+	uint64_t offset = GetHeader()->usedBytes;
+	if (Grow(offset+recordBytes)==false)
+		return false;
+
+	unsigned char *p = base+offset;
+	uint32_t size32 = (uint32_t) recordBytes;
+	uint64_t receiveTime = record.receiveTime;
+	uint64_t senderTimestamp = record.senderTimestamp;
+	uint32_t payloadBytes = record.payloadBytes;
+	memcpy(p, &size32, 4); p+=4;
+	memcpy(p, &receiveTime, 8); p+=8;
+	memcpy(p, &senderTimestamp, 8); p+=8;
+	memcpy(p, &payloadBytes, 4); p+=4;
+	memcpy(p, record.senderAddress, addressBytes); p+=addressBytes;
+	memcpy(p, record.identifier, identifierBytes); p+=identifierBytes;
+	if (payloadBytes > 0)
+		memcpy(p, record.payload, payloadBytes);
+
+	// Published last, so a reader never sees a partly written record
+	GetHeader()->recordCount++;
+	GetHeader()->usedBytes=offset+recordBytes;
+	return true;
+}
+
+bool CaptureLog::Read(CaptureRecord *record)
+{
+	if (base==0)
+		return false;
+	uint64_t usedBytes = GetHeader()->usedBytes;
+	if (readOffset+RECORD_FIXED_BYTES > usedBytes)
+		return false;
+
+	const unsigned char *p = base+readOffset;
+	uint32_t recordBytes, payloadBytes;
+	uint64_t receiveTime, senderTimestamp;
+	memcpy(&recordBytes, p, 4); p+=4;
+	memcpy(&receiveTime, p, 8); p+=8;
+	memcpy(&senderTimestamp, p, 8); p+=8;
+	memcpy(&payloadBytes, p, 4); p+=4;
+	if ((uint64_t) recordBytes < (uint64_t) RECORD_FIXED_BYTES+2+payloadBytes || readOffset+recordBytes > usedBytes)
+		return false;
+
+	// Both strings must be terminated inside the record, ahead of the payload
+	const unsigned char *stringsEnd = base+readOffset+recordBytes-payloadBytes;
+	const unsigned char *addressEnd = (const unsigned char*) memchr(p, 0, stringsEnd-p);
+	if (addressEnd==0)
+		return false;
+	const unsigned char *identifierEnd = (const unsigned char*) memchr(addressEnd+1, 0, stringsEnd-(addressEnd+1));
+	if (identifierEnd==0 || identifierEnd+1!=stringsEnd)
+		return false;
+
+	record->receiveTime=receiveTime;
+	record->senderTimestamp=(RakNet::Time) senderTimestamp;
+	record->senderAddress=(const char*) p;
+	record->identifier=(const char*) addressEnd+1;
+	record->payload=stringsEnd;
+	record->payloadBytes=payloadBytes;
+	readOffset+=recordBytes;
+	return true;
+}
+
+void CaptureLog::Rewind(void)
+{
+	readOffset = base ? GetHeader()->headerBytes : 0;
+}
+
+uint64_t CaptureLog::GetRecordCount(void) const
+{
+	return base ? GetHeader()->recordCount : 0;
+}
+
+} // namespace _RPC3
+} // namespace RakNet
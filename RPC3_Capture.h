@@ -0,0 +1,92 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/// \file
+/// \brief Memory-mapped append-only log of incoming RPC3 messages, written by RPC3::StartCapture() and read by RPC3::ReplayCapture().
+/// \details The log starts with a fixed header followed by one record per ID_RPC_PLUGIN message.
+/// Values are stored in host byte order, so a log is replayed on the architecture it was captured on.
+
+
+#ifndef __RPC3_CAPTURE_H
+#define __RPC3_CAPTURE_H
+
+#include <stdint.h>
+#include "RakNetTypes.h"
+
+namespace RakNet
+{
+namespace _RPC3
+{
+
+/// One captured message. Strings and payload point into the mapped log and stay valid until the log is closed.
+struct CaptureRecord
+{
+	/// Microseconds since the capture was started
+	RakNet::TimeUS receiveTime;
+	/// Timestamp sent with ID_TIMESTAMP, or 0
+	RakNet::Time senderTimestamp;
+	/// Sender in SystemAddress::ToString(true, '|') form
+	const char *senderAddress;
+	/// Identifier of the called function or signal, empty if the header could not be read
+	const char *identifier;
+	/// The message following ID_RPC_PLUGIN, as passed to RPC3::OnRPC3Call()
+	const unsigned char *payload;
+	unsigned int payloadBytes;
+};
+
+/// \brief Append-only message log backed by a memory-mapped file.
+class CaptureLog
+{
+public:
+	CaptureLog();
+	~CaptureLog();
+
+	/// Creates or truncates \a path for appending
+	bool Create(const char *path);
+	/// Opens an existing log at \a path for reading
+	bool Open(const char *path);
+	/// Unmaps the log. A log opened with Create() is trimmed to its used size.
+	void Close(void);
+	bool IsOpen(void) const;
+
+	/// Appends one record, growing the file as needed
+	bool Append(const CaptureRecord &record);
+	/// Reads the next record
+	/// \return false at the end of the log, or if the next record is malformed
+	bool Read(CaptureRecord *record);
+	/// Makes the next Read() return the first record again
+	void Rewind(void);
+	uint64_t GetRecordCount(void) const;
+
+protected:
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t headerBytes;
+		/// End of the last complete record, so a log left behind by a crash stays readable
+		uint64_t usedBytes;
+		uint64_t recordCount;
+	};
+
+	bool Map(uint64_t bytes);
+	bool Grow(uint64_t minimumBytes);
+	Header *GetHeader(void) const {return (Header*) base;}
+
+	int fileDescriptor;
+	unsigned char *base;
+	uint64_t mappedBytes;
+	uint64_t readOffset;
+	bool writable;
+};
+
+} // namespace _RPC3
+} // namespace RakNet
+
+#endif
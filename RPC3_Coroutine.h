@@ -0,0 +1,160 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#ifndef __RPC3_COROUTINE_H
+#define __RPC3_COROUTINE_H
+
+#include "RPC3.h"
+
+/*
+ * C++20 coroutine support, built on RPC3::CallWithReply() and RPC3::Reply().
+ * Include this header from code compiled as C++20, the plugin itself stays
+ * C++14.
+ *
+ * A registered function returning RPC3Task can co_await remote calls. It
+ * suspends into a heap frame instead of blocking, and resumes from
+ * RakPeerInterface::Receive() when the reply arrives:
+ *
+ *     RakNet::RPC3Task Login(RakNet::RakString name, RakNet::RPC3 *rpc) {
+ *         RakNet::RPC3ReplyToken token = rpc->GetReplyToken();
+ *         rpc->SetRecipientAddress(databaseAddress, false);
+ *         RakNet::RPC3Reply profile = co_await RakNet::AwaitCallC(rpc, "LoadProfile", name);
+ *         int level = 0;
+ *         if (profile.IsOK())
+ *             profile.Read(level);
+ *         rpc->Reply(token, level);
+ *     }
+ *     RPC3_REGISTER_FUNCTION(rpc, Login);
+ *
+ * Take handler parameters by value. Memory RPC3 allocates for pointer
+ * parameters, such as char* strings, is released when the handler first
+ * suspends.
+ * Read the reply token before the first co_await, as GetReplyToken() only
+ * describes the call currently being handled.
+ */
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+namespace RakNet
+{
+
+/// \brief Return type of coroutine handlers and flows
+/// \details The coroutine starts right away and frees its frame when it finishes. Nothing needs to keep the returned object.
+/// \ingroup RPC_3_GROUP
+struct RPC3Task
+{
+	struct promise_type
+	{
+		RPC3Task get_return_object() noexcept {return RPC3Task();}
+		std::suspend_never initial_suspend() noexcept {return std::suspend_never();}
+		std::suspend_never final_suspend() noexcept {return std::suspend_never();}
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept {std::terminate();}
+	};
+};
+
+/// \internal
+/// Shared by the reply callback and the awaiting coroutine
+struct RPC3ReplyState
+{
+	RPC3ReplyState() : status(RPC3_REPLY_NOT_SENT), done(false) {}
+	RPC3ReplyStatus status;
+	bool done;
+	RakNet::BitStream bitStream;
+	std::coroutine_handle<> waiting;
+};
+
+/// \brief Result of co_await on AwaitCall()
+/// \ingroup RPC_3_GROUP
+class RPC3Reply
+{
+public:
+	RPC3Reply(const std::shared_ptr<RPC3ReplyState> &_state) : state(_state) {}
+
+	RPC3ReplyStatus GetStatus(void) const {return state->status;}
+	bool IsOK(void) const {return state->status==RPC3_REPLY_OK;}
+
+	/// Values passed to RPC3::Reply(), or the error code with RPC3_REPLY_REMOTE_ERROR
+	RakNet::BitStream &GetBitStream(void) const {return state->bitStream;}
+
+	/// Reads the next replied value
+	template <class templateType>
+	bool Read(templateType &t) const {return state->bitStream.Read(t);}
+
+protected:
+	std::shared_ptr<RPC3ReplyState> state;
+};
+
+/// \brief Awaitable returned by AwaitCall(). The call is already sent when it is created.
+/// \ingroup RPC_3_GROUP
+class RPC3ReplyAwaitable
+{
+public:
+	RPC3ReplyAwaitable() : state(std::make_shared<RPC3ReplyState>()) {}
+
+	/// \internal
+	RPC3::ReplyCallback GetCallback(void) const
+	{
+		std::shared_ptr<RPC3ReplyState> replyState = state;
+		return [replyState](RPC3ReplyStatus status, RakNet::BitStream *reply)
+		{
+			replyState->status=status;
+			// The bitstream passed in only lives during the callback
+			if (reply)
+				replyState->bitStream.Write(reply);
+			replyState->done=true;
+			if (replyState->waiting)
+				replyState->waiting.resume();
+		};
+	}
+
+	bool await_ready(void) const noexcept {return state->done;}
+	void await_suspend(std::coroutine_handle<> handle) noexcept {state->waiting=handle;}
+	RPC3Reply await_resume(void) const {return RPC3Reply(state);}
+
+protected:
+	std::shared_ptr<RPC3ReplyState> state;
+};
+
+/// Awaitable form of RPC3::CallWithReply()
+template<typename... Args>
+RPC3ReplyAwaitable AwaitCall(RPC3 *rpc, const char *uniqueIdentifier, const Args&... args)
+{
+	RPC3ReplyAwaitable awaitable;
+	rpc->CallWithReply(uniqueIdentifier, awaitable.GetCallback(), args...);
+	return awaitable;
+}
+
+/// Awaitable form of RPC3::CallCWithReply()
+template<typename... Args>
+RPC3ReplyAwaitable AwaitCallC(RPC3 *rpc, const char *uniqueIdentifier, const Args&... args)
+{
+	RPC3ReplyAwaitable awaitable;
+	rpc->CallCWithReply(uniqueIdentifier, awaitable.GetCallback(), args...);
+	return awaitable;
+}
+
+/// Awaitable form of RPC3::CallCPPWithReply()
+template<typename... Args>
+RPC3ReplyAwaitable AwaitCallCPP(RPC3 *rpc, const char *uniqueIdentifier, NetworkID nid, const Args&... args)
+{
+	RPC3ReplyAwaitable awaitable;
+	rpc->CallCPPWithReply(uniqueIdentifier, nid, awaitable.GetCallback(), args...);
+	return awaitable;
+}
+
+} // namespace RakNet
+
+#endif
+
+#endif
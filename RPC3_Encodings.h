@@ -0,0 +1,352 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#ifndef __RPC3_ENCODINGS_H
+#define __RPC3_ENCODINGS_H
+
+#include <stdint.h>
+#include <cmath>
+#include <type_traits>
+
+#include "BitStream.h"
+#include "RakString.h"
+
+/*
+ * Compact encodings for RPC arguments.
+ *
+ * Wrap an argument at the call site and declare the same wrapper type as the
+ * parameter of the registered function:
+ *
+ *     void SetHeading(RakNet::_RPC3::QuantizedFloat<0, 360, 10> heading);
+ *     rpc->CallC("SetHeading", RakNet::_RPC3::Quantized<0, 360, 10>(h));
+ *
+ * The wrappers convert back to their value type, so the handler body reads
+ * them like the plain value.
+ */
+
+namespace RakNet
+{
+namespace _RPC3
+{
+
+// Types deriving from EncodedArg are written with their own Serialize() and
+// read with Deserialize() instead of BitStream operators.
+struct EncodedArg {};
+
+template <typename T>
+struct IsEncodedArg
+{
+	static const bool value = std::is_base_of<EncodedArg, T>::value;
+};
+
+// Number of bits needed to store any value in [0, range].
+constexpr unsigned int BitsForRange(uint64_t range)
+{
+	return range==0 ? 0 : 1 + BitsForRange(range >> 1);
+}
+
+// Low bitCount bits of value, independent of host endianness.
+inline void WriteIntegerBits(RakNet::BitStream &bitStream, uint64_t value, unsigned int bitCount)
+{
+	if (bitCount==0)
+		return;
+	unsigned char bytes[8];
+	for (unsigned int i=0; i < 8; i++)
+		bytes[i]=(unsigned char) (value >> (i*8));
+	bitStream.WriteBits(bytes, bitCount, true);
+}
+
+inline bool ReadIntegerBits(RakNet::BitStream &bitStream, uint64_t &value, unsigned int bitCount)
+{
+	value=0;
+	if (bitCount==0)
+		return true;
+	unsigned char bytes[8];
+	if (bitStream.ReadBits(bytes, bitCount, true)==false)
+		return false;
+	for (unsigned int i=0; i < BITS_TO_BYTES(bitCount); i++)
+		value|=(uint64_t) bytes[i] << (i*8);
+	return true;
+}
+
+// 7 bits per group, with a continuation bit in front of each group.
+inline void WriteVarInt(RakNet::BitStream &bitStream, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		bitStream.Write(true);
+		WriteIntegerBits(bitStream, value & 0x7F, 7);
+		value >>= 7;
+	}
+	bitStream.Write(false);
+	WriteIntegerBits(bitStream, value, 7);
+}
+
+inline bool ReadVarInt(RakNet::BitStream &bitStream, uint64_t &value)
+{
+	value=0;
+	for (unsigned int shift=0; shift < 64; shift+=7)
+	{
+		bool more;
+		uint64_t group;
+		if (bitStream.Read(more)==false || ReadIntegerBits(bitStream, group, 7)==false)
+			return false;
+		value|=group << shift;
+		if (more==false)
+			return true;
+	}
+	return false;
+}
+
+inline uint64_t ZigZagEncode(int64_t value) {return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);}
+inline int64_t ZigZagDecode(uint64_t value) {return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);}
+
+
+// Integer in [Min, Max], sent with just enough bits for the range.
+// Values outside of the range are clamped.
+template <int64_t Min, int64_t Max>
+struct RangedInt : public EncodedArg
+{
+	static_assert(Min < Max, "RangedInt needs Min < Max");
+	static const unsigned int bitCount = BitsForRange((uint64_t) (Max - Min));
+
+	RangedInt() : value(Min) {}
+	RangedInt(int64_t _value) : value(_value) {}
+	operator int64_t() const {return value;}
+
+	void Serialize(RakNet::BitStream &bitStream) const
+	{
+		int64_t clamped = value < Min ? Min : (value > Max ? Max : value);
+		WriteIntegerBits(bitStream, (uint64_t) (clamped - Min), bitCount);
+	}
+	bool Deserialize(RakNet::BitStream &bitStream)
+	{
+		uint64_t offset;
+		if (ReadIntegerBits(bitStream, offset, bitCount)==false)
+			return false;
+		value = Min + (int64_t) offset;
+		return true;
+	}
+
+	int64_t value;
+};
+
+template <int64_t Min, int64_t Max, typename T>
+inline RangedInt<Min, Max> Ranged(T value) {return RangedInt<Min, Max>((int64_t) value);}
+
+
+// Float in [Min, Max] with a precision of 1/Resolution.
+// QuantizedFloat<-1000, 1000, 100> sends centimeters over +-1km in 18 bits.
+template <int Min, int Max, unsigned int Resolution>
+struct QuantizedFloat : public EncodedArg
+{
+	static_assert(Min < Max && Resolution > 0, "QuantizedFloat needs Min < Max and a non-zero Resolution");
+	static const uint64_t steps = (uint64_t) (Max - Min) * Resolution;
+	static const unsigned int bitCount = BitsForRange(steps);
+
+	QuantizedFloat() : value((float) Min) {}
+	QuantizedFloat(float _value) : value(_value) {}
+	operator float() const {return value;}
+
+	static uint64_t Quantize(float f)
+	{
+		double scaled = ((double) f - Min) * Resolution + 0.5;
+		if (!(scaled > 0.0))
+			return 0;
+		if (scaled >= (double) steps)
+			return steps;
+		return (uint64_t) scaled;
+	}
+	static float Dequantize(uint64_t q) {return (float) ((double) Min + (double) q / Resolution);}
+
+	void Serialize(RakNet::BitStream &bitStream) const {WriteIntegerBits(bitStream, Quantize(value), bitCount);}
+	bool Deserialize(RakNet::BitStream &bitStream)
+	{
+		uint64_t q;
+		if (ReadIntegerBits(bitStream, q, bitCount)==false)
+			return false;
+		value = Dequantize(q);
+		return true;
+	}
+
+	float value;
+};
+
+template <int Min, int Max, unsigned int Resolution>
+inline QuantizedFloat<Min, Max, Resolution> Quantized(float value) {return QuantizedFloat<Min, Max, Resolution>(value);}
+
+
+// Three floats, each quantized like QuantizedFloat.
+template <int Min, int Max, unsigned int Resolution>
+struct QuantizedVector3 : public EncodedArg
+{
+	typedef QuantizedFloat<Min, Max, Resolution> Component;
+
+	QuantizedVector3() : x((float) Min), y((float) Min), z((float) Min) {}
+	QuantizedVector3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+
+	void Serialize(RakNet::BitStream &bitStream) const
+	{
+		WriteIntegerBits(bitStream, Component::Quantize(x), Component::bitCount);
+		WriteIntegerBits(bitStream, Component::Quantize(y), Component::bitCount);
+		WriteIntegerBits(bitStream, Component::Quantize(z), Component::bitCount);
+	}
+	bool Deserialize(RakNet::BitStream &bitStream)
+	{
+		uint64_t qx, qy, qz;
+		if (ReadIntegerBits(bitStream, qx, Component::bitCount)==false ||
+			ReadIntegerBits(bitStream, qy, Component::bitCount)==false ||
+			ReadIntegerBits(bitStream, qz, Component::bitCount)==false)
+			return false;
+		x = Component::Dequantize(qx);
+		y = Component::Dequantize(qy);
+		z = Component::Dequantize(qz);
+		return true;
+	}
+
+	float x, y, z;
+};
+
+template <int Min, int Max, unsigned int Resolution>
+inline QuantizedVector3<Min, Max, Resolution> QuantizedVector(float x, float y, float z) {return QuantizedVector3<Min, Max, Resolution>(x, y, z);}
+
+
+// Unit length vector in octahedral mapping, BitsPerAxis bits for each of the
+// two mapped coordinates. 11 bits per axis keeps the error under 0.1 degrees.
+template <unsigned int BitsPerAxis>
+struct UnitVector3 : public EncodedArg
+{
+	static_assert(BitsPerAxis >= 2 && BitsPerAxis <= 24, "UnitVector3 needs 2 to 24 bits per axis");
+	static const uint32_t maxValue = (1u << BitsPerAxis) - 1;
+
+	UnitVector3() : x(0.0f), y(0.0f), z(1.0f) {}
+	UnitVector3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+
+	static float SignNotZero(float f) {return f < 0.0f ? -1.0f : 1.0f;}
+	static uint32_t ToUnsigned(float f)
+	{
+		float scaled = (f * 0.5f + 0.5f) * maxValue + 0.5f;
+		if (!(scaled > 0.0f))
+			return 0;
+		return scaled >= (float) maxValue ? maxValue : (uint32_t) scaled;
+	}
+	static float FromUnsigned(uint32_t u) {return ((float) u / maxValue) * 2.0f - 1.0f;}
+
+	void Serialize(RakNet::BitStream &bitStream) const
+	{
+		float length = std::fabs(x) + std::fabs(y) + std::fabs(z);
+		float u = 0.0f, v = 0.0f;
+		if (length > 0.0f)
+		{
+			u = x / length;
+			v = y / length;
+			if (z < 0.0f)
+			{
+				float fu = (1.0f - std::fabs(v)) * SignNotZero(u);
+				v = (1.0f - std::fabs(u)) * SignNotZero(v);
+				u = fu;
+			}
+		}
+		WriteIntegerBits(bitStream, ToUnsigned(u), BitsPerAxis);
+		WriteIntegerBits(bitStream, ToUnsigned(v), BitsPerAxis);
+	}
+	bool Deserialize(RakNet::BitStream &bitStream)
+	{
+		uint64_t qu, qv;
+		if (ReadIntegerBits(bitStream, qu, BitsPerAxis)==false || ReadIntegerBits(bitStream, qv, BitsPerAxis)==false)
+			return false;
+		float u = FromUnsigned((uint32_t) qu);
+		float v = FromUnsigned((uint32_t) qv);
+		x = u;
+		y = v;
+		z = 1.0f - std::fabs(u) - std::fabs(v);
+		if (z < 0.0f)
+		{
+			x = (1.0f - std::fabs(v)) * SignNotZero(u);
+			y = (1.0f - std::fabs(u)) * SignNotZero(v);
+		}
+		float length = std::sqrt(x*x + y*y + z*z);
+		x /= length;
+		y /= length;
+		z /= length;
+		return true;
+	}
+
+	float x, y, z;
+};
+
+template <unsigned int BitsPerAxis>
+inline UnitVector3<BitsPerAxis> UnitNormal(float x, float y, float z) {return UnitVector3<BitsPerAxis>(x, y, z);}
+
+
+// Integer in 8 bit groups, small magnitudes take fewer bits.
+// Signed types are zig-zag encoded so small negative values stay small.
+template <typename T>
+struct VarInt : public EncodedArg
+{
+	static_assert(std::is_integral<T>::value, "VarInt needs an integer type");
+
+	VarInt() : value(0) {}
+	VarInt(T _value) : value(_value) {}
+	operator T() const {return value;}
+
+	void Serialize(RakNet::BitStream &bitStream) const
+	{
+		if (std::is_signed<T>::value)
+			WriteVarInt(bitStream, ZigZagEncode((int64_t) value));
+		else
+			WriteVarInt(bitStream, (uint64_t) value);
+	}
+	bool Deserialize(RakNet::BitStream &bitStream)
+	{
+		uint64_t encoded;
+		if (ReadVarInt(bitStream, encoded)==false)
+			return false;
+		if (std::is_signed<T>::value)
+			value = (T) ZigZagDecode(encoded);
+		else
+			value = (T) encoded;
+		return true;
+	}
+
+	T value;
+};
+
+template <typename T>
+inline VarInt<T> Varint(T value) {return VarInt<T>(value);}
+
+
+// String sent in full the first time, then as a small index into a table the
+// receiver keeps for each connection. Meant for names that repeat, such as
+// items, animations or maps. Written by RPC3 itself rather than Serialize(),
+// see RPC3::SetStringInterningLimit().
+struct InternedString
+{
+	InternedString() {}
+	InternedString(const char *_value) : value(_value) {}
+	InternedString(const RakNet::RakString &_value) : value(_value) {}
+	operator const char*() const {return value.C_String();}
+	operator const RakNet::RakString&() const {return value;}
+
+	RakNet::RakString value;
+};
+
+template <typename T>
+struct IsInternedString
+{
+	static const bool value = std::is_same<typename std::remove_const<T>::type, InternedString>::value;
+};
+
+inline InternedString Interned(const char *value) {return InternedString(value);}
+inline InternedString Interned(const RakNet::RakString &value) {return InternedString(value);}
+
+} // namespace _RPC3
+} // namespace RakNet
+
+#endif
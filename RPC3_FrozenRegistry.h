@@ -0,0 +1,214 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/// \file
+/// \brief Immutable perfect-hash table used by RPC3::FreezeRegistry() for allocation-free identifier lookup.
+
+
+#ifndef __RPC3_FROZEN_REGISTRY_H
+#define __RPC3_FROZEN_REGISTRY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+namespace RakNet
+{
+namespace _RPC3
+{
+
+/// 64 bit FNV-1a over a null terminated identifier
+inline uint64_t HashIdentifier(const char *str)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	while (*str)
+	{
+		hash ^= (unsigned char) *str++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/// Remixes an identifier hash with a bucket displacement, so every bucket can search for a collision free placement
+inline uint64_t DisplaceHash(uint64_t hash, uint32_t displacement)
+{
+	hash ^= displacement * 0x9E3779B97F4A7C15ULL;
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/// \brief Read-only string to pointer map built with hash-and-displace.
+/// \details Each lookup hashes the identifier once, reads one displacement and probes exactly one slot.
+/// Keys are copied into a single string pool, so the table does not reference the registry it was built from.
+template <class data_type>
+class FrozenRegistry
+{
+public:
+	FrozenRegistry() : slotMask(0) {}
+
+	/// Builds the table. Any previous contents are discarded. Keys must be unique.
+	/// \return false if no placement could be found, in which case the table is left empty
+	bool Build(const char * const *keys, const data_type *values, unsigned int count)
+	{
+		Clear();
+		if (count==0)
+			return true;
+
+		std::vector<uint64_t> hashes(count);
+		size_t poolSize=0;
+		for (unsigned int i=0; i < count; i++)
+		{
+			hashes[i]=HashIdentifier(keys[i]);
+			poolSize+=strlen(keys[i])+1;
+		}
+
+		// Average of four keys per bucket keeps the displacement table small while seeds stay easy to find
+		displacements.assign((count+3)/4, 0);
+		std::vector<std::vector<unsigned int> > buckets(displacements.size());
+		for (unsigned int i=0; i < count; i++)
+			buckets[BucketOf(hashes[i])].push_back(i);
+		std::vector<unsigned int> order(buckets.size());
+		for (unsigned int b=0; b < order.size(); b++)
+			order[b]=b;
+		std::sort(order.begin(), order.end(), [&buckets](unsigned int l, unsigned int r) {return buckets[l].size() > buckets[r].size();});
+
+		// Load factor between 0.4 and 0.8
+		size_t slotCount=1;
+		while (slotCount < count + count/4)
+			slotCount<<=1;
+
+		while (Place(hashes, buckets, order, slotCount)==false)
+		{
+			// Only reachable with duplicate keys or a full 64 bit hash collision
+			if (slotCount > (size_t) count * 64)
+			{
+				Clear();
+				return false;
+			}
+			slotCount<<=1;
+		}
+
+		pool.resize(poolSize);
+		size_t poolOffset=0;
+		std::vector<size_t> nameOffsets(slots.size());
+		for (unsigned int i=0; i < count; i++)
+		{
+			size_t len=strlen(keys[i])+1;
+			memcpy(&pool[poolOffset], keys[i], len);
+			Slot &slot = slots[SlotOf(hashes[i])];
+			slot.hash=hashes[i];
+			slot.value=values[i];
+			nameOffsets[SlotOf(hashes[i])]=poolOffset;
+			poolOffset+=len;
+		}
+		for (size_t s=0; s < slots.size(); s++)
+		{
+			if (slots[s].occupied)
+				slots[s].name=&pool[nameOffsets[s]];
+		}
+		return true;
+	}
+
+	/// \return The value stored for \a key, or 0 if \a key was not part of the build
+	data_type Get(const char *key) const
+	{
+		if (slots.empty())
+			return 0;
+		uint64_t hash=HashIdentifier(key);
+		const Slot &slot = slots[SlotOf(hash)];
+		if (slot.occupied && slot.hash==hash && strcmp(slot.name, key)==0)
+			return slot.value;
+		return 0;
+	}
+
+	/// \return The stored key equal to \a key, or 0. The returned string lives as long as the table.
+	const char *GetKey(const char *key) const
+	{
+		if (slots.empty())
+			return 0;
+		uint64_t hash=HashIdentifier(key);
+		const Slot &slot = slots[SlotOf(hash)];
+		if (slot.occupied && slot.hash==hash && strcmp(slot.name, key)==0)
+			return slot.name;
+		return 0;
+	}
+
+	bool IsEmpty(void) const {return slots.empty();}
+
+	void Clear(void)
+	{
+		slots.clear();
+		displacements.clear();
+		pool.clear();
+		slotMask=0;
+	}
+
+protected:
+	struct Slot
+	{
+		Slot() : hash(0), name(0), value(0), occupied(false) {}
+		uint64_t hash;
+		const char *name;
+		data_type value;
+		bool occupied;
+	};
+
+	size_t BucketOf(uint64_t hash) const {return (size_t) ((hash >> 32) % displacements.size());}
+	size_t SlotOf(uint64_t hash) const {return (size_t) (DisplaceHash(hash, displacements[BucketOf(hash)]) & slotMask);}
+
+	bool Place(const std::vector<uint64_t> &hashes, const std::vector<std::vector<unsigned int> > &buckets, const std::vector<unsigned int> &order, size_t slotCount)
+	{
+		slots.assign(slotCount, Slot());
+		slotMask=slotCount-1;
+		std::vector<size_t> candidate;
+		for (unsigned int b : order)
+		{
+			const std::vector<unsigned int> &bucket = buckets[b];
+			if (bucket.empty())
+				break;
+
+			uint32_t displacement;
+			for (displacement=0; displacement < 65536; displacement++)
+			{
+				candidate.clear();
+				unsigned int k;
+				for (k=0; k < bucket.size(); k++)
+				{
+					size_t s = (size_t) (DisplaceHash(hashes[bucket[k]], displacement) & slotMask);
+					if (slots[s].occupied || std::find(candidate.begin(), candidate.end(), s)!=candidate.end())
+						break;
+					candidate.push_back(s);
+				}
+				if (k==bucket.size())
+					break;
+			}
+			// Table too dense for this bucket, caller retries with more slots
+			if (displacement==65536)
+				return false;
+
+			displacements[b]=displacement;
+			for (size_t s : candidate)
+				slots[s].occupied=true;
+		}
+		return true;
+	}
+
+	std::vector<Slot> slots;
+	std::vector<uint32_t> displacements;
+	std::vector<char> pool;
+	size_t slotMask;
+};
+
+} // namespace _RPC3
+} // namespace RakNet
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#include "RPC3_LZ.h"
+#include <stdint.h>
+#include <string.h>
+
+namespace RakNet
+{
+namespace _RPC3
+{
+
+static const unsigned int LZ_MIN_MATCH=4;
+// The last match must start this many bytes before the end, and the block always ends with literals
+static const unsigned int LZ_MATCH_LIMIT=12;
+static const unsigned int LZ_LAST_LITERALS=5;
+static const unsigned int LZ_MAX_OFFSET=65535;
+static const unsigned int LZ_HASH_LOG=12;
+
+static inline uint32_t Read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t HashSequence(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+// Writes length-15 as a run of 255 bytes and a remainder, following a nibble of 15
+static inline bool WriteLengthExtension(unsigned int length, unsigned char *&op, const unsigned char *outputEnd)
+{
+	while (length >= 255)
+	{
+		if (op >= outputEnd)
+			return false;
+		*op++ = 255;
+		length -= 255;
+	}
+	if (op >= outputEnd)
+		return false;
+	*op++ = (unsigned char) length;
+	return true;
+}
+
+static inline bool WriteSequence(const unsigned char *literals, unsigned int literalLength, unsigned int offset, unsigned int matchLength, unsigned char *&op, const unsigned char *outputEnd)
+{
+	if (op >= outputEnd)
+		return false;
+	unsigned char *token = op++;
+	*token = (unsigned char) ((literalLength < 15 ? literalLength : 15) << 4);
+	if (literalLength >= 15 && WriteLengthExtension(literalLength - 15, op, outputEnd)==false)
+		return false;
+	if ((unsigned int) (outputEnd - op) < literalLength)
+		return false;
+	if (literalLength > 0)
+		memcpy(op, literals, literalLength);
+	op += literalLength;
+
+	// Final sequence has literals only
+	if (matchLength==0)
+		return true;
+
+	if (outputEnd - op < 2)
+		return false;
+	*op++ = (unsigned char) (offset & 0xFF);
+	*op++ = (unsigned char) (offset >> 8);
+	unsigned int matchCode = matchLength - LZ_MIN_MATCH;
+	*token |= (unsigned char) (matchCode < 15 ? matchCode : 15);
+	if (matchCode >= 15 && WriteLengthExtension(matchCode - 15, op, outputEnd)==false)
+		return false;
+	return true;
+}
+
+unsigned int LZCompressBound(unsigned int inputSize)
+{
+	return inputSize + inputSize / 255 + 16;
+}
+
+unsigned int LZDecompressBound(unsigned int inputSize)
+{
+	// One length extension byte adds at most 255 bytes of match, more than a token with its literals and offset can
+	if (inputSize > 0xFFFFFFFFu / 255)
+		return 0xFFFFFFFFu;
+	return inputSize * 255;
+}
+
+unsigned int LZCompress(const unsigned char *input, unsigned int inputSize, unsigned char *output, unsigned int outputCapacity)
+{
+	unsigned char *op = output;
+	const unsigned char *outputEnd = output + outputCapacity;
+	unsigned int anchor = 0;
+
+	if (inputSize > LZ_MATCH_LIMIT)
+	{
+		// Positions are stored +1 so zero means empty
+		uint32_t table[1 << LZ_HASH_LOG];
+		memset(table, 0, sizeof(table));
+
+		unsigned int matchLimit = inputSize - LZ_MATCH_LIMIT;
+		unsigned int ip = 0;
+		while (ip < matchLimit)
+		{
+			uint32_t sequence = Read32(input + ip);
+			uint32_t h = HashSequence(sequence);
+			uint32_t candidate = table[h];
+			table[h] = ip + 1;
+			if (candidate==0 || ip - (candidate - 1) > LZ_MAX_OFFSET || Read32(input + candidate - 1)!=sequence)
+			{
+				ip++;
+				continue;
+			}
+
+			unsigned int ref = candidate - 1;
+			unsigned int matchLength = LZ_MIN_MATCH;
+			while (ip + matchLength < inputSize - LZ_LAST_LITERALS && input[ref + matchLength]==input[ip + matchLength])
+				matchLength++;
+
+			if (WriteSequence(input + anchor, ip - anchor, ip - ref, matchLength, op, outputEnd)==false)
+				return 0;
+			ip += matchLength;
+			anchor = ip;
+		}
+	}
+
+	if (WriteSequence(input + anchor, inputSize - anchor, 0, 0, op, outputEnd)==false)
+		return 0;
+	return (unsigned int) (op - output);
+}
+
+static inline bool ReadLengthExtension(unsigned int &length, const unsigned char *&ip, const unsigned char *inputEnd)
+{
+	unsigned char b;
+	do
+	{
+		if (ip >= inputEnd)
+			return false;
+		b = *ip++;
+		length += b;
+	} while (b==255);
+	return true;
+}
+
+bool LZDecompress(const unsigned char *input, unsigned int inputSize, unsigned char *output, unsigned int outputSize)
+{
+	const unsigned char *ip = input;
+	const unsigned char *inputEnd = input + inputSize;
+	unsigned char *op = output;
+	const unsigned char *outputEnd = output + outputSize;
+
+	while (ip < inputEnd)
+	{
+		unsigned char token = *ip++;
+		unsigned int literalLength = token >> 4;
+		if (literalLength==15 && ReadLengthExtension(literalLength, ip, inputEnd)==false)
+			return false;
+		if ((unsigned int) (inputEnd - ip) < literalLength || (unsigned int) (outputEnd - op) < literalLength)
+			return false;
+		if (literalLength > 0)
+			memcpy(op, ip, literalLength);
+		ip += literalLength;
+		op += literalLength;
+
+		if (ip==inputEnd)
+			break;
+
+		if (inputEnd - ip < 2)
+			return false;
+		unsigned int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset==0 || offset > (unsigned int) (op - output))
+			return false;
+		unsigned int matchLength = token & 15;
+		if (matchLength==15 && ReadLengthExtension(matchLength, ip, inputEnd)==false)
+			return false;
+		matchLength += LZ_MIN_MATCH;
+		if ((unsigned int) (outputEnd - op) < matchLength)
+			return false;
+		// Source and destination may overlap, which repeats the last offset bytes
+		const unsigned char *match = op - offset;
+		for (unsigned int i=0; i < matchLength; i++)
+			op[i] = match[i];
+		op += matchLength;
+	}
+
+	return op==outputEnd;
+}
+
+} // namespace _RPC3
+} // namespace RakNet
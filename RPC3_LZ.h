@@ -0,0 +1,40 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/// \file
+/// \brief Small LZ77 block codec used to compress large RPC3 parameter payloads.
+/// \details The output follows the LZ4 block layout: a token with literal and match lengths, the literals, a 16 bit offset and length extension bytes.
+
+
+#ifndef __RPC3_LZ_H
+#define __RPC3_LZ_H
+
+namespace RakNet
+{
+namespace _RPC3
+{
+
+/// \return Worst case size of LZCompress() output for \a inputSize bytes of input
+unsigned int LZCompressBound(unsigned int inputSize);
+
+/// \return Most bytes LZDecompress() can produce from \a inputSize bytes of input
+unsigned int LZDecompressBound(unsigned int inputSize);
+
+/// Compresses \a inputSize bytes from \a input into \a output
+/// \return Number of bytes written, or 0 if the result does not fit in \a outputCapacity
+unsigned int LZCompress(const unsigned char *input, unsigned int inputSize, unsigned char *output, unsigned int outputCapacity);
+
+/// Decompresses a block written by LZCompress()
+/// \return True if the block was well formed and decompressed to exactly \a outputSize bytes
+bool LZDecompress(const unsigned char *input, unsigned int inputSize, unsigned char *output, unsigned int outputSize);
+
+} // namespace _RPC3
+} // namespace RakNet
+
+#endif
@@ -15,6 +15,8 @@
 #include <tuple>
 #include <iterator>
 #include <vector>
+#include <typeinfo>
+#include <string.h>
 
 #include <iostream>
 #include <cxxabi.h>
@@ -22,8 +24,13 @@
 #include "NetworkIDManager.h"
 #include "NetworkIDObject.h"
 #include "BitStream.h"
+#include "DS_List.h"
+#include "GetTime.h"
 
 #include "std_additions.h"
+#include "RPC3_Encodings.h"
+#include "RPC3_Stream.h"
+#include "RPC3_Trace.h"
 
 namespace RakNet
 {
@@ -59,9 +66,49 @@ struct InvokeArgs
 
 	// The this pointer for C++
 	NetworkIDObject *thisPtr;
+
+	// All objects of a RPC3::CallCPPMulti(), called in order with the same arguments. 0 for a single object.
+	NetworkIDObject **thisPtrs;
+	unsigned int thisPtrCount;
+
+	// Objects passed with Deref() are framed with a varint length, see WriteWithNetworkIDPtr
+	bool compactDeref;
+
+	// Arguments of a caller on this system, a std::tuple of const references to the types from GetLocalArgsType().
+	// Used instead of bitStream when set.
+	const void *localArgs;
+
+	// If set and still 0, receives GetTimeUS() once the arguments are read, for RPC3::EnableTracing()
+	RakNet::TimeUS *decodedTime;
+};
+
+// RPC3::GetObjectFromID() of the caller, or the NetworkIDManager alone without one
+NetworkIDObject *GetObjectFromID(const InvokeArgs &args, NetworkID networkId);
+
+// Member function, invoker, arity, and the argument types the handler takes from a caller on this system (0 if it cannot)
+typedef std::tuple<bool, std::function<InvokeResultCodes(InvokeArgs)>, int, const std::type_info*> FunctionPointer;
+
+// The function an invoker is bound to, so slots registering the same function share one invoker
+struct FunctionKey
+{
+	const std::type_info *type;
+	// Large enough for member function pointers of any inheritance model
+	unsigned char bytes[32];
+
+	bool operator==(const FunctionKey &other) const {
+		return *type==*other.type && memcmp(bytes, other.bytes, sizeof(bytes))==0;
+	}
 };
 
-typedef std::tuple<bool, std::function<InvokeResultCodes(InvokeArgs)>, int> FunctionPointer;
+template<typename Function>
+FunctionKey GetFunctionKey(Function f) {
+	static_assert(sizeof(Function) <= sizeof(FunctionKey::bytes), "Function pointer larger than FunctionKey");
+	FunctionKey key;
+	key.type = &typeid(Function);
+	memset(key.bytes, 0, sizeof(key.bytes));
+	memcpy(key.bytes, &f, sizeof(f));
+	return key;
+}
 
 struct StrWithDestructor
 {
@@ -85,9 +132,10 @@ struct RPC3Tag
 };
 
 // Track the pointers tagged with RakNet::_RPC3::Deref
-static std::vector<RPC3Tag> __RPC3TagPtrs;
-static int __RPC3TagHead=0;
-static int __RPC3TagTail=0;
+// Per thread, as each RPC3ShardGroup shard serializes calls on its own thread
+static thread_local std::vector<RPC3Tag> __RPC3TagPtrs;
+static thread_local int __RPC3TagHead=0;
+static thread_local int __RPC3TagTail=0;
 
 // If this assert hits, then RakNet::_RPC3::Deref was called more times than the argument was passed to the function
 static void __RPC3_Tag_AddHead(const RPC3Tag &p)
@@ -149,6 +197,122 @@ inline const templateType& PtrToArray(unsigned int count, const templateType & t
 	return t;
 }
 
+/*
+ * Number of bits operator<< writes for an object passed with Deref(), for
+ * types where it never changes. With the compact framing the object is then
+ * written in place after its length, instead of through a scratch BitStream:
+ *
+ *     template <> struct RakNet::_RPC3::SerializedBits<Unit> {static const BitSize_t value = 96;};
+ */
+template <typename T>
+struct SerializedBits
+{
+	static const BitSize_t value = 0;
+};
+
+// Reusable BitStreams for outgoing calls, kept per thread. A buffer keeps
+// the size of the largest call written with it, so steady traffic stops
+// allocating once the pool has warmed up.
+RakNet::BitStream *AcquireBitStream(void);
+void ReleaseBitStream(RakNet::BitStream *bitStream);
+
+struct PooledBitStream
+{
+	PooledBitStream() : bitStream(AcquireBitStream()) {}
+	~PooledBitStream() {ReleaseBitStream(bitStream);}
+	RakNet::BitStream *bitStream;
+
+private:
+	PooledBitStream(const PooledBitStream &);
+	PooledBitStream &operator=(const PooledBitStream &);
+};
+
+// Bits a parameter of type T always takes, or fixed=false if that depends on its value
+template <typename T>
+struct FixedParameterBits
+{
+	static const bool isRPC3 = std::is_pointer<T>::value && std::is_convertible<T, RPC3*>::value;
+	static const bool isScalar = std::is_arithmetic<T>::value || std::is_enum<T>::value;
+	static const bool fixed = isRPC3 || isScalar || SerializedBits<T>::value!=0;
+	static const BitSize_t value = isRPC3 ? 0 : (std::is_same<T, bool>::value ? 1 : (isScalar ? sizeof(T)*8 : SerializedBits<T>::value));
+};
+
+// Exact size of a parameter list made only of fixed size types, otherwise 0
+template <typename... Args>
+struct ParameterListBits;
+
+template <>
+struct ParameterListBits<>
+{
+	static const bool fixed = true;
+	static const BitSize_t value = 0;
+};
+
+template <typename Arg, typename... Args>
+struct ParameterListBits<Arg, Args...>
+{
+	typedef FixedParameterBits<typename std::decay<Arg>::type> First;
+	static const bool fixed = First::fixed && ParameterListBits<Args...>::fixed;
+	static const BitSize_t value = fixed ? First::value + ParameterListBits<Args...>::value : 0;
+};
+
+struct ObjectArrayBase {};
+
+/*
+ * Any number of pointers to objects deriving from NetworkIDObject, sent as
+ * NetworkIDs and resolved on the receiving side in one pass before the
+ * handler runs:
+ *
+ *     void Select(RakNet::_RPC3::ObjectArray<Unit> units);
+ *     rpc->CallC("Select", RakNet::_RPC3::ObjectArray<Unit>(unitPtrs, unitCount));
+ *
+ * Elements whose object does not exist on the receiving side, or that were
+ * null, are null. With serializeObjects the objects themselves are written
+ * with operator<<, like Deref(), and read into every object that exists.
+ */
+template <class T>
+struct ObjectArray : public ObjectArrayBase
+{
+	typedef T ObjectType;
+
+	ObjectArray() : objects(0), count(0), serializeObjects(false), missingCount(0) {}
+	ObjectArray(T * const *_objects, unsigned int _count, bool _serializeObjects=false)
+		: objects(_objects), count(_count), serializeObjects(_serializeObjects), missingCount(0) {}
+	ObjectArray(const std::vector<T*> &_objects, bool _serializeObjects=false)
+		: objects(_objects.empty() ? 0 : &_objects[0]), count((unsigned int) _objects.size()), serializeObjects(_serializeObjects), missingCount(0) {}
+	ObjectArray(const ObjectArray &other) : objects(0) {*this=other;}
+	ObjectArray &operator=(const ObjectArray &other)
+	{
+		storage=other.storage;
+		// Only a received array has storage, and then points into it
+		objects = storage.empty() ? other.objects : &storage[0];
+		count=other.count;
+		serializeObjects=other.serializeObjects;
+		missingCount=other.missingCount;
+		return *this;
+	}
+
+	unsigned int Size(void) const {return count;}
+	T *operator[](unsigned int index) const {return objects[index];}
+	T * const *begin(void) const {return objects;}
+	T * const *end(void) const {return objects+count;}
+	/// Elements that were received as null
+	unsigned int GetMissingCount(void) const {return missingCount;}
+
+	// Not owned when sending, points into storage when received
+	T * const *objects;
+	unsigned int count;
+	bool serializeObjects;
+	unsigned int missingCount;
+	std::vector<T*> storage;
+};
+
+template <typename T>
+struct IsObjectArray
+{
+	static const bool value = std::is_base_of<ObjectArrayBase, T>::value;
+};
+
 struct ReadBitstream
 {
 	static void applyArray(RakNet::BitStream &bitStream, RakNet::BitStream* t){apply(bitStream,t);}
@@ -241,20 +405,42 @@ struct ReadWithNetworkIDPtr
 			args.bitStream->ReadCompressed(count);
 		else
 			count=1;
+		// The handler only sees the first object, every element that exists is still deserialized
 		NetworkID networkId;
+		t=0;
 		for (unsigned int i=0; i < count; i++)
 		{
 			args.bitStream->Read(networkId);
-			t = args.networkIDManager->GET_OBJECT_FROM_ID< T >(networkId);
-			if (deref)
+			T object = (T) GetObjectFromID(args, networkId);
+			if (i==0)
+				t=object;
+			if (deref && args.compactDeref)
+			{
+				uint64_t bitsUsed=0;
+				ReadVarInt(* (args.bitStream), bitsUsed);
+				BitSize_t payloadEnd = args.bitStream->GetReadOffset()+(BitSize_t) bitsUsed;
+				if (object && (args.bitStream->GetReadOffset() & 7)==0)
+				{
+					DoRead< typename std::remove_pointer<T>::type >::type::apply(* (args.bitStream),object);
+				}
+				else if (object)
+				{
+					// Written at bit 0 of its own BitStream by applyCompactDeref, so aligned reads such as those of RakString must start there too
+					RakNet::BitStream payload;
+					payload.Write(args.bitStream, (BitSize_t) bitsUsed);
+					DoRead< typename std::remove_pointer<T>::type >::type::apply(payload,object);
+				}
+				args.bitStream->SetReadOffset(payloadEnd);
+			}
+			else if (deref)
 			{
 				BitSize_t bitsUsed;
 				args.bitStream->AlignReadToByteBoundary();
 				args.bitStream->Read(bitsUsed);
 
-				if (t)
+				if (object)
 				{
-					DoRead< typename std::remove_pointer<T>::type >::type::apply(* (args.bitStream),t);
+					DoRead< typename std::remove_pointer<T>::type >::type::apply(* (args.bitStream),object);
 				}
 				else
 				{
@@ -361,6 +547,108 @@ struct GetReadFunction
 	>::type type;
 };
 
+template< typename T >
+struct ReadEncoded
+{
+	static InvokeResultCodes apply(InvokeArgs &args, T &t)
+	{
+		t.Deserialize(* (args.bitStream));
+		return IRC_SUCCESS;
+	}
+
+	template< typename T2 >
+	static void Cleanup(T2 &t) {}
+};
+
+// Implemented by RPC3, which keeps the string tables. Without a plugin the string is written in full.
+void WriteInternedString(RPC3 *rpc, RakNet::BitStream &bitStream, const RakNet::RakString &string);
+bool ReadInternedString(RPC3 *rpc, RakNet::BitStream &bitStream, RakNet::RakString &string);
+
+template< typename T >
+struct ReadInterned
+{
+	static InvokeResultCodes apply(InvokeArgs &args, T &t)
+	{
+		ReadInternedString(args.caller, * (args.bitStream), t.value);
+		return IRC_SUCCESS;
+	}
+
+	template< typename T2 >
+	static void Cleanup(T2 &t) {}
+};
+
+// Implemented by RPC3, which sends and receives the chunks. Without a plugin the bytes are written inside the call.
+void WriteStream(RPC3 *rpc, RakNet::BitStream &bitStream, const Stream &stream);
+bool ReadStream(RPC3 *rpc, RakNet::BitStream &bitStream, Stream &stream);
+
+template< typename T >
+struct ReadStreamArg
+{
+	static InvokeResultCodes apply(InvokeArgs &args, T &t)
+	{
+		ReadStream(args.caller, * (args.bitStream), t);
+		return IRC_SUCCESS;
+	}
+
+	template< typename T2 >
+	static void Cleanup(T2 &t) {}
+};
+
+template< typename T >
+struct ReadObjectArray
+{
+	static InvokeResultCodes apply(InvokeArgs &args, T &t)
+	{
+		RakNet::BitStream &bitStream = * (args.bitStream);
+		typedef typename T::ObjectType ObjectType;
+		uint64_t count;
+		bool serializeObjects=false;
+		// Every id takes at least 8 bits, which bounds the count before anything is allocated
+		if (ReadVarInt(bitStream, count)==false || count > bitStream.GetNumberOfUnreadBits()/8 || bitStream.Read(serializeObjects)==false)
+			count=0;
+		t.storage.resize((size_t) count);
+		t.objects = count ? &t.storage[0] : 0;
+		t.count = (unsigned int) count;
+		t.serializeObjects = serializeObjects;
+		t.missingCount = 0;
+
+		// Resolve all ids first, so the payloads below are only touched for objects that exist
+		NetworkID previous=0;
+		for (unsigned int i=0; i < t.count; i++)
+		{
+			uint64_t delta=0;
+			ReadVarInt(bitStream, delta);
+			previous+=(NetworkID) ZigZagDecode(delta);
+			t.storage[i] = previous!=UNASSIGNED_NETWORK_ID ? (ObjectType*) GetObjectFromID(args, previous) : 0;
+			if (t.storage[i]==0)
+				t.missingCount++;
+		}
+
+		if (serializeObjects)
+		{
+			// Size of each payload, so missing objects are skipped without parsing them
+			std::vector<BitSize_t> payloadBits(t.count);
+			for (unsigned int i=0; i < t.count; i++)
+			{
+				uint64_t bits=0;
+				ReadVarInt(bitStream, bits);
+				payloadBits[i]=(BitSize_t) bits;
+			}
+			for (unsigned int i=0; i < t.count; i++)
+			{
+				BitSize_t payloadEnd = bitStream.GetReadOffset()+payloadBits[i];
+				if (t.storage[i])
+					DoRead< ObjectType >::type::apply(bitStream, t.storage[i]);
+				bitStream.SetReadOffset(payloadEnd);
+			}
+		}
+		return IRC_SUCCESS;
+	}
+
+	template< typename T2 >
+	static void Cleanup(T2 &t) {}
+};
+
 template< typename T >
 struct ProcessArgType
 {
@@ -368,10 +656,117 @@ struct ProcessArgType
 		std::is_convertible<T, RPC3*>::value
 		, SetRPC3Ptr<T>
 		, typename GetReadFunction<T>::type
+	>::type typeCheck1;
+
+	typedef typename std::conditional<
+		IsEncodedArg<T>::value
+		, ReadEncoded<T>
+		, typeCheck1
+	>::type typeCheck2;
+
+	typedef typename std::conditional<
+		IsInternedString<T>::value
+		, ReadInterned<T>
+		, typeCheck2
+	>::type typeCheck3;
+
+	typedef typename std::conditional<
+		IsStream<T>::value
+		, ReadStreamArg<T>
+		, typeCheck3
+	>::type typeCheck4;
+
+	typedef typename std::conditional<
+		IsObjectArray<T>::value
+		, ReadObjectArray<T>
+		, typeCheck4
 	>::type type;
 };
 
 
+// A caller on this system can hand an argument of type T straight to the handler.
+// Values are copied and NetworkIDObject pointers are the objects themselves, as the receiver would look them up.
+// Other pointers are deserialized into new memory on the receiver, which the caller's pointer cannot stand in for.
+template <typename T>
+struct IsLocalArg
+{
+	static const bool value = std::is_array<T>::value==false && std::is_copy_assignable<T>::value &&
+		(std::is_pointer<T>::value==false || std::is_convertible<T, NetworkIDObject*>::value || std::is_convertible<T, RPC3*>::value);
+};
+
+template <typename... Args>
+struct AreLocalArgs;
+
+template <>
+struct AreLocalArgs<>
+{
+	static const bool value = true;
+};
+
+template <typename Arg, typename... Args>
+struct AreLocalArgs<Arg, Args...>
+{
+	static const bool value = IsLocalArg<Arg>::value && AreLocalArgs<Args...>::value;
+};
+
+template <bool areLocalArgs, typename... Args>
+struct LocalArgsType
+{
+	static const std::type_info *Get(void) {return &typeid(std::tuple<Args...>);}
+};
+
+template <typename... Args>
+struct LocalArgsType<false, Args...>
+{
+	static const std::type_info *Get(void) {return 0;}
+};
+
+// Compared between caller and handler, which skip serializing when they match. 0 if these types always need it.
+template <typename... Args>
+inline const std::type_info *GetLocalArgsType(void)
+{
+	return LocalArgsType<AreLocalArgs<Args...>::value, Args...>::Get();
+}
+
+// RPC3 pointers are filled in with the plugin, as SetRPC3Ptr does
+template <typename T>
+inline void ReadLocalArg(InvokeArgs &args, T &t, const T &callerValue, std::true_type)
+{
+	(void) callerValue;
+	t=args.caller;
+}
+
+template <typename T>
+inline void ReadLocalArg(InvokeArgs &args, T &t, const T &callerValue, std::false_type)
+{
+	(void) args;
+	t=callerValue;
+}
+
+template<std::size_t I = 0, typename Tuple, typename CallerTuple>
+inline typename std::enable_if<I == std::tuple_size<Tuple>::value, void>::type
+		ReadLocalArgs(InvokeArgs &args, Tuple &t, const CallerTuple &callerArgs)
+{
+	(void) args;
+	(void) t;
+	(void) callerArgs;
+}
+
+template<std::size_t I = 0, typename Tuple, typename CallerTuple>
+inline typename std::enable_if<I < std::tuple_size<Tuple>::value, void>::type
+		ReadLocalArgs(InvokeArgs &args, Tuple &t, const CallerTuple &callerArgs)
+{
+	typedef typename std::tuple_element<I, Tuple>::type arg_type;
+	ReadLocalArg(args, std::get<I>(t), std::get<I>(callerArgs), std::integral_constant<bool, std::is_convertible<arg_type, RPC3*>::value>());
+	ReadLocalArgs<I+1>(args, t, callerArgs);
+}
+
+static inline void MarkDecoded(InvokeArgs &functionArgs)
+{
+	if (functionArgs.decodedTime && *functionArgs.decodedTime==0)
+		*functionArgs.decodedTime = RakNet::GetTimeUS();
+}
+
 template<typename F>
 struct RpcInvoker;
 
@@ -387,11 +782,40 @@ struct RpcInvoker<R(Args...)> {
 		std::tuple<typename std::decay<Args>::type...> args;
 		InvokeResultCodes irc = IRC_SUCCESS;
 		
-		RpcInvoker<decltype(func)>::apply(func, functionArgs, args, irc);
+		if (functionArgs.localArgs)
+			RpcInvoker<decltype(func)>::applyLocal(func, functionArgs, args, irc, std::integral_constant<bool, AreLocalArgs<typename std::decay<Args>::type...>::value>());
+		else
+			RpcInvoker<decltype(func)>::apply(func, functionArgs, args, irc);
 		
 		return irc;
 	}
 
+	static inline const std::type_info *GetLocalArgsType(void) {
+		return _RPC3::GetLocalArgsType<typename std::decay<Args>::type...>();
+	}
+
+	/*
+	 * Take the arguments of a caller on this system, which passed exactly
+	 * these types, and invoke.
+	 */
+	template <typename Function>
+	static inline void applyLocal(Function func, InvokeArgs &functionArgs,
+							std::tuple<typename std::decay<Args>::type...> &args, InvokeResultCodes &irc, std::true_type) {
+		typedef std::tuple<const typename std::decay<Args>::type&...> CallerArgs;
+		ReadLocalArgs(functionArgs, args, * (const CallerArgs *) functionArgs.localArgs);
+		RpcInvoker<decltype(func)>::template apply<sizeof...(Args)>(func, functionArgs, args, irc);
+	}
+
+	template <typename Function>
+	static inline void applyLocal(Function func, InvokeArgs &functionArgs,
+							std::tuple<typename std::decay<Args>::type...> &args, InvokeResultCodes &irc, std::false_type) {
+		(void) func;
+		(void) functionArgs;
+		(void) args;
+		RakAssert("Local arguments passed to a handler that has to deserialize them" && 0);
+		irc = IRC_NEED_BITSTREAM;
+	}
+
 	/*
 	 * After all of the arguments are processed, invoke them with the function
 	 * pointer.
@@ -400,6 +824,7 @@ struct RpcInvoker<R(Args...)> {
 	static inline typename std::enable_if<I == sizeof...(Args), void>::type
 			apply(Function func, InvokeArgs &functionArgs,
 							std::tuple<typename std::decay<Args>::type...> &args, InvokeResultCodes &irc) {
+		MarkDecoded(functionArgs);
 		INVOKE(func, args);
 		irc = IRC_SUCCESS;
 	}
@@ -436,16 +861,47 @@ struct RpcInvokerCpp {
 		InvokeResultCodes irc = IRC_SUCCESS;
 		
 		auto *objectPointer = (C *)functionArgs.thisPtr;
-		RpcInvokerCpp::apply(func, objectPointer, functionArgs, args, irc);
+		if (functionArgs.localArgs)
+			RpcInvokerCpp::applyLocal(func, objectPointer, functionArgs, args, irc, std::integral_constant<bool, AreLocalArgs<typename std::decay<Args>::type...>::value>());
+		else
+			RpcInvokerCpp::apply(func, objectPointer, functionArgs, args, irc);
 		
 		return irc;
     }
+
+	template <typename Ret, typename C, typename... Args, typename Obj>
+	static inline void applyLocal(Ret(C::*func)(Args...), Obj *object, InvokeArgs &functionArgs,
+							std::tuple<typename std::decay<Args>::type...>& args, InvokeResultCodes &irc, std::true_type) {
+		typedef std::tuple<const typename std::decay<Args>::type&...> CallerArgs;
+		ReadLocalArgs(functionArgs, args, * (const CallerArgs *) functionArgs.localArgs);
+		RpcInvokerCpp::template apply<sizeof...(Args)>(func, object, functionArgs, args, irc);
+	}
+
+	template <typename Ret, typename C, typename... Args, typename Obj>
+	static inline void applyLocal(Ret(C::*func)(Args...), Obj *object, InvokeArgs &functionArgs,
+							std::tuple<typename std::decay<Args>::type...>& args, InvokeResultCodes &irc, std::false_type) {
+		(void) func;
+		(void) object;
+		(void) functionArgs;
+		(void) args;
+		RakAssert("Local arguments passed to a handler that has to deserialize them" && 0);
+		irc = IRC_NEED_BITSTREAM;
+	}
     
 	template<std::size_t I = 0, typename Ret, typename C, typename... Args, typename Obj>
 	static inline typename std::enable_if<I == sizeof...(Args), void>::type
 			apply(Ret(C::*func)(Args...), Obj *object, InvokeArgs &functionArgs,
 							std::tuple<typename std::decay<Args>::type...>& args, InvokeResultCodes &irc) {
-		INVOKE(func, object, args);
+		MarkDecoded(functionArgs);
+		if (functionArgs.thisPtrs) {
+			// Arguments were read once, every object gets the same values
+			for (unsigned int i = 0; i < functionArgs.thisPtrCount; i++) {
+				INVOKE(func, (C *)functionArgs.thisPtrs[i], args);
+			}
+		}
+		else {
+			INVOKE(func, object, args);
+		}
 		irc = IRC_SUCCESS;
 	}
 	
@@ -515,8 +971,37 @@ struct DoWrite
 template <typename T>
 struct WriteWithNetworkIDPtr
 {
+	// Varint length in bits, then the object, without alignment. Only read by peers with RPC3_FEATURE_COMPACT_DEREF.
+	static void applyCompactDeref(RakNet::BitStream &bitStream, T element)
+	{
+		typedef typename std::remove_pointer<T>::type ObjectType;
+		typedef typename std::remove_const<ObjectType>::type ObjectTypeNoConst;
+		ObjectTypeNoConst *object = const_cast<ObjectTypeNoConst *>(element);
+		const BitSize_t knownBits = SerializedBits<ObjectTypeNoConst>::value;
+		if (knownBits)
+		{
+			WriteVarInt(bitStream, knownBits);
+			BitSize_t bitsUsed1 = bitStream.GetNumberOfBitsUsed();
+			DoWrite< ObjectTypeNoConst >::type::apply(bitStream,object);
+			RakAssert("SerializedBits does not match operator<<" && bitStream.GetNumberOfBitsUsed()-bitsUsed1==knownBits);
+			return;
+		}
+		RakNet::BitStream payload;
+		DoWrite< ObjectTypeNoConst >::type::apply(payload,object);
+		WriteVarInt(bitStream, payload.GetNumberOfBitsUsed());
+		if (payload.GetNumberOfBitsUsed() > 0)
+			bitStream.WriteBits(payload.GetData(), payload.GetNumberOfBitsUsed(), false);
+	}
+
 	static void apply(RakNet::BitStream &bitStream, T& t)
 	{
+		bool compactDerefUsed;
+		apply(bitStream, t, false, &compactDerefUsed);
+	}
+
+	static void apply(RakNet::BitStream &bitStream, T& t, bool compactDerefAllowed, bool *compactDerefUsed)
+	{
+		*compactDerefUsed=false;
 		
 		bool isNull;
 		isNull=(t==0);
@@ -527,6 +1012,8 @@ struct WriteWithNetworkIDPtr
 		__RPC3ClearPtr(t, &tag);
 		bool deref = (tag.flag & RPC3_TAG_FLAG_DEREF) !=0;
 		bool isArray = (tag.flag & RPC3_TAG_FLAG_ARRAY) !=0;
+		bool compactDeref = deref && compactDerefAllowed;
+		*compactDerefUsed=compactDeref;
 		bitStream.Write(deref);
 		bitStream.Write(isArray);
 		if (isArray)
@@ -535,9 +1022,14 @@ struct WriteWithNetworkIDPtr
 		}
 		for (unsigned int i=0; i < tag.count; i++)
 		{
-			NetworkID inNetworkID=t->GetNetworkID();
+			T element = t+i;
+			NetworkID inNetworkID=element->GetNetworkID();
 			bitStream << inNetworkID;
-			if (deref)
+			if (deref && compactDeref)
+			{
+				applyCompactDeref(bitStream, element);
+			}
+			else if (deref)
 			{
 				// skip bytes, write data, go back, write number of bits written, reset cursor
 				bitStream.AlignWriteToByteBoundary();
@@ -545,7 +1037,7 @@ struct WriteWithNetworkIDPtr
 				BitSize_t bitsUsed1=bitStream.GetNumberOfBitsUsed();
 				bitStream.Write(bitsUsed1);
 				bitsUsed1=bitStream.GetNumberOfBitsUsed();
-				DoWrite< typename std::remove_pointer<T>::type >::type::apply(bitStream,t);
+				DoWrite< typename std::remove_pointer<T>::type >::type::apply(bitStream,element);
 				BitSize_t writeOffset2 = bitStream.GetWriteOffset();
 				BitSize_t bitsUsed2=bitStream.GetNumberOfBitsUsed();
 				bitStream.SetWriteOffset(writeOffset1);
@@ -603,6 +1095,68 @@ struct WriteWithoutNetworkIDPtr
 	}
 };
 
+template <typename T>
+struct WriteEncoded
+{
+	static void apply(RakNet::BitStream &bitStream, T& t)
+	{
+		t.Serialize(bitStream);
+	}
+};
+
+template <typename T>
+struct WriteInterned
+{
+	static void apply(RakNet::BitStream &bitStream, T& t)
+	{
+		WriteInternedString(0, bitStream, t.value);
+	}
+};
+
+template <typename T>
+struct WriteStreamArg
+{
+	static void apply(RakNet::BitStream &bitStream, T& t)
+	{
+		WriteStream(0, bitStream, t);
+	}
+};
+
+template <typename T>
+struct WriteObjectArray
+{
+	static void apply(RakNet::BitStream &bitStream, T& t)
+	{
+		typedef typename T::ObjectType ObjectType;
+		WriteVarInt(bitStream, t.count);
+		bitStream.Write(t.serializeObjects);
+		// Ids handed out together are close, so each is the difference to the one before
+		NetworkID previous=0;
+		for (unsigned int i=0; i < t.count; i++)
+		{
+			NetworkID networkId = t.objects[i] ? t.objects[i]->GetNetworkID() : UNASSIGNED_NETWORK_ID;
+			WriteVarInt(bitStream, ZigZagEncode((int64_t) (networkId-previous)));
+			previous=networkId;
+		}
+		if (t.serializeObjects==false)
+			return;
+
+		RakNet::BitStream payloads;
+		std::vector<BitSize_t> payloadBits(t.count);
+		for (unsigned int i=0; i < t.count; i++)
+		{
+			BitSize_t start = payloads.GetNumberOfBitsUsed();
+			if (t.objects[i])
+				DoWrite< ObjectType >::type::apply(payloads, t.objects[i]);
+			payloadBits[i] = payloads.GetNumberOfBitsUsed()-start;
+		}
+		for (unsigned int i=0; i < t.count; i++)
+			WriteVarInt(bitStream, payloadBits[i]);
+		if (payloads.GetNumberOfBitsUsed() > 0)
+			bitStream.WriteBits(payloads.GetData(), payloads.GetNumberOfBitsUsed(), false);
+	}
+};
+
 template <typename T>
 struct SerializeCallParameterBranch
 {
@@ -622,6 +1176,30 @@ struct SerializeCallParameterBranch
 		std::is_convertible<T,NetworkIDObject*>::value
 		, WriteWithNetworkIDPtr<T>
 		, typeCheck2
+	>::type typeCheck3;
+
+	typedef typename std::conditional<
+		IsEncodedArg<T>::value
+		, WriteEncoded<T>
+		, typeCheck3
+	>::type typeCheck4;
+
+	typedef typename std::conditional<
+		IsInternedString<T>::value
+		, WriteInterned<T>
+		, typeCheck4
+	>::type typeCheck5;
+
+	typedef typename std::conditional<
+		IsStream<T>::value
+		, WriteStreamArg<T>
+		, typeCheck5
+	>::type typeCheck6;
+
+	typedef typename std::conditional<
+		IsObjectArray<T>::value
+		, WriteObjectArray<T>
+		, typeCheck6
 	>::type type;
 };
 
@@ -634,7 +1212,8 @@ struct GetBoundPointer_C {
 		return std::make_tuple(false,
 			std::bind(static_cast<InvokeResultCodes(*)(Function, InvokeArgs)>
 				(&RpcInvoker<decltype(f)>::applyer), f, std::placeholders::_1),
-			arity
+			arity,
+			RpcInvoker<decltype(f)>::GetLocalArgsType()
 		);
 	}
 };
@@ -650,7 +1229,8 @@ struct GetBoundPointer_CPP {
 				f,
 				std::placeholders::_1
 			),
-			sizeof...(Args)
+			sizeof...(Args),
+			GetLocalArgsType<typename std::decay<Args>::type...>()
 		);
 	}
 };
@@ -665,50 +1245,139 @@ FunctionPointer GetBoundPointer(Function f) {
 	>::type::GetBoundPointer(f);
 }
 
-// Recursive loop to serialize all arguments into a BitStream.
-// Finally, send the call or signal with BitStream.
+// Serialize all arguments into a BitStream, unless every handler is on this
+// system and takes them as they are. Then send the call or signal.
 struct RpcCall {
 	template<typename Rpc, typename... Args>
 	static inline bool Call(Rpc *rpc, const char *identifier, int argCount,
 													bool isCall, const Args&... args) {
-		RakNet::BitStream bitStream;
-		bool result = false;
+		// Handed to handlers on this system whose parameter types match, see GetLocalArgsType()
+		const std::tuple<const Args&...> localArgs(args...);
+		const std::type_info *localArgsType = GetLocalArgsType<Args...>();
+		// Kept per call, as a local slot may send calls of its own before this one is sent
+		typename Rpc::OutgoingCall outgoingCall;
+		rpc->BeginCallTrace(&outgoingCall);
+		typename Rpc::LocalDelivery delivery = rpc->GetLocalDelivery(identifier, isCall, localArgsType);
+
+		_RPC3::PooledBitStream pooledBitStream;
+		RakNet::BitStream &bitStream = *pooledBitStream.bitStream;
+		const BitSize_t fixedBits = ParameterListBits<Args...>::value;
+
+		typename Rpc::OutgoingCall *lastOutgoingCall = rpc->outgoingCall;
+		rpc->outgoingCall = &outgoingCall;
+
+		if (delivery.serialize) {
+			// Reserve once, exactly for fixed size parameters, otherwise as much as this identifier needed lately
+			bitStream.AddBitsAndReallocate(fixedBits ? fixedBits : rpc->GetParameterBitsEstimate(identifier));
+			RpcCall::WriteParameters(rpc, bitStream, args...);
+		}
+		else {
+			// Deref() and PtrToArray() tags are otherwise consumed while serializing
+			RpcCall::ClearTags(args...);
+		}
+		if (delivery.serialize && outgoingCall.traceId != 0) {
+			outgoingCall.traceTimes[RPC3_TRACE_SERIALIZED] = RakNet::GetTimeUS();
+		}
+
+		if (!isCall) {
+			rpc->InvokeSignal(delivery.localSlot, identifier, &bitStream, true, localArgsType ? &localArgs : 0, localArgsType);
+		}
+		else if (delivery.localFunction) {
+			rpc->InvokeLocalCall(delivery.localFunction, &localArgs);
+		}
 
-		RpcCall::Call(rpc, identifier, bitStream, result, argCount, isCall, args...);
+		bool result = delivery.result;
+		if (delivery.send) {
+			result = rpc->SendCallOrSignal(identifier, argCount, &bitStream, isCall);
+		}
 
+		rpc->outgoingCall = lastOutgoingCall;
+		if (delivery.serialize && fixedBits==0)
+			rpc->UpdateParameterBitsEstimate(identifier, bitStream.GetNumberOfBitsUsed());
 		return result;
 	}
-    
-	template<typename Rpc>
-	static inline void Call(Rpc *rpc, const char *identifier,
-							RakNet::BitStream &bitStream, bool &result,
-							int argCount, bool isCall) {
-		if (!isCall) {
-			rpc->InvokeSignal(rpc->GetLocalSlotIndex(identifier), &bitStream, true);
-		}
 
-		result = rpc->SendCallOrSignal(identifier, argCount, &bitStream, isCall);
+	template<typename Rpc, typename Arg>
+	static inline void WriteParameter(Rpc *rpc, RakNet::BitStream &bitStream, Arg &arg) {
+		typedef typename std::remove_reference<decltype(arg)>::type arg_type_no_ref;
+		typedef typename _RPC3::SerializeCallParameterBranch<arg_type_no_ref>::type branch;
+		RpcCall::WriteParameter(rpc, bitStream, arg, std::is_same<branch, WriteWithNetworkIDPtr<arg_type_no_ref> >());
 	}
-	
+
+	// Pointers to NetworkIDObject, which are framed compactly when every recipient reads it
+	template<typename Rpc, typename Arg>
+	static inline void WriteParameter(Rpc *rpc, RakNet::BitStream &bitStream, Arg &arg, std::true_type) {
+		typedef typename std::remove_reference<decltype(arg)>::type arg_type_no_ref;
+		bool compactDerefUsed;
+		WriteWithNetworkIDPtr<arg_type_no_ref>::apply(bitStream, arg, rpc->CanUseCompactDeref(), &compactDerefUsed);
+		// Tells the recipients, and local slots, which framing to read
+		if (compactDerefUsed)
+			rpc->outgoingCall->compactDeref=true;
+	}
+
 	template<typename Rpc, typename Arg>
-	static inline void Call(Rpc *rpc, const char *identifier,
-					RakNet::BitStream &bitStream, bool &result, int argCount,
-					bool isCall, Arg &arg) {
+	static inline void WriteParameter(Rpc *rpc, RakNet::BitStream &bitStream, Arg &arg, std::false_type) {
 		typedef typename std::remove_reference<decltype(arg)>::type arg_type_no_ref;
+		(void) rpc;
 		_RPC3::SerializeCallParameterBranch<arg_type_no_ref>::type::apply(bitStream, arg);
-        
-		RpcCall::Call(rpc, identifier, bitStream, result, argCount, isCall);
+	}
+
+	template<typename Rpc>
+	static inline void WriteParameter(Rpc *rpc, RakNet::BitStream &bitStream, const InternedString &arg) {
+		WriteInternedString(rpc, bitStream, arg.value);
+	}
+
+	template<typename Rpc>
+	static inline void WriteParameter(Rpc *rpc, RakNet::BitStream &bitStream, const Stream &arg) {
+		WriteStream(rpc, bitStream, arg);
+	}
+
+	template<typename Rpc>
+	static inline void WriteParameters(Rpc *rpc, RakNet::BitStream &bitStream) {
+		(void) rpc;
+		(void) bitStream;
+	}
+
+	template<typename Rpc, typename Arg, typename... Args>
+	static inline void WriteParameters(Rpc *rpc, RakNet::BitStream &bitStream, Arg &arg, const Args&... args) {
+		RpcCall::WriteParameter(rpc, bitStream, arg);
+
+		RpcCall::WriteParameters(rpc, bitStream, args...);
+	}
+
+	template<typename Arg>
+	static inline void ClearTag(const Arg &arg, std::true_type) {
+		RPC3Tag tag;
+		__RPC3ClearPtr((void*) arg, &tag);
+	}
+
+	template<typename Arg>
+	static inline void ClearTag(const Arg &arg, std::false_type) {
+		(void) arg;
+	}
+
+	static inline void ClearTags(void) {
+	}
+
+	template<typename Arg, typename... Args>
+	static inline void ClearTags(const Arg &arg, const Args&... args) {
+		RpcCall::ClearTag(arg, std::integral_constant<bool, std::is_pointer<Arg>::value>());
+
+		RpcCall::ClearTags(args...);
+	}
+
+	// Serialize only, for values that are not sent as a call, such as replies.
+	static inline void Serialize(RakNet::BitStream &bitStream) {
+		(void) bitStream;
 	}
 	
-	template<std::size_t I = 0, typename Rpc, typename Arg, typename... Args>
-	static inline typename std::enable_if<I < sizeof...(Args), void>::type
-			Call(Rpc *rpc, const char *identifier, RakNet::BitStream &bitStream,
-				bool &result, int argCount, bool isCall, Arg &arg, const Args&... args) {
+	template<typename Arg, typename... Args>
+	static inline void Serialize(RakNet::BitStream &bitStream, Arg &arg, const Args&... args) {
 		typedef typename std::remove_reference<decltype(arg)>::type arg_type_no_ref;
 		
 		_RPC3::SerializeCallParameterBranch<arg_type_no_ref>::type::apply(bitStream, arg);
-        
-		RpcCall::Call(rpc, identifier, bitStream, result, argCount, isCall, args...);
+		
+		RpcCall::Serialize(bitStream, args...);
 	}
 };
 
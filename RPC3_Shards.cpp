@@ -0,0 +1,190 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#include "RPC3_Shards.h"
+#include "RakMemoryOverride.h"
+
+using namespace RakNet;
+
+RPC3ShardGroup::RPC3ShardGroup()
+{
+	registry=0;
+}
+
+RPC3ShardGroup::~RPC3ShardGroup()
+{
+	unsigned int i;
+	for (i=0; i < shards.Size(); i++)
+	{
+		shards[i]->rpc->shardGroup=0;
+		RakNet::OP_DELETE(shards[i],_FILE_AND_LINE_);
+	}
+	shards.Clear(false,_FILE_AND_LINE_);
+	owners.Clear(_FILE_AND_LINE_);
+}
+
+bool RPC3ShardGroup::SetRegistry(RPC3 *_registry)
+{
+	if (_registry && _registry->IsRegistryFrozen()==false)
+		return false;
+	registry=_registry;
+	return true;
+}
+
+RPC3 *RPC3ShardGroup::GetRegistry(void) const
+{
+	return registry;
+}
+
+int RPC3ShardGroup::AddShard(RPC3 *shard)
+{
+	if (shard->shardGroup!=0 || shard->SetSharedRegistry(registry)==false)
+		return -1;
+	Shard *s = RakNet::OP_NEW<Shard>(_FILE_AND_LINE_);
+	s->rpc=shard;
+	shard->shardGroup=this;
+	shard->shardIndex=shards.Size();
+	shards.Push(s,_FILE_AND_LINE_);
+	return (int) shard->shardIndex;
+}
+
+unsigned int RPC3ShardGroup::GetShardCount(void) const
+{
+	return shards.Size();
+}
+
+RPC3 *RPC3ShardGroup::GetShard(unsigned int index) const
+{
+	return index < shards.Size() ? shards[index]->rpc : 0;
+}
+
+int RPC3ShardGroup::GetShardIndex(RakNetGUID rakNetGUID)
+{
+	int index=-1;
+	ownersMutex.Lock();
+	DataStructures::HashIndex ownerIndex = owners.GetIndexOf(rakNetGUID);
+	if (ownerIndex.IsInvalid()==false)
+		index=(int) owners.ItemAtIndex(ownerIndex).shardIndex;
+	ownersMutex.Unlock();
+	return index;
+}
+
+bool RPC3ShardGroup::Post(RakNetGUID rakNetGUID, const ShardFunction &shardFunction)
+{
+	PostedCall postedCall;
+	unsigned int index;
+	ownersMutex.Lock();
+	DataStructures::HashIndex ownerIndex = owners.GetIndexOf(rakNetGUID);
+	if (ownerIndex.IsInvalid())
+	{
+		ownersMutex.Unlock();
+		return false;
+	}
+	const Owner &owner = owners.ItemAtIndex(ownerIndex);
+	index=owner.shardIndex;
+	postedCall.systemAddress=owner.systemAddress;
+	ownersMutex.Unlock();
+
+	postedCall.shardFunction=shardFunction;
+	postedCall.broadcast=false;
+	Post(index, postedCall);
+	return true;
+}
+
+bool RPC3ShardGroup::PostToShard(unsigned int index, const ShardFunction &shardFunction)
+{
+	if (index >= shards.Size())
+		return false;
+	PostedCall postedCall;
+	postedCall.shardFunction=shardFunction;
+	// Recipient left alone
+	postedCall.systemAddress=UNASSIGNED_SYSTEM_ADDRESS;
+	postedCall.broadcast=false;
+	Post(index, postedCall);
+	return true;
+}
+
+void RPC3ShardGroup::PostToAll(const ShardFunction &shardFunction)
+{
+	PostedCall postedCall;
+	postedCall.shardFunction=shardFunction;
+	postedCall.systemAddress=UNASSIGNED_SYSTEM_ADDRESS;
+	postedCall.broadcast=true;
+	for (unsigned int i=0; i < shards.Size(); i++)
+		Post(i, postedCall);
+}
+
+void RPC3ShardGroup::Post(unsigned int index, const PostedCall &postedCall)
+{
+	Shard *shard = shards[index];
+	shard->postedCallsMutex.Lock();
+	shard->postedCalls.push_back(postedCall);
+	shard->postedCallsMutex.Unlock();
+	// Shards waiting in RPC3::WaitForCalls() run the call at once
+	shard->rpc->Wake();
+}
+
+void RPC3ShardGroup::OnShardConnection(unsigned int index, const SystemAddress &systemAddress, RakNetGUID rakNetGUID)
+{
+	Owner owner;
+	owner.shardIndex=index;
+	owner.systemAddress=systemAddress;
+	ownersMutex.Lock();
+	DataStructures::HashIndex ownerIndex = owners.GetIndexOf(rakNetGUID);
+	if (ownerIndex.IsInvalid())
+		owners.Push(rakNetGUID, owner, _FILE_AND_LINE_);
+	else
+		owners.ItemAtIndex(ownerIndex)=owner;
+	ownersMutex.Unlock();
+}
+
+void RPC3ShardGroup::OnShardDisconnection(unsigned int index, RakNetGUID rakNetGUID)
+{
+	ownersMutex.Lock();
+	DataStructures::HashIndex ownerIndex = owners.GetIndexOf(rakNetGUID);
+	// The same system may have connected to another shard since
+	if (ownerIndex.IsInvalid()==false && owners.ItemAtIndex(ownerIndex).shardIndex==index)
+		owners.RemoveAtIndex(ownerIndex, _FILE_AND_LINE_);
+	ownersMutex.Unlock();
+}
+
+void RPC3ShardGroup::OnShardShutdown(unsigned int index)
+{
+	DataStructures::List<Owner> ownerList;
+	DataStructures::List<RakNetGUID> guidList;
+	unsigned int i;
+	ownersMutex.Lock();
+	owners.GetAsList(ownerList, guidList, _FILE_AND_LINE_);
+	for (i=0; i < ownerList.Size(); i++)
+	{
+		if (ownerList[i].shardIndex==index)
+			owners.Remove(guidList[i], _FILE_AND_LINE_);
+	}
+	ownersMutex.Unlock();
+}
+
+void RPC3ShardGroup::RunPostedCalls(unsigned int index)
+{
+	Shard *shard = shards[index];
+	shard->postedCallsMutex.Lock();
+	shard->runningCalls.swap(shard->postedCalls);
+	shard->postedCallsMutex.Unlock();
+
+	RPC3 *rpc = shard->rpc;
+	for (size_t i=0; i < shard->runningCalls.size(); i++)
+	{
+		PostedCall &postedCall = shard->runningCalls[i];
+		if (postedCall.broadcast)
+			rpc->SetRecipientAddress(UNASSIGNED_SYSTEM_ADDRESS, true);
+		else if (postedCall.systemAddress!=UNASSIGNED_SYSTEM_ADDRESS)
+			rpc->SetRecipientAddress(postedCall.systemAddress, false);
+		postedCall.shardFunction(rpc);
+	}
+	shard->runningCalls.clear();
+}
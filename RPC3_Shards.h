@@ -0,0 +1,158 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/// \file
+/// \brief Runs one set of RPC3 registrations on several RakPeerInterface instances, each updated on its own thread.
+
+
+#ifndef __RPC3_SHARDS_H
+#define __RPC3_SHARDS_H
+
+#include "RPC3.h"
+#include "SimpleMutex.h"
+#include "DS_Hash.h"
+#include "DS_List.h"
+#include <functional>
+#include <vector>
+
+namespace RakNet
+{
+
+/// \brief Routes work to the RPC3 shard that owns a connection
+/// \details A shard is an RPC3 instance attached to its own RakPeerInterface, with its own NetworkIDManager, updated by one thread.
+/// Functions and slots are registered once on a registry instance, which is frozen and then shared by every shard.
+/// <BR>
+/// Other threads cannot use a shard directly, as RPC3 is not threadsafe. Post() queues a function for the shard owning a connection instead,
+/// and the shard runs it from RakPeerInterface::Receive() on its own thread. A shard blocked in RPC3::WaitForCalls() is woken to run it.
+/// \code
+/// RPC3 registry;
+/// RPC3_REGISTER_FUNCTION(&registry, Move);
+/// registry.FreezeRegistry();
+/// RPC3ShardGroup group;
+/// group.SetRegistry(&registry);
+/// for (int i=0; i < shardCount; i++)
+/// 	group.AddShard(&shards[i]); // Then start the thread pumping the RakPeerInterface of shards[i]
+/// group.CallC(playerGuid, "Move", x, y); // From any thread
+/// \endcode
+/// \ingroup RPC_3_GROUP
+class RPC3ShardGroup
+{
+public:
+	/// Runs on the thread of the shard, with the recipient of the shard set to the connection it was posted for
+	typedef std::function<void(RPC3 *shard)> ShardFunction;
+
+	RPC3ShardGroup();
+	~RPC3ShardGroup();
+
+	/// Sets the registrations used by shards added afterwards. See RPC3::SetSharedRegistry()
+	/// \return false if \a registry is not frozen
+	bool SetRegistry(RPC3 *registry);
+	RPC3 *GetRegistry(void) const;
+
+	/// Adds \a shard, which must be attached to its RakPeerInterface and not have connections yet
+	/// Add every shard before any of them is updated, the shard list is not locked.
+	/// \return The index of the shard, or -1 if the shard could not use the registry
+	int AddShard(RPC3 *shard);
+	unsigned int GetShardCount(void) const;
+	RPC3 *GetShard(unsigned int index) const;
+
+	/// \return The index of the shard with a connection to \a rakNetGUID, or -1 if there is none. Threadsafe.
+	int GetShardIndex(RakNetGUID rakNetGUID);
+
+	/// Queues \a shardFunction to run on the shard with a connection to \a rakNetGUID. Threadsafe.
+	/// \return false if no shard has a connection to \a rakNetGUID
+	bool Post(RakNetGUID rakNetGUID, const ShardFunction &shardFunction);
+	/// Queues \a shardFunction to run on shard \a index, with the recipient left as the shard has it. Threadsafe.
+	bool PostToShard(unsigned int index, const ShardFunction &shardFunction);
+	/// Queues \a shardFunction to run once on every shard, with each shard set to broadcast. Threadsafe.
+	void PostToAll(const ShardFunction &shardFunction);
+
+	/// RPC3::Call() on the shard owning \a rakNetGUID, to that connection. Threadsafe.
+	/// Arguments are copied into the queue. Data that pointer arguments point to must stay valid until the shard runs the call, so pass strings as RakString.
+	template<typename... Args>
+	bool Call(RakNetGUID rakNetGUID, const char *uniqueIdentifier, const Args&... args)
+	{
+		RakString identifier(uniqueIdentifier);
+		return Post(rakNetGUID, [=](RPC3 *shard) {shard->Call(identifier.C_String(), args...);});
+	}
+
+	/// RPC3::CallC() on the shard owning \a rakNetGUID. See Call()
+	template<typename... Args>
+	bool CallC(RakNetGUID rakNetGUID, const char *uniqueIdentifier, const Args&... args)
+	{
+		RakString identifier(uniqueIdentifier);
+		return Post(rakNetGUID, [=](RPC3 *shard) {shard->CallC(identifier.C_String(), args...);});
+	}
+
+	/// RPC3::CallCPP() on the shard owning \a rakNetGUID. See Call()
+	template<typename... Args>
+	bool CallCPP(RakNetGUID rakNetGUID, const char *uniqueIdentifier, NetworkID nid, const Args&... args)
+	{
+		RakString identifier(uniqueIdentifier);
+		return Post(rakNetGUID, [=](RPC3 *shard) {shard->CallCPP(identifier.C_String(), nid, args...);});
+	}
+
+	/// RPC3::Signal() on the shard owning \a rakNetGUID, to that connection. See Call()
+	template<typename... Args>
+	bool Signal(RakNetGUID rakNetGUID, const char *uniqueIdentifier, const Args&... args)
+	{
+		RakString identifier(uniqueIdentifier);
+		return Post(rakNetGUID, [=](RPC3 *shard) {shard->Signal(identifier.C_String(), args...);});
+	}
+
+	/// RPC3::Signal() broadcast by every shard to all of its connections. Local slots run once per shard. See Call()
+	template<typename... Args>
+	void SignalAll(const char *uniqueIdentifier, const Args&... args)
+	{
+		RakString identifier(uniqueIdentifier);
+		PostToAll([=](RPC3 *shard) {shard->Signal(identifier.C_String(), args...);});
+	}
+
+	/// \internal
+	void OnShardConnection(unsigned int index, const SystemAddress &systemAddress, RakNetGUID rakNetGUID);
+	/// \internal
+	void OnShardDisconnection(unsigned int index, RakNetGUID rakNetGUID);
+	/// \internal
+	void OnShardShutdown(unsigned int index);
+	/// \internal
+	/// Called by the shard from RPC3::Update()
+	void RunPostedCalls(unsigned int index);
+
+protected:
+	struct PostedCall
+	{
+		ShardFunction shardFunction;
+		SystemAddress systemAddress;
+		bool broadcast;
+	};
+	struct Shard
+	{
+		RPC3 *rpc;
+		SimpleMutex postedCallsMutex;
+		std::vector<PostedCall> postedCalls;
+		/// Only used by the thread of the shard, kept to reuse its allocation
+		std::vector<PostedCall> runningCalls;
+	};
+	struct Owner
+	{
+		unsigned int shardIndex;
+		SystemAddress systemAddress;
+	};
+
+	void Post(unsigned int index, const PostedCall &postedCall);
+
+	RPC3 *registry;
+	DataStructures::List<Shard*> shards;
+	SimpleMutex ownersMutex;
+	DataStructures::Hash<RakNetGUID, Owner, 2048, RakNetGUID::ToUint32> owners;
+};
+
+} // namespace RakNet
+
+#endif
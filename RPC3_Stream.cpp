@@ -0,0 +1,94 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#include "RPC3_Stream.h"
+#include "RPC3.h"
+
+using namespace RakNet;
+using namespace RakNet::_RPC3;
+
+static const std::vector<unsigned char> noData;
+
+Stream::Stream(const void *data, unsigned int length) : state(std::make_shared<StreamState>())
+{
+	state->data.assign((const unsigned char*) data, (const unsigned char*) data + length);
+	state->length=length;
+	state->received=length;
+}
+
+Stream::Stream(std::vector<unsigned char> &&data) : state(std::make_shared<StreamState>())
+{
+	state->data.swap(data);
+	state->length=(uint32_t) state->data.size();
+	state->received=state->length;
+}
+
+Stream::Stream(const RakNet::BitStream &bitStream) : state(std::make_shared<StreamState>())
+{
+	const unsigned char *data = bitStream.GetData();
+	state->data.assign(data, data + bitStream.GetNumberOfBytesUsed());
+	state->length=(uint32_t) state->data.size();
+	state->received=state->length;
+}
+
+unsigned int Stream::GetLength(void) const
+{
+	return state ? state->length : 0;
+}
+
+unsigned int Stream::GetReceivedLength(void) const
+{
+	return state ? state->received : 0;
+}
+
+StreamStatus Stream::GetStatus(void) const
+{
+	return state ? state->status : STREAM_COMPLETE;
+}
+
+const std::vector<unsigned char> &Stream::GetData(void) const
+{
+	return state ? state->data : noData;
+}
+
+void Stream::SetChunkHandler(const StreamChunkHandler &handler)
+{
+	if (!state || !handler)
+		return;
+	if (state->data.size() > 0)
+		handler(&state->data[0], (unsigned int) state->data.size(), 0);
+	// The sending system keeps its bytes, which are still being sent
+	if (state->incoming==false)
+		return;
+	std::vector<unsigned char>().swap(state->data);
+	if (state->status==STREAM_RECEIVING)
+		state->chunkHandler=handler;
+}
+
+void Stream::SetCompleteHandler(const StreamCompleteHandler &handler)
+{
+	if (!state || !handler)
+		return;
+	if (state->status==STREAM_RECEIVING)
+	{
+		state->completeHandler=handler;
+		return;
+	}
+	bool hasData = state->status==STREAM_COMPLETE && state->data.size()==state->length && state->length > 0;
+	handler(state->status, hasData ? &state->data[0] : 0, hasData ? state->length : 0);
+}
+
+void Stream::Cancel(void)
+{
+	if (!state || state->rpc==0)
+		return;
+	// The plugin may drop its references
+	std::shared_ptr<StreamState> keep(state);
+	state->rpc->CancelStream(keep);
+}
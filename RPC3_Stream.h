@@ -0,0 +1,124 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#ifndef __RPC3_STREAM_H
+#define __RPC3_STREAM_H
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <type_traits>
+
+#include "BitStream.h"
+
+/*
+ * Large argument sent in chunks after the call, instead of inside it.
+ *
+ * A BitStream argument of several megabytes becomes one message, which
+ * RakNet buffers whole on both ends and which holds back every call sent
+ * after it on the same ordering channel. A Stream argument only carries an
+ * id and a length. RPC3 sends the bytes after the call, a window of chunks
+ * at a time, so other calls go out in between:
+ *
+ *     void LoadLevel(RakNet::_RPC3::Stream level, RakNet::RPC3 *rpc);
+ *     rpc->CallC("LoadLevel", RakNet::_RPC3::Stream(levelBitStream), rpc);
+ *
+ * The handler runs when the call arrives, before the bytes do. It either
+ * takes them chunk by chunk, so only a window of them is ever held:
+ *
+ *     level.SetChunkHandler([](const unsigned char *data, unsigned int length, unsigned int offset) {...});
+ *
+ * or lets them be reassembled and reads them once they are all there:
+ *
+ *     level.SetCompleteHandler([](RakNet::_RPC3::StreamStatus status, const unsigned char *data, unsigned int length) {...});
+ *
+ * A stream nobody keeps a copy of or set a handler on when the handler
+ * returns is cancelled, so unread streams cost the sender nothing. See
+ * RPC3::SetStreamWindow().
+ */
+
+namespace RakNet
+{
+class RPC3;
+
+namespace _RPC3
+{
+
+enum StreamStatus
+{
+	// Chunks are still arriving
+	STREAM_RECEIVING,
+	// Every byte arrived, or the stream was made on this system
+	STREAM_COMPLETE,
+	// Cancelled by either end, or the connection closed
+	STREAM_CANCELLED,
+};
+
+// Gets the bytes starting at offset, in order. The data is only valid during the call.
+typedef std::function<void(const unsigned char *data, unsigned int length, unsigned int offset)> StreamChunkHandler;
+// Runs once when the stream ends. The data holds every byte with STREAM_COMPLETE, unless a chunk handler took them, and is 0 otherwise.
+typedef std::function<void(StreamStatus status, const unsigned char *data, unsigned int length)> StreamCompleteHandler;
+
+// Shared by every copy of a Stream, and by RPC3 while the bytes are sent or received
+struct StreamState
+{
+	StreamState() : length(0), received(0), status(STREAM_COMPLETE), incoming(false), rpc(0) {}
+
+	// Every byte on the sending system. On the receiving system, those that arrived and were not taken by the chunk handler.
+	std::vector<unsigned char> data;
+	uint32_t length;
+	uint32_t received;
+	StreamStatus status;
+	// Received from another system, rather than made on this one
+	bool incoming;
+	StreamChunkHandler chunkHandler;
+	StreamCompleteHandler completeHandler;
+	// Plugin sending or receiving the bytes, to cancel through. 0 once it is done with the stream.
+	RPC3 *rpc;
+};
+
+struct Stream
+{
+	Stream() {}
+	// Copies length bytes from data
+	Stream(const void *data, unsigned int length);
+	// Takes data without copying it
+	Stream(std::vector<unsigned char> &&data);
+	// Copies the bytes used by bitStream
+	Stream(const RakNet::BitStream &bitStream);
+
+	// Bytes in the stream, including those still to arrive
+	unsigned int GetLength(void) const;
+	// Bytes that arrived so far
+	unsigned int GetReceivedLength(void) const;
+	StreamStatus GetStatus(void) const;
+	// Bytes held, see StreamState::data
+	const std::vector<unsigned char> &GetData(void) const;
+
+	// Passes the bytes that already arrived to handler at once, then each chunk as it arrives, without keeping them
+	void SetChunkHandler(const StreamChunkHandler &handler);
+	// Runs handler when the stream ends, at once if it already did
+	void SetCompleteHandler(const StreamCompleteHandler &handler);
+	// Stops the transfer. On the sending system, to every recipient.
+	void Cancel(void);
+
+	std::shared_ptr<StreamState> state;
+};
+
+template <typename T>
+struct IsStream
+{
+	static const bool value = std::is_same<typename std::remove_const<T>::type, Stream>::value;
+};
+
+} // namespace _RPC3
+} // namespace RakNet
+
+#endif
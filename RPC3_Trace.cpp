@@ -0,0 +1,250 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#include "RPC3_Trace.h"
+#include "RakMemoryOverride.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace RakNet;
+
+static const RPC3TraceStage SPAN_STAGES[RPC3_TRACE_SPAN_COUNT][2] =
+{
+	{RPC3_TRACE_CALL, RPC3_TRACE_SERIALIZED},
+	{RPC3_TRACE_SERIALIZED, RPC3_TRACE_SENT},
+	{RPC3_TRACE_REMOTE_SENT, RPC3_TRACE_RECEIVED},
+	{RPC3_TRACE_RECEIVED, RPC3_TRACE_DECODED},
+	{RPC3_TRACE_DECODED, RPC3_TRACE_HANDLED},
+};
+static const char *SPAN_NAMES[RPC3_TRACE_SPAN_COUNT] = {"serialize", "send", "network", "decode", "handler"};
+
+bool RPC3TraceRecord::HasSpan(RPC3TraceSpan span) const
+{
+	return times[SPAN_STAGES[span][0]]!=0 && times[SPAN_STAGES[span][1]]!=0;
+}
+
+RakNet::TimeUS RPC3TraceRecord::GetSpan(RPC3TraceSpan span) const
+{
+	if (HasSpan(span)==false)
+		return 0;
+	RakNet::TimeUS start = times[SPAN_STAGES[span][0]];
+	RakNet::TimeUS end = times[SPAN_STAGES[span][1]];
+	// The remote send time only has millisecond precision
+	return end > start ? end - start : 0;
+}
+
+RPC3TraceStage RPC3TraceRecord::GetSpanStart(RPC3TraceSpan span)
+{
+	return SPAN_STAGES[span][0];
+}
+
+RPC3TraceStage RPC3TraceRecord::GetSpanEnd(RPC3TraceSpan span)
+{
+	return SPAN_STAGES[span][1];
+}
+
+const char *RPC3TraceRecord::GetSpanName(RPC3TraceSpan span)
+{
+	return SPAN_NAMES[span];
+}
+
+RakNet::TimeUS RPC3TraceHistogram::GetPercentile(float fraction) const
+{
+	if (count==0)
+		return 0;
+	uint64_t rank = (uint64_t) (fraction * (float) count);
+	if (rank >= count)
+		rank = count-1;
+	uint64_t seen=0;
+	unsigned int i;
+	for (i=0; i < RPC3_TRACE_HISTOGRAM_BUCKETS-1; i++)
+	{
+		seen+=buckets[i];
+		if (seen > rank)
+			return (RakNet::TimeUS) 1 << i;
+	}
+	return maximum;
+}
+
+static unsigned int GetHistogramBucket(RakNet::TimeUS duration)
+{
+	unsigned int bucket=0;
+	while (duration!=0 && bucket < RPC3_TRACE_HISTOGRAM_BUCKETS-1)
+	{
+		duration>>=1;
+		bucket++;
+	}
+	return bucket;
+}
+
+RPC3Tracer::RPC3Tracer(unsigned int capacity) : startCount(0), writeCount(0)
+{
+	unsigned int size=1;
+	while (size < capacity)
+		size<<=1;
+	records = RakNet::OP_NEW_ARRAY<RPC3TraceRecord>(size, _FILE_AND_LINE_);
+	mask=size-1;
+}
+
+RPC3Tracer::~RPC3Tracer()
+{
+	RakNet::OP_DELETE_ARRAY(records, _FILE_AND_LINE_);
+}
+
+void RPC3Tracer::Add(const RPC3TraceRecord &record)
+{
+	uint64_t index = writeCount.load(std::memory_order_relaxed);
+	startCount.store(index+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	records[index & mask]=record;
+	writeCount.store(index+1, std::memory_order_release);
+}
+
+void RPC3Tracer::GetRecords(DataStructures::List<RPC3TraceRecord> &output) const
+{
+	uint64_t end = writeCount.load(std::memory_order_acquire);
+	uint64_t capacity = (uint64_t) mask+1;
+	uint64_t start = end > capacity ? end-capacity : 0;
+	DataStructures::List<RPC3TraceRecord> copied;
+	copied.Preallocate((unsigned int) (end-start), _FILE_AND_LINE_);
+	uint64_t index;
+	for (index=start; index < end; index++)
+		copied.Insert(records[index & mask], _FILE_AND_LINE_);
+
+	// The slot of record i is rewritten by record i+capacity, so records whose slot the writer may have started on meanwhile are dropped
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t started = startCount.load(std::memory_order_relaxed);
+	uint64_t keepFrom = started > capacity ? started-capacity : 0;
+	for (index=keepFrom > start ? keepFrom : start; index < end; index++)
+		output.Insert(copied[(unsigned int) (index-start)], _FILE_AND_LINE_);
+}
+
+uint64_t RPC3Tracer::GetRecordCount(void) const
+{
+	return writeCount.load(std::memory_order_acquire);
+}
+
+unsigned int RPC3Tracer::GetCapacity(void) const
+{
+	return mask+1;
+}
+
+void RPC3Tracer::GetHistograms(DataStructures::List<RPC3TraceHistogram> &histograms) const
+{
+	DataStructures::List<RPC3TraceRecord> snapshot;
+	GetRecords(snapshot);
+	unsigned int i, j;
+	for (i=0; i < snapshot.Size(); i++)
+	{
+		const RPC3TraceRecord &record = snapshot[i];
+		int span;
+		for (span=0; span < RPC3_TRACE_SPAN_COUNT; span++)
+		{
+			if (record.HasSpan((RPC3TraceSpan) span)==false)
+				continue;
+			// Few identifiers are traced at once, so a linear search is enough
+			for (j=0; j < histograms.Size(); j++)
+			{
+				if (histograms[j].span==span && strcmp(histograms[j].identifier.C_String(), record.identifier)==0)
+					break;
+			}
+			if (j==histograms.Size())
+			{
+				RPC3TraceHistogram histogram;
+				histogram.identifier=record.identifier;
+				histogram.span=(RPC3TraceSpan) span;
+				histogram.count=0;
+				histogram.total=0;
+				histogram.maximum=0;
+				memset(histogram.buckets, 0, sizeof(histogram.buckets));
+				histograms.Insert(histogram, _FILE_AND_LINE_);
+			}
+			RPC3TraceHistogram &histogram = histograms[j];
+			RakNet::TimeUS duration = record.GetSpan((RPC3TraceSpan) span);
+			histogram.count++;
+			histogram.total+=duration;
+			if (duration > histogram.maximum)
+				histogram.maximum=duration;
+			histogram.buckets[GetHistogramBucket(duration)]++;
+		}
+	}
+}
+
+static void WriteJSONString(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++)
+	{
+		unsigned char c = (unsigned char) *str;
+		if (c=='"' || c=='\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+bool RPC3Tracer::ExportChromeTrace(const char *path, unsigned int processId, const char *processName) const
+{
+	FILE *fp = fopen(path, "w");
+	if (fp==0)
+		return false;
+
+	DataStructures::List<RPC3TraceRecord> snapshot;
+	GetRecords(snapshot);
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first=true;
+	if (processName)
+	{
+		fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":", processId);
+		WriteJSONString(fp, processName);
+		fprintf(fp, "}}");
+		first=false;
+	}
+	unsigned int i;
+	for (i=0; i < snapshot.Size(); i++)
+	{
+		const RPC3TraceRecord &record = snapshot[i];
+		// Senders on thread 1 and handlers on thread 2, so spans of calls to this system do not overlap
+		unsigned int threadId = record.outgoing ? 1 : 2;
+		char traceName[48];
+		sprintf(traceName, "%llx-%x", (unsigned long long) record.origin.g, record.traceId);
+		int span;
+		for (span=0; span < RPC3_TRACE_SPAN_COUNT; span++)
+		{
+			if (record.HasSpan((RPC3TraceSpan) span)==false)
+				continue;
+			fprintf(fp, "%s{\"name\":\"%s\",\"cat\":", first ? "" : ",\n", SPAN_NAMES[span]);
+			WriteJSONString(fp, record.identifier);
+			fprintf(fp, ",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%u,\"tid\":%u,\"args\":{\"trace\":\"%s\",\"function\":",
+				(unsigned long long) record.times[SPAN_STAGES[span][0]], (unsigned long long) record.GetSpan((RPC3TraceSpan) span), processId, threadId, traceName);
+			WriteJSONString(fp, record.identifier);
+			fprintf(fp, "}}");
+			first=false;
+		}
+		if (record.traceId==0)
+			continue;
+		// Joins the send on one system to the receive on the other
+		RPC3TraceStage flowStage = record.outgoing ? RPC3_TRACE_SENT : RPC3_TRACE_RECEIVED;
+		if (record.times[flowStage]==0)
+			continue;
+		fprintf(fp, "%s{\"name\":\"rpc\",\"cat\":\"rpc3\",\"ph\":\"%s\",\"id\":\"%s\",\"ts\":%llu,\"pid\":%u,\"tid\":%u%s}",
+			first ? "" : ",\n", record.outgoing ? "s" : "f", traceName, (unsigned long long) record.times[flowStage], processId, threadId,
+			record.outgoing ? "" : ",\"bp\":\"e\"");
+		first=false;
+	}
+	fprintf(fp, "\n]}\n");
+	bool written = ferror(fp)==0;
+	if (fclose(fp)!=0)
+		written=false;
+	return written;
+}
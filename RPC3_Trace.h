@@ -0,0 +1,162 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/// \file
+/// \brief Sampled lifecycle records of RPC3 calls, kept in a ring written by RPC3::EnableTracing().
+/// \details The system sending a call records when it was made, serialized and handed to RakNet.
+/// The system handling it records when it was sent according to the ID_TIMESTAMP clock, received, decoded and when the handler returned.
+/// Both records carry the same trace id and the GUID of the sender, so traces exported on each system can be matched.
+
+
+#ifndef __RPC3_TRACE_H
+#define __RPC3_TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include "RakNetTypes.h"
+#include "RakString.h"
+#include "DS_List.h"
+
+namespace RakNet
+{
+
+/// \ingroup RPC_3_GROUP
+/// Records kept by RPC3::EnableTracing() when no capacity is given
+#define RPC3_DEFAULT_TRACE_CAPACITY 4096
+
+/// \ingroup RPC_3_GROUP
+/// Longer identifiers are truncated in RPC3TraceRecord
+#define RPC3_TRACE_IDENTIFIER_LENGTH 48
+
+/// \ingroup RPC_3_GROUP
+/// Power of two buckets of RPC3TraceHistogram, the last one ends above 8 seconds
+#define RPC3_TRACE_HISTOGRAM_BUCKETS 24
+
+/// \brief Points in the life of a traced call, in RPC3TraceRecord::times
+/// \ingroup RPC_3_GROUP
+enum RPC3TraceStage
+{
+	/// Sender, Call() or Signal() was entered
+	RPC3_TRACE_CALL,
+	/// Sender, the parameters are serialized
+	RPC3_TRACE_SERIALIZED,
+	/// Sender, the message was handed to RakNet for every recipient
+	RPC3_TRACE_SENT,
+	/// Handler, when the sender sent the message, from the ID_TIMESTAMP clock. Millisecond precision, and only for calls to one system.
+	RPC3_TRACE_REMOTE_SENT,
+	/// Handler, the message reached RPC3
+	RPC3_TRACE_RECEIVED,
+	/// Handler, the arguments are read and the handler starts
+	RPC3_TRACE_DECODED,
+	/// Handler, the function or the last slot returned
+	RPC3_TRACE_HANDLED,
+	RPC3_TRACE_STAGE_COUNT
+};
+
+/// \brief Time between two stages, the unit of RPC3TraceHistogram and of exported events
+/// \ingroup RPC_3_GROUP
+enum RPC3TraceSpan
+{
+	/// RPC3_TRACE_CALL to RPC3_TRACE_SERIALIZED
+	RPC3_TRACE_SPAN_SERIALIZE,
+	/// RPC3_TRACE_SERIALIZED to RPC3_TRACE_SENT
+	RPC3_TRACE_SPAN_SEND,
+	/// RPC3_TRACE_REMOTE_SENT to RPC3_TRACE_RECEIVED
+	RPC3_TRACE_SPAN_NETWORK,
+	/// RPC3_TRACE_RECEIVED to RPC3_TRACE_DECODED
+	RPC3_TRACE_SPAN_DECODE,
+	/// RPC3_TRACE_DECODED to RPC3_TRACE_HANDLED
+	RPC3_TRACE_SPAN_HANDLER,
+	RPC3_TRACE_SPAN_COUNT
+};
+
+/// \brief One side of one traced call
+/// \ingroup RPC_3_GROUP
+struct RPC3TraceRecord
+{
+	/// Unique per sender, 0 for calls that were not traced but passed to the slow handler callback
+	uint32_t traceId;
+	/// System that sent the call
+	RakNetGUID origin;
+	/// True on the sending side, false on the handling side
+	bool outgoing;
+	bool isCall;
+	char identifier[RPC3_TRACE_IDENTIFIER_LENGTH];
+	/// GetTimeUS() at each RPC3TraceStage, 0 for stages not seen by this side
+	RakNet::TimeUS times[RPC3_TRACE_STAGE_COUNT];
+
+	/// \return True if both stages of \a span were recorded
+	bool HasSpan(RPC3TraceSpan span) const;
+	/// \return Duration of \a span, 0 if it was not recorded
+	RakNet::TimeUS GetSpan(RPC3TraceSpan span) const;
+	static RPC3TraceStage GetSpanStart(RPC3TraceSpan span);
+	static RPC3TraceStage GetSpanEnd(RPC3TraceSpan span);
+	static const char *GetSpanName(RPC3TraceSpan span);
+};
+
+/// \brief Distribution of one span of one identifier, see RPC3Tracer::GetHistograms()
+/// \ingroup RPC_3_GROUP
+struct RPC3TraceHistogram
+{
+	RakNet::RakString identifier;
+	RPC3TraceSpan span;
+	uint64_t count;
+	RakNet::TimeUS total;
+	RakNet::TimeUS maximum;
+	/// Bucket 0 counts spans under 1 microsecond, bucket n those from 2^(n-1) up to 2^n microseconds. The last bucket takes everything longer.
+	uint32_t buckets[RPC3_TRACE_HISTOGRAM_BUCKETS];
+
+	/// \return Upper bound of the bucket holding the \a fraction quantile, such as 0.99
+	RakNet::TimeUS GetPercentile(float fraction) const;
+};
+
+/// \brief Fixed size ring of RPC3TraceRecord
+/// \details Written by the thread the owning RPC3 runs on, without locking. Any thread can read it while it is written.
+/// Records are overwritten oldest first once the ring is full.
+/// \ingroup RPC_3_GROUP
+class RPC3Tracer
+{
+public:
+	/// \param[in] capacity Rounded up to a power of two
+	RPC3Tracer(unsigned int capacity);
+	~RPC3Tracer();
+
+	/// Appends \a record, from the thread of the owning RPC3 only
+	void Add(const RPC3TraceRecord &record);
+
+	/// Copies the records currently in the ring, oldest first. Threadsafe.
+	/// Records being overwritten while they are copied are left out.
+	void GetRecords(DataStructures::List<RPC3TraceRecord> &records) const;
+
+	/// \return Records added since creation, including those since overwritten
+	uint64_t GetRecordCount(void) const;
+	unsigned int GetCapacity(void) const;
+
+	/// Builds one histogram per identifier and span from the records currently in the ring. Threadsafe.
+	void GetHistograms(DataStructures::List<RPC3TraceHistogram> &histograms) const;
+
+	/// Writes the records currently in the ring as Chrome trace-event JSON, for chrome://tracing or Perfetto. Threadsafe.
+	/// Each span is a complete event. Sends and receives of the same call are joined by a flow event, once the files of both systems are loaded together.
+	/// \param[in] path File to create
+	/// \param[in] processId Shown as the process of every event. Use a different one on each system.
+	/// \param[in] processName Name of the process in the viewer, or 0
+	/// \return false if the file could not be written
+	bool ExportChromeTrace(const char *path, unsigned int processId=1, const char *processName=0) const;
+
+protected:
+	RPC3TraceRecord *records;
+	unsigned int mask;
+	/// Only the writer stores. startCount before writing a record, writeCount once it is complete.
+	std::atomic<uint64_t> startCount;
+	std::atomic<uint64_t> writeCount;
+};
+
+} // namespace RakNet
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+#include "RPC3_Wakeup.h"
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <chrono>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+using namespace RakNet;
+
+RPC3Wakeup::RPC3Wakeup() : signalled(false)
+{
+#if defined(__linux__)
+	readDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	writeDescriptor = readDescriptor;
+#elif !defined(_WIN32)
+	int descriptors[2];
+	if (pipe(descriptors)==0)
+	{
+		int i;
+		for (i=0; i < 2; i++)
+		{
+			fcntl(descriptors[i], F_SETFL, fcntl(descriptors[i], F_GETFL) | O_NONBLOCK);
+			fcntl(descriptors[i], F_SETFD, FD_CLOEXEC);
+		}
+		readDescriptor=descriptors[0];
+		writeDescriptor=descriptors[1];
+	}
+	else
+	{
+		readDescriptor=-1;
+		writeDescriptor=-1;
+	}
+#endif
+}
+
+RPC3Wakeup::~RPC3Wakeup()
+{
+#if !defined(_WIN32)
+	if (writeDescriptor!=readDescriptor)
+		close(writeDescriptor);
+	if (readDescriptor!=-1)
+		close(readDescriptor);
+#endif
+}
+
+void RPC3Wakeup::Signal(void)
+{
+	if (signalled.load(std::memory_order_acquire))
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (signalled.load(std::memory_order_relaxed))
+		return;
+	signalled.store(true, std::memory_order_release);
+#if defined(_WIN32)
+	condition.notify_all();
+#else
+	if (writeDescriptor==-1)
+		return;
+	// An eventfd reads a 64 bit counter, a pipe any single byte
+	uint64_t one=1;
+	ssize_t written = write(writeDescriptor, &one, writeDescriptor==readDescriptor ? sizeof(one) : 1);
+	(void) written;
+#endif
+}
+
+void RPC3Wakeup::Reset(void)
+{
+	if (signalled.load(std::memory_order_acquire)==false)
+		return;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (signalled.load(std::memory_order_relaxed)==false)
+		return;
+	signalled.store(false, std::memory_order_release);
+#if !defined(_WIN32)
+	if (readDescriptor==-1)
+		return;
+	uint64_t buffer[8];
+	while (read(readDescriptor, buffer, sizeof(buffer)) > 0)
+		;
+#endif
+}
+
+bool RPC3Wakeup::IsSignalled(void) const
+{
+	return signalled.load(std::memory_order_acquire);
+}
+
+bool RPC3Wakeup::Wait(unsigned int timeoutMs)
+{
+	if (signalled.load(std::memory_order_acquire))
+		return true;
+#if defined(_WIN32)
+	std::unique_lock<std::mutex> lock(mutex);
+	return condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] {return signalled.load(std::memory_order_relaxed);});
+#else
+	struct pollfd descriptor;
+	descriptor.fd=readDescriptor;
+	descriptor.events=POLLIN;
+	descriptor.revents=0;
+	// A descriptor of -1 is ignored, which leaves a plain sleep
+	poll(&descriptor, 1, (int) timeoutMs);
+	return signalled.load(std::memory_order_acquire);
+#endif
+}
+
+int RPC3Wakeup::GetFileDescriptor(void) const
+{
+#if defined(_WIN32)
+	return -1;
+#else
+	return readDescriptor;
+#endif
+}
@@ -0,0 +1,69 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/// \file
+/// \brief Level-triggered event that wakes a thread waiting for RPC3 calls, see RPC3::EnableWakeup().
+/// \details On Linux the event is an eventfd, on other POSIX systems a pipe, so it can be added to epoll, poll or select.
+/// On Windows there is no descriptor and only Wait() can be used.
+
+
+#ifndef __RPC3_WAKEUP_H
+#define __RPC3_WAKEUP_H
+
+#include <atomic>
+#include <mutex>
+#if defined(_WIN32)
+#include <condition_variable>
+#endif
+
+namespace RakNet
+{
+
+/// \brief Event set by any thread and cleared by the thread it wakes
+/// \details Setting an already set event costs one atomic load, so it can be set once per received message.
+/// \ingroup RPC_3_GROUP
+class RPC3Wakeup
+{
+public:
+	RPC3Wakeup();
+	~RPC3Wakeup();
+
+	/// Sets the event, making the descriptor readable. Threadsafe.
+	void Signal(void);
+
+	/// Clears the event, from the waiting thread
+	void Reset(void);
+
+	/// \return True if the event is set
+	bool IsSignalled(void) const;
+
+	/// Blocks until the event is set, without clearing it
+	/// \param[in] timeoutMs Longest wait in milliseconds
+	/// \return True if the event is set, false on timeout
+	bool Wait(unsigned int timeoutMs);
+
+	/// \return Descriptor readable while the event is set, or -1 on Windows or if it could not be created
+	int GetFileDescriptor(void) const;
+
+protected:
+	/// Read without the lock to skip setting or clearing twice, changed with it together with the descriptor
+	std::atomic<bool> signalled;
+	std::mutex mutex;
+#if defined(_WIN32)
+	std::condition_variable condition;
+#else
+	int readDescriptor;
+	/// Same as readDescriptor for an eventfd
+	int writeDescriptor;
+#endif
+};
+
+} // namespace RakNet
+
+#endif
@@ -90,6 +90,10 @@ int main(int argc, char *argv[]) {
     // Add RPC3 plugin.
     std::unique_ptr<RakNet::RPC3> rpc3;
     rpc3.reset(new RakNet::RPC3);
+#ifdef __RPC3_STD_H
+    // Lets the main loop sleep until a call arrives, instead of spinning.
+    rpc3->EnableWakeup();
+#endif
     rakPeer->AttachPlugin(rpc3.get());
     
     RakNet::NetworkIDManager networkIDManager;
@@ -253,7 +257,12 @@ int main(int argc, char *argv[]) {
             rpc3->Signal("TestSlot");
         }
 
+#ifdef __RPC3_STD_H
+        // Connection messages do not wake it, so they wait at most this long.
+        rpc3->WaitForCalls(30);
+#else
         RakSleep(0);
+#endif
     }
 
     rakPeer->Shutdown(100, 0);
@@ -0,0 +1,678 @@
+/*
+ *  Copyright (c) 2016, Indium Games
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree.
+ *
+ */
+
+/*
+ * Load generator for the RPC3 plugin.
+ *
+ * One server RPC3 is driven by thousands of virtual clients. A virtual client
+ * is only an address, a GUID and its next due calls, so client counts far
+ * beyond what separate RakPeerInterface instances allow can be simulated.
+ *
+ * The messages are encoded once by a real RPC3 client, sent to a recorder
+ * over a loopback connection. The recorded bytes are then delivered to the
+ * server as if each virtual client had sent them, on a Poisson schedule per
+ * client and message kind. Latency is measured from when a message was due
+ * until the server returned from dispatching it, so it includes any backlog
+ * once the server falls behind.
+ */
+
+#include "RPC3.h"
+#include "RakPeerInterface.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <functional>
+
+#include "MessageIdentifiers.h"
+#include "RakSleep.h"
+#include "NetworkIDObject.h"
+#include "NetworkIDManager.h"
+#include "GetTime.h"
+
+static const char *LOAD_SIGNAL = "LoadTick";
+
+static uint64_t cFunctionCalls = 0;
+
+void LoadCFunction(int32_t value, float position, RakNet::RakString payload,
+        RakNet::RPC3 *rpcFromNetwork) {
+    cFunctionCalls++;
+}
+
+class LoadObject : public RakNet::NetworkIDObject {
+
+public:
+    LoadObject() : calls(0), slotCalls(0) {}
+
+    void Move(float x, float y, uint32_t sequence,
+            RakNet::RPC3 *rpcFromNetwork) {
+        calls++;
+    }
+
+    void OnTick(uint32_t sequence, RakNet::RPC3 *rpcFromNetwork) {
+        slotCalls++;
+    }
+
+    uint64_t calls;
+    uint64_t slotCalls;
+};
+
+/*
+ * Every RPC3 instance registers the same functions in the same order, so
+ * the recorded messages decode the same way on the server.
+ */
+void RegisterLoadFunctions(RakNet::RPC3 *rpc) {
+    RPC3_REGISTER_FUNCTION(rpc, LoadCFunction);
+    RPC3_REGISTER_FUNCTION(rpc, &LoadObject::Move);
+}
+
+/*
+ * Keeps the messages received from the encoder instead of running them.
+ * Messages that arrive before recording starts, which is the handshake, are
+ * run as usual and kept as the warmup each virtual client replays on connect.
+ */
+class TemplateRecorder : public RakNet::RPC3 {
+
+public:
+    TemplateRecorder() : recording(false) {}
+
+    bool recording;
+    std::vector<std::vector<unsigned char> > warmup;
+    std::vector<std::vector<unsigned char> > templates;
+
+protected:
+    virtual void OnRPC3Call(const RakNet::SystemAddress &systemAddress,
+            unsigned char *data, unsigned int lengthInBytes) {
+        std::vector<unsigned char> message(lengthInBytes + 1);
+        message[0] = ID_RPC_PLUGIN;
+        memcpy(&message[1], data, lengthInBytes);
+
+        if (recording) {
+            templates.push_back(message);
+        }
+        else {
+            warmup.push_back(message);
+            RakNet::RPC3::OnRPC3Call(systemAddress, data, lengthInBytes);
+        }
+    }
+};
+
+/*
+ * Exposes the plugin callbacks RakPeerInterface would call, so virtual
+ * clients can connect and deliver messages without a real connection.
+ */
+class LoadServer : public RakNet::RPC3 {
+
+public:
+    void Connect(const RakNet::SystemAddress &systemAddress,
+            RakNet::RakNetGUID guid) {
+        OnNewConnection(systemAddress, guid, true);
+    }
+
+    void Disconnect(const RakNet::SystemAddress &systemAddress,
+            RakNet::RakNetGUID guid) {
+        OnClosedConnection(systemAddress, guid,
+                           RakNet::LCR_DISCONNECTION_NOTIFICATION);
+    }
+
+    void Deliver(RakNet::Packet *packet) {
+        OnReceive(packet);
+    }
+};
+
+enum CallKind {
+    CALL_KIND_C,
+    CALL_KIND_CPP,
+    CALL_KIND_SIGNAL,
+    CALL_KIND_COUNT
+};
+
+struct LoadOptions {
+    std::vector<unsigned int> clientCounts;
+    std::vector<unsigned int> objectCounts;
+    std::vector<unsigned int> slotCounts;
+    /* Calls per second, per virtual client */
+    double rates[CALL_KIND_COUNT];
+    double duration;
+    unsigned int payloadBytes;
+    unsigned int seed;
+    /* Resolve objects with RPC3::RegisterObject handles */
+    bool objectHandles;
+};
+
+struct VirtualClient {
+    RakNet::SystemAddress systemAddress;
+    RakNet::RakNetGUID guid;
+};
+
+struct ScheduledCall {
+    uint64_t due;
+    uint32_t client;
+    uint32_t kind;
+
+    bool operator>(const ScheduledCall &other) const {
+        return due > other.due;
+    }
+};
+
+struct RunResult {
+    uint64_t calls;
+    uint64_t lost;
+    double elapsed;
+    double cpuSeconds;
+    uint64_t dispatchTime;
+    uint64_t connectTime;
+    std::vector<uint32_t> latencies;
+};
+
+static double GetProcessCpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static bool ParseCounts(const char *arg, std::vector<unsigned int> &counts) {
+    counts.clear();
+    std::stringstream stream(arg);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        int count = atoi(item.c_str());
+        if (count <= 0) {
+            return false;
+        }
+        counts.push_back(count);
+    }
+    return !counts.empty();
+}
+
+static void PumpPeers(RakNet::RakPeerInterface *first,
+        RakNet::RakPeerInterface *second) {
+    RakNet::Packet *packet;
+    for (packet = first->Receive(); packet;
+            first->DeallocatePacket(packet), packet = first->Receive()) {
+    }
+    for (packet = second->Receive(); packet;
+            second->DeallocatePacket(packet), packet = second->Receive()) {
+    }
+}
+
+/*
+ * Encodes one CallC message, one signal and one CallCPP message per object,
+ * once the encoder and the recorder agreed on the compact header.
+ */
+static bool EncodeTemplates(const LoadOptions &options,
+        const std::vector<RakNet::NetworkID> &objectIds,
+        RakNet::RakPeerInterface *encoderPeer, RakNet::RPC3 &encoder,
+        RakNet::RakPeerInterface *recorderPeer, TemplateRecorder &recorder) {
+    uint64_t timeout = RakNet::GetTimeUS() + 5000000;
+    while (encoderPeer->NumberOfConnections() == 0 ||
+            encoder.GetProtocolVersion(
+                encoderPeer->GetSystemAddressFromIndex(0)) !=
+                RakNet::RPC3_PROTOCOL_COMPACT ||
+            recorder.warmup.empty()) {
+        if (RakNet::GetTimeUS() > timeout) {
+            std::cout << "Could not connect the template encoder." << std::endl;
+            return false;
+        }
+        PumpPeers(encoderPeer, recorderPeer);
+        RakSleep(1);
+    }
+
+    recorder.recording = true;
+    encoder.SetRecipientAddress(encoderPeer->GetSystemAddressFromIndex(0),
+                                false);
+
+    RakNet::RPC3 *noRpc = 0;
+    RakNet::RakString payload(
+        std::string(options.payloadBytes, 'x').c_str());
+    encoder.CallC("LoadCFunction", (int32_t) 7, 1.5f, payload, noRpc);
+    encoder.Signal(LOAD_SIGNAL, (uint32_t) 1, noRpc);
+    for (size_t i = 0; i < objectIds.size(); i++) {
+        encoder.CallCPP("&LoadObject::Move", objectIds[i],
+                        1.0f, 2.0f, (uint32_t) i, noRpc);
+        if (i % 256 == 255) {
+            PumpPeers(encoderPeer, recorderPeer);
+        }
+    }
+
+    size_t expected = objectIds.size() + 2;
+    timeout = RakNet::GetTimeUS() + 30000000;
+    while (recorder.templates.size() < expected) {
+        if (RakNet::GetTimeUS() > timeout) {
+            std::cout << "Recorded only " << recorder.templates.size()
+                      << " of " << expected << " templates." << std::endl;
+            return false;
+        }
+        PumpPeers(encoderPeer, recorderPeer);
+        RakSleep(0);
+    }
+    return true;
+}
+
+/*
+ * Runs EncodeTemplates() with a real RPC3 client, recording the messages on
+ * the other end of a loopback connection.
+ */
+static bool RecordTemplates(const LoadOptions &options,
+        const std::vector<RakNet::NetworkID> &objectIds,
+        TemplateRecorder &recorder) {
+    RakNet::RakPeerInterface *encoderPeer =
+        RakNet::RakPeerInterface::GetInstance();
+    RakNet::RakPeerInterface *recorderPeer =
+        RakNet::RakPeerInterface::GetInstance();
+    RakNet::RPC3 encoder;
+
+    RakNet::SocketDescriptor recorderSocket(0, 0);
+    recorderSocket.socketFamily = AF_INET;
+    recorderPeer->Startup(1, &recorderSocket, 1);
+    recorderPeer->SetMaximumIncomingConnections(1);
+    recorderPeer->AttachPlugin(&recorder);
+    RegisterLoadFunctions(&recorder);
+
+    RakNet::SocketDescriptor encoderSocket(0, 0);
+    encoderSocket.socketFamily = AF_INET;
+    encoderPeer->Startup(1, &encoderSocket, 1);
+    encoderPeer->AttachPlugin(&encoder);
+
+    unsigned short recorderPort = recorderPeer->GetInternalID(
+        RakNet::UNASSIGNED_SYSTEM_ADDRESS).GetPort();
+    encoderPeer->Connect("127.0.0.1", recorderPort, 0, 0);
+
+    bool recorded = EncodeTemplates(options, objectIds, encoderPeer, encoder,
+                                    recorderPeer, recorder);
+
+    encoderPeer->Shutdown(100, 0);
+    recorderPeer->Shutdown(100, 0);
+    encoderPeer->DetachPlugin(&encoder);
+    recorderPeer->DetachPlugin(&recorder);
+    RakNet::RakPeerInterface::DestroyInstance(encoderPeer);
+    RakNet::RakPeerInterface::DestroyInstance(recorderPeer);
+    return recorded;
+}
+
+static void MakeVirtualClient(unsigned int index, VirtualClient &client) {
+    char address[32];
+    sprintf(address, "10.%u.%u.%u|%u", (index >> 16) & 255, (index >> 8) & 255,
+            index & 255, 1024 + index % 60000);
+    client.systemAddress.FromString(address);
+    client.guid.g = 0x100000000ull + index;
+}
+
+static void DeliverMessage(LoadServer &server, const VirtualClient &client,
+        const std::vector<unsigned char> &message,
+        std::vector<unsigned char> &scratch) {
+    // A fresh copy, as RakPeerInterface would hand over.
+    scratch.assign(message.begin(), message.end());
+    RakNet::Packet packet;
+    packet.systemAddress = client.systemAddress;
+    packet.guid = client.guid;
+    packet.data = &scratch[0];
+    packet.length = (unsigned int) scratch.size();
+    packet.bitSize = packet.length * 8;
+    packet.deleteData = false;
+    packet.wasGeneratedLocally = false;
+    server.Deliver(&packet);
+}
+
+static bool RunLoad(const LoadOptions &options, unsigned int clientCount,
+        unsigned int objectCount, unsigned int slotCount, RunResult &result) {
+    RakNet::NetworkIDManager networkIdManager;
+    LoadServer server;
+    std::vector<LoadObject> objects(objectCount);
+    std::vector<LoadObject> slotObjects(slotCount);
+    std::vector<RakNet::NetworkID> objectIds(objectCount);
+
+    for (unsigned int i = 0; i < objectCount; i++) {
+        objects[i].SetNetworkIDManager(&networkIdManager);
+        if (options.objectHandles) {
+            server.RegisterObject(&objects[i]);
+        } else {
+            objects[i].SetNetworkID(i);
+        }
+        objectIds[i] = objects[i].GetNetworkID();
+    }
+    for (unsigned int i = 0; i < slotCount; i++) {
+        slotObjects[i].SetNetworkIDManager(&networkIdManager);
+        if (options.objectHandles) {
+            server.RegisterObject(&slotObjects[i]);
+        } else {
+            slotObjects[i].SetNetworkID(objectCount + i);
+        }
+    }
+
+    TemplateRecorder recorder;
+    if (!RecordTemplates(options, objectIds, recorder)) {
+        return false;
+    }
+
+    RakNet::RakPeerInterface *serverPeer =
+        RakNet::RakPeerInterface::GetInstance();
+    RakNet::SocketDescriptor serverSocket(0, 0);
+    serverSocket.socketFamily = AF_INET;
+    serverPeer->Startup(1, &serverSocket, 1);
+    serverPeer->AttachPlugin(&server);
+    server.SetNetworkIDManager(&networkIdManager);
+    RegisterLoadFunctions(&server);
+    std::vector<RakNet::NetworkID> slotIds(slotCount);
+    for (unsigned int i = 0; i < slotCount; i++) {
+        slotIds[i] = slotObjects[i].GetNetworkID();
+    }
+    if (slotCount > 0) {
+        server.RegisterSlots(LOAD_SIGNAL, &LoadObject::OnTick, &slotIds[0],
+                             slotCount, 0);
+    }
+    server.FreezeRegistry();
+
+    std::vector<VirtualClient> clients(clientCount);
+    std::vector<unsigned char> scratch;
+    uint64_t startTime = RakNet::GetTimeUS();
+    for (unsigned int i = 0; i < clientCount; i++) {
+        MakeVirtualClient(i, clients[i]);
+        server.Connect(clients[i].systemAddress, clients[i].guid);
+        for (size_t j = 0; j < recorder.warmup.size(); j++) {
+            DeliverMessage(server, clients[i], recorder.warmup[j], scratch);
+        }
+    }
+    result.connectTime = RakNet::GetTimeUS() - startTime;
+
+    std::mt19937 random(options.seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::exponential_distribution<double> intervals[CALL_KIND_COUNT];
+    std::priority_queue<ScheduledCall, std::vector<ScheduledCall>,
+                        std::greater<ScheduledCall> > schedule;
+
+    startTime = RakNet::GetTimeUS();
+    for (unsigned int kind = 0; kind < CALL_KIND_COUNT; kind++) {
+        if (options.rates[kind] <= 0) {
+            continue;
+        }
+        intervals[kind] = std::exponential_distribution<double>(
+            options.rates[kind] / 1e6);
+        for (unsigned int i = 0; i < clientCount; i++) {
+            // Spread the first calls, so clients do not start in lockstep.
+            ScheduledCall call;
+            call.due = startTime +
+                (uint64_t) (uniform(random) * 1e6 / options.rates[kind]);
+            call.client = i;
+            call.kind = kind;
+            schedule.push(call);
+        }
+    }
+
+    uint64_t cFunctionCallsBefore = cFunctionCalls;
+    uint64_t expectedSlotCalls = 0;
+    uint64_t expectedCalls[CALL_KIND_COUNT] = {0, 0, 0};
+    std::uniform_int_distribution<unsigned int> pickObject(0, objectCount - 1);
+
+    result.calls = 0;
+    result.dispatchTime = 0;
+    result.latencies.clear();
+    result.latencies.reserve((size_t) (options.duration * clientCount *
+        (options.rates[0] + options.rates[1] + options.rates[2]) * 1.1));
+
+    double cpuStart = GetProcessCpuSeconds();
+    uint64_t endTime = startTime + (uint64_t) (options.duration * 1e6);
+    uint64_t lastReceive = 0;
+    uint64_t now = RakNet::GetTimeUS();
+    while (now < endTime && !schedule.empty()) {
+        if (schedule.top().due > now || now - lastReceive > 1000) {
+            // Lets the plugin run its Update() as in a real server loop.
+            RakNet::Packet *packet;
+            for (packet = serverPeer->Receive(); packet;
+                    serverPeer->DeallocatePacket(packet),
+                    packet = serverPeer->Receive()) {
+            }
+            lastReceive = now;
+            now = RakNet::GetTimeUS();
+            if (schedule.top().due > now + 2000) {
+                RakSleep(1);
+            }
+            else if (schedule.top().due > now) {
+                RakSleep(0);
+            }
+            now = RakNet::GetTimeUS();
+            continue;
+        }
+
+        ScheduledCall call = schedule.top();
+        schedule.pop();
+
+        const std::vector<unsigned char> *message;
+        if (call.kind == CALL_KIND_C) {
+            message = &recorder.templates[0];
+        }
+        else if (call.kind == CALL_KIND_SIGNAL) {
+            message = &recorder.templates[1];
+            expectedSlotCalls += slotCount;
+        }
+        else {
+            message = &recorder.templates[2 + pickObject(random)];
+        }
+        expectedCalls[call.kind]++;
+
+        DeliverMessage(server, clients[call.client], *message, scratch);
+        uint64_t done = RakNet::GetTimeUS();
+        result.dispatchTime += done - now;
+        result.latencies.push_back((uint32_t) std::min<uint64_t>(
+            done - call.due, 0xFFFFFFFF));
+        result.calls++;
+
+        call.due += (uint64_t) intervals[call.kind](random) + 1;
+        schedule.push(call);
+        now = done;
+    }
+    result.elapsed = (RakNet::GetTimeUS() - startTime) / 1e6;
+    result.cpuSeconds = GetProcessCpuSeconds() - cpuStart;
+
+    uint64_t objectCalls = 0;
+    uint64_t slotCalls = 0;
+    for (unsigned int i = 0; i < objectCount; i++) {
+        objectCalls += objects[i].calls;
+    }
+    for (unsigned int i = 0; i < slotCount; i++) {
+        slotCalls += slotObjects[i].slotCalls;
+    }
+    result.lost =
+        (expectedCalls[CALL_KIND_C] - (cFunctionCalls - cFunctionCallsBefore)) +
+        (expectedCalls[CALL_KIND_CPP] - objectCalls) +
+        (expectedSlotCalls - slotCalls) / std::max(slotCount, 1u);
+
+    for (unsigned int i = 0; i < clientCount; i++) {
+        server.Disconnect(clients[i].systemAddress, clients[i].guid);
+    }
+    serverPeer->Shutdown(0, 0);
+    serverPeer->DetachPlugin(&server);
+    RakNet::RakPeerInterface::DestroyInstance(serverPeer);
+    return true;
+}
+
+static uint32_t GetPercentile(const std::vector<uint32_t> &sorted,
+        double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t) (fraction * sorted.size());
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+static void PrintHeader() {
+    std::cout << std::setw(8) << "clients" << std::setw(8) << "objects"
+              << std::setw(6) << "slots" << std::setw(11) << "offered/s"
+              << std::setw(11) << "calls/s" << std::setw(10) << "cpu us"
+              << std::setw(10) << "disp us" << std::setw(8) << "p50"
+              << std::setw(8) << "p90" << std::setw(8) << "p99"
+              << std::setw(9) << "p99.9" << std::setw(10) << "max"
+              << std::setw(6) << "lost" << std::setw(9) << "conn ms"
+              << std::endl;
+}
+
+static void PrintResult(const LoadOptions &options, unsigned int clientCount,
+        unsigned int objectCount, unsigned int slotCount, RunResult &result) {
+    std::sort(result.latencies.begin(), result.latencies.end());
+    double offered = clientCount *
+        (options.rates[0] + options.rates[1] + options.rates[2]);
+    double calls = result.calls ? (double) result.calls : 1.0;
+
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(8) << clientCount << std::setw(8) << objectCount
+              << std::setw(6) << slotCount
+              << std::setw(11) << (uint64_t) offered
+              << std::setw(11) << (uint64_t) (result.calls / result.elapsed)
+              << std::setw(10) << result.cpuSeconds * 1e6 / calls
+              << std::setw(10) << result.dispatchTime / calls
+              << std::setw(8) << GetPercentile(result.latencies, 0.5)
+              << std::setw(8) << GetPercentile(result.latencies, 0.9)
+              << std::setw(8) << GetPercentile(result.latencies, 0.99)
+              << std::setw(9) << GetPercentile(result.latencies, 0.999)
+              << std::setw(10)
+              << (result.latencies.empty() ? 0 : result.latencies.back())
+              << std::setw(6) << result.lost
+              << std::setw(9) << result.connectTime / 1000.0 << std::endl;
+}
+
+static void PrintUsage() {
+    std::cout
+        << "Options, lists are comma separated and every combination is run:\n"
+        << "  --clients LIST        virtual clients (1000,5000,10000)\n"
+        << "  --objects LIST        objects CallCPP picks from (1000)\n"
+        << "  --slots LIST          slots the signal runs (1)\n"
+        << "  --callc-rate N        CallC per client per second (5)\n"
+        << "  --callcpp-rate N      CallCPP per client per second (20)\n"
+        << "  --signal-rate N       Signal per client per second (1)\n"
+        << "  --duration SECONDS    length of each run (5)\n"
+        << "  --payload-bytes N     string argument of CallC (32)\n"
+        << "  --seed N              schedule seed (1)\n"
+        << "  --object-handles      register objects with RPC3::RegisterObject\n"
+        << "\nLatency columns are microseconds from when a call was due until"
+        << "\nthe server dispatched it. cpu us is process CPU per call,"
+        << "\ndisp us the time spent inside the server per call. lost counts"
+        << "\ncalls whose handler did not run, conn ms the time to connect"
+        << "\nevery virtual client." << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+
+    std::cout << "Load generator for the RPC314 plugin." << std::endl;
+
+    LoadOptions options;
+    ParseCounts("1000,5000,10000", options.clientCounts);
+    ParseCounts("1000", options.objectCounts);
+    ParseCounts("1", options.slotCounts);
+    options.rates[CALL_KIND_C] = 5;
+    options.rates[CALL_KIND_CPP] = 20;
+    options.rates[CALL_KIND_SIGNAL] = 1;
+    options.duration = 5;
+    options.payloadBytes = 32;
+    options.seed = 1;
+    options.objectHandles = false;
+
+    int opt;
+    while (1) {
+        static struct option long_options[] = {
+            {"clients",    required_argument, 0, 'c'},
+            {"objects",    required_argument, 0, 'o'},
+            {"slots",    required_argument, 0, 's'},
+            {"callc-rate",    required_argument, 0, 'C'},
+            {"callcpp-rate",    required_argument, 0, 'P'},
+            {"signal-rate",    required_argument, 0, 'S'},
+            {"duration",    required_argument, 0, 'd'},
+            {"payload-bytes",    required_argument, 0, 'b'},
+            {"seed",    required_argument, 0, 'r'},
+            {"object-handles",    no_argument, 0, 'H'},
+            {"help",    no_argument, 0, 'h'},
+            {0, 0, 0, 0}
+        };
+
+        // getopt_long stores the option index here.
+        int option_index = 0;
+
+        opt = getopt_long(argc, argv, "c:o:s:d:h", long_options, &option_index);
+
+        // Detect the end of the options.
+        if (opt == -1) {
+            break;
+        }
+
+        bool valid = true;
+        switch (opt) {
+            case 'c':
+                valid = ParseCounts(optarg, options.clientCounts);
+                break;
+            case 'o':
+                valid = ParseCounts(optarg, options.objectCounts);
+                break;
+            case 's':
+                valid = ParseCounts(optarg, options.slotCounts);
+                break;
+            case 'C':
+                options.rates[CALL_KIND_C] = atof(optarg);
+                break;
+            case 'P':
+                options.rates[CALL_KIND_CPP] = atof(optarg);
+                break;
+            case 'S':
+                options.rates[CALL_KIND_SIGNAL] = atof(optarg);
+                break;
+            case 'd':
+                options.duration = atof(optarg);
+                valid = options.duration > 0;
+                break;
+            case 'b':
+                options.payloadBytes = atoi(optarg);
+                break;
+            case 'r':
+                options.seed = atoi(optarg);
+                break;
+            case 'H':
+                options.objectHandles = true;
+                break;
+            case 'h':
+                PrintUsage();
+                return 0;
+            default:
+                PrintUsage();
+                return 1;
+        }
+        if (!valid) {
+            std::cout << "Invalid value for option " << argv[optind - 1]
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    PrintHeader();
+    for (size_t c = 0; c < options.clientCounts.size(); c++) {
+        for (size_t o = 0; o < options.objectCounts.size(); o++) {
+            for (size_t s = 0; s < options.slotCounts.size(); s++) {
+                RunResult result;
+                if (!RunLoad(options, options.clientCounts[c],
+                             options.objectCounts[o], options.slotCounts[s],
+                             result)) {
+                    return 1;
+                }
+                PrintResult(options, options.clientCounts[c],
+                            options.objectCounts[o], options.slotCounts[s],
+                            result);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -23,6 +23,12 @@
 #include <thread>
 #include <mutex>
 #include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <set>
+#include <map>
+#include <limits>
 
 #include "Kbhit.h"
 #include "BitStream.h"
@@ -33,10 +39,79 @@
 #include "NetworkIDManager.h"
 #include "GetTime.h"
 #include "Gets.h"
+#include "RakNetStatistics.h"
+#include "RakMemoryOverride.h"
 
 #include "democlasses.h"
 #include "democfunctions.h"
 
+/*
+ * The original RPC3 in RakNet/DependentExtensions includes RPC3_Boost.h
+ * instead, and lacks the additions of this port.
+ */
+#ifdef __RPC3_STD_H
+#define RPC3_TESTS_BUILD "c++14"
+#else
+#define RPC3_TESTS_BUILD "boost"
+#endif
+
+/*
+ * Counts every allocation of the process, through operator new and through
+ * the RakNet allocation hooks, for the allocations per call in --report.
+ */
+static std::atomic<uint64_t> allocationCount(0);
+
+void *operator new(std::size_t size) {
+    allocationCount++;
+    void *p = malloc(size ? size : 1);
+    if (p == 0) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::size_t size) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, std::size_t size) noexcept {
+    free(p);
+}
+
+void *CountingMalloc(size_t size, const char *file, unsigned int line) {
+    allocationCount++;
+    return malloc(size);
+}
+
+void *CountingRealloc(void *p, size_t size, const char *file,
+        unsigned int line) {
+    allocationCount++;
+    return realloc(p, size);
+}
+
+uint64_t GetBytesSent(RakNet::RakPeerInterface *rakPeer) {
+    uint64_t bytes = 0;
+    RakNet::RakNetStatistics statistics;
+    for (unsigned int i = 0; i < rakPeer->GetMaximumNumberOfPeers(); i++) {
+        if (rakPeer->GetStatistics(i, &statistics)) {
+            bytes += statistics.runningTotal[RakNet::ACTUAL_BYTES_SENT];
+        }
+    }
+    return bytes;
+}
+
 /*
  * All time values are in microseconds.
  */
@@ -93,9 +168,51 @@ struct TestValues {
         cFuncValues.insert(values.begin(), values.end());
     }
     
+    void AppendLatencies(const std::map<int, uint64_t> &values) {
+        for (auto &value : values) {
+            latencies.push_back(value.second);
+        }
+    }
+    
+    uint64_t GetLatencyPercentile(double fraction) {
+        if (latencies.empty()) {
+            return 0;
+        }
+        size_t rank = (size_t) (fraction * latencies.size());
+        return latencies[std::min(rank, latencies.size() - 1)];
+    }
+    
+    /*
+     * Writes one "metric value" line per metric, for tests/compare.
+     */
+    bool WriteReport(const char *path) {
+        std::sort(latencies.begin(), latencies.end());
+        double seconds = (callEndTime - callStartTime) / 1000000.0;
+        double calls = messageCount ? (double) messageCount : 1.0;
+        
+        std::ofstream report(path);
+        report << "calls_per_second " << messageCount / seconds << "\n"
+               << "bytes_per_call " << bytesSent / calls << "\n"
+               << "allocations_per_call " << allocations / calls << "\n"
+               << "latency_p50_us " << GetLatencyPercentile(0.5) << "\n"
+               << "latency_p90_us " << GetLatencyPercentile(0.9) << "\n"
+               << "latency_p99_us " << GetLatencyPercentile(0.99) << "\n"
+               << "latency_max_us "
+               << (latencies.empty() ? 0 : latencies.back()) << std::endl;
+        return report.good();
+    }
+    
     uint64_t callFunctionsTime;
     uint64_t programRunTime;
     
+    // For --report, over the calls from the first call until all arrived.
+    uint64_t callStartTime;
+    uint64_t callEndTime;
+    uint64_t messageCount;
+    uint64_t bytesSent;
+    uint64_t allocations;
+    std::vector<uint64_t> latencies;
+    
     std::map<int, uint64_t> cClassSlotValues;
     std::map<int, uint64_t> cClassValues;
     std::map<int, uint64_t> cFuncValues;
@@ -103,10 +220,125 @@ struct TestValues {
     bool allReady;
 };
 
+#ifdef __RPC3_STD_H
+/*
+ * --wire-checks sends one more call per round, with edge values of the
+ * compact encodings, a string, and a payload that exercises the LZ
+ * compression. The
+ * values depend on the call number, so the receiver can tell what it should
+ * have got. A wrong header, option bit or encoding fails the run.
+ */
+typedef RakNet::_RPC3::RangedInt<-100, 100> WireRanged;
+typedef RakNet::_RPC3::QuantizedFloat<-1000, 1000, 100> WireQuantized;
+
+static const int64_t wireSignedValues[] = {
+    0, -1, 1, 63, -64, 64, -65, 8191, -8192,
+    std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min()
+};
+static const uint64_t wireUnsignedValues[] = {
+    0, 127, 128, 16383, 16384, std::numeric_limits<uint32_t>::max(),
+    std::numeric_limits<uint64_t>::max()
+};
+// Values out of the range arrive clamped.
+static const int64_t wireRangedValues[] = {-100, 100, 0, -101, 101, 1000};
+static const float wireQuantizedValues[] = {
+    -1000.0f, 1000.0f, 0.0f, 12.34f, -0.01f, -5000.0f, 5000.0f
+};
+
+template <typename T, size_t N>
+static T WireValue(const T (&values)[N], uint64_t callNumber) {
+    return values[callNumber % N];
+}
+
+// Follows the bit packed values, so it starts off a byte boundary.
+static RakNet::RakString MakeWireText(uint64_t callNumber) {
+    if (callNumber % 4 == 0) {
+        return RakNet::RakString();
+    }
+    return RakNet::RakString("Wire text %llu", (unsigned long long) callNumber);
+}
+
+/*
+ * Each kind of payload hits another edge of the LZ block layout: an empty
+ * payload, long runs that need length extension bytes, literal runs of 15
+ * and 270 bytes, data that does not compress, and repeats further back than
+ * the 64 KB match window.
+ */
+static void MakeWirePayload(uint64_t callNumber, std::vector<unsigned char> &payload) {
+    uint32_t seed = (uint32_t) callNumber * 2654435761u + 1;
+    auto random = [&seed] () {
+        seed = seed * 1664525u + 1013904223u;
+        return (unsigned char) (seed >> 24);
+    };
+    payload.clear();
+    switch (callNumber % 5) {
+        case 0:
+            break;
+        case 1:
+            payload.assign(4000, (unsigned char) callNumber);
+            break;
+        case 2:
+            for (size_t literals : {15, 270}) {
+                for (size_t i = 0; i < literals; i++) {
+                    payload.push_back(random());
+                }
+                payload.insert(payload.end(), 300, 'x');
+            }
+            break;
+        case 3:
+            for (size_t i = 0; i < 300; i++) {
+                payload.push_back(random());
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < 66000; i++) {
+                payload.push_back(random());
+            }
+            payload.insert(payload.end(), payload.begin(), payload.begin() + 1000);
+            break;
+    }
+}
+
+// Call numbers each client got WireTest with, and how many arrived wrong.
+static std::map<RakNet::RPC3 *, std::set<uint64_t>> wireTestCalls;
+static unsigned int wireTestFailures = 0;
+
+void WireTest(RakNet::_RPC3::VarInt<int64_t> signedValue,
+        RakNet::_RPC3::VarInt<uint64_t> unsignedValue,
+        WireRanged rangedValue, RakNet::RakString text,
+        WireQuantized quantizedValue, RakNet::BitStream &payload,
+        uint64_t callNumber,
+        RakNet::RPC3 *rpcFromNetwork) {
+    
+    int64_t ranged = WireValue(wireRangedValues, callNumber);
+    ranged = std::max<int64_t>(-100, std::min<int64_t>(100, ranged));
+    float quantized = WireQuantized::Dequantize(
+        WireQuantized::Quantize(WireValue(wireQuantizedValues, callNumber)));
+    std::vector<unsigned char> expected;
+    MakeWirePayload(callNumber, expected);
+    
+    if ((int64_t) signedValue != WireValue(wireSignedValues, callNumber) ||
+            (uint64_t) unsignedValue != WireValue(wireUnsignedValues, callNumber) ||
+            (int64_t) rangedValue != ranged ||
+            text != MakeWireText(callNumber) ||
+            (float) quantizedValue != quantized ||
+            payload.GetNumberOfBytesUsed() != expected.size() ||
+            (expected.size() && memcmp(payload.GetData(), &expected[0],
+                                       expected.size()) != 0)) {
+        std::cout << "WireTest got wrong values for call " << callNumber
+                  << std::endl;
+        wireTestFailures++;
+    }
+    if (!wireTestCalls[rpcFromNetwork].insert(callNumber).second) {
+        std::cout << "WireTest already added: " << callNumber << std::endl;
+    }
+}
+#endif
+
 void serverThread(std::recursive_mutex *mutex_, TestValues *testValues,
         BaseClassA *serverAPtr, ClassC *serverCPtr, ClassD *serverDPtr,
         RakNet::RPC3 *serverRpc, unsigned int peerCount,
-        unsigned int callCount) {
+        unsigned int callCount, unsigned int roundSleep, bool wireChecks) {
     
     RakNet::RPC3 *emptyRpc = 0;
     unsigned int count = callCount;
@@ -142,9 +374,26 @@ void serverThread(std::recursive_mutex *mutex_, TestValues *testValues,
             callTime = RakNet::GetTimeUS();
             serverRpc->Signal("TestSlotTest", callNumber, callTime);
             
+#ifdef __RPC3_STD_H
+            if (wireChecks) {
+                std::vector<unsigned char> payload;
+                MakeWirePayload(callNumber, payload);
+                RakNet::BitStream payloadBitStream;
+                if (payload.size()) {
+                    payloadBitStream.WriteAlignedBytes(&payload[0], payload.size());
+                }
+                serverRpc->CallC("WireTest",
+                    RakNet::_RPC3::Varint(WireValue(wireSignedValues, callNumber)),
+                    RakNet::_RPC3::Varint(WireValue(wireUnsignedValues, callNumber)),
+                    WireRanged(WireValue(wireRangedValues, callNumber)),
+                    MakeWireText(callNumber),
+                    WireQuantized(WireValue(wireQuantizedValues, callNumber)),
+                    payloadBitStream, callNumber, emptyRpc);
+            }
+#endif
         }
         count--;
-        RakSleep(16);
+        RakSleep(roundSleep);
     }
     
     mutex_->lock();
@@ -154,6 +403,50 @@ void serverThread(std::recursive_mutex *mutex_, TestValues *testValues,
     delete emptyRpc;
 }
 
+#ifdef __RPC3_STD_H
+/*
+ * Feeds a log written with --capture back through one RPC3 instance set up
+ * like a test client, as fast as possible, and prints the dispatch rate.
+ */
+int replayCapture(const char *capturePath) {
+    RakNet::RPC3 rpc;
+    RakNet::NetworkIDManager networkIdManager;
+    ClassC c;
+    ClassD d;
+    
+    rpc.SetNetworkIDManager(&networkIdManager);
+    c.SetNetworkIDManager(&networkIdManager);
+    d.SetNetworkIDManager(&networkIdManager);
+    c.SetNetworkID(0);
+    d.SetNetworkID(1);
+    
+    RPC3_REGISTER_FUNCTION(&rpc, CFuncTest);
+    RPC3_REGISTER_FUNCTION(&rpc, &ClassC::ClassMemberFuncTest);
+    rpc.RegisterSlot("TestSlotTest", &ClassC::TestSlotTest, c.GetNetworkID(), 0);
+    rpc.RegisterSlot("TestSlotTest", &ClassD::TestSlotTest, d.GetNetworkID(), 0);
+    rpc.FreezeRegistry();
+    
+    unsigned int messageCount = 0;
+    uint64_t startTime = RakNet::GetTimeUS();
+    bool ok = rpc.ReplayCapture(capturePath, false, &messageCount);
+    uint64_t useconds = RakNet::GetTimeUS() - startTime;
+    
+    if (!ok && messageCount == 0) {
+        std::cout << "Could not replay " << capturePath << std::endl;
+        return 1;
+    }
+    
+    std::cout << "Replayed " << messageCount << " messages in "
+              << useconds << " microseconds";
+    if (useconds) {
+        std::cout << ", " << (uint64_t) messageCount * 1000000 / useconds
+                  << " messages per second";
+    }
+    std::cout << std::endl;
+    return ok ? 0 : 1;
+}
+#endif
+
 int main(int argc, char *argv[]) {
     
     std::cout << "Performance test for the RPC314 plugin." << std::endl;
@@ -166,6 +459,12 @@ int main(int argc, char *argv[]) {
     bool useBoost = false;
     unsigned int clientCount = 1;
     unsigned int callCount = 1;
+    const char *capturePath = 0;
+    const char *replayPath = 0;
+    const char *reportPath = 0;
+    unsigned int roundSleep = 16;
+    unsigned int legacyClients = 0;
+    bool wireChecks = false;
     
     int opt;
     while (1) {
@@ -174,6 +473,12 @@ int main(int argc, char *argv[]) {
             {"test",    required_argument, 0, 't'},
             {"client-count",    required_argument, 0, 'c'},
             {"call-count",    required_argument, 0, 'r'},
+            {"capture",    required_argument, 0, 'w'},
+            {"replay",    required_argument, 0, 'p'},
+            {"report",    required_argument, 0, 'o'},
+            {"round-sleep",    required_argument, 0, 's'},
+            {"legacy-clients",    required_argument, 0, 'l'},
+            {"wire-checks",    no_argument, 0, 'k'},
             {0, 0, 0, 0}
         };
         
@@ -199,6 +504,24 @@ int main(int argc, char *argv[]) {
             case 'r':
                 callCount = atoi(optarg);
                 break;
+            case 'w':
+                capturePath = optarg;
+                break;
+            case 'p':
+                replayPath = optarg;
+                break;
+            case 'o':
+                reportPath = optarg;
+                break;
+            case 's':
+                roundSleep = atoi(optarg);
+                break;
+            case 'l':
+                legacyClients = atoi(optarg);
+                break;
+            case 'k':
+                wireChecks = true;
+                break;
             case 't': {
                 if (optarg == "all") {
                     testAll = true;
@@ -224,6 +547,27 @@ int main(int argc, char *argv[]) {
         }
     }
 
+#ifdef __RPC3_STD_H
+    if (replayPath) {
+        return replayCapture(replayPath);
+    }
+#else
+    if (capturePath || replayPath) {
+        std::cout << "--capture and --replay need the C++14 build."
+                  << std::endl;
+        return 1;
+    }
+    if (legacyClients || wireChecks) {
+        std::cout << "--legacy-clients and --wire-checks need the C++14 build."
+                  << std::endl;
+        return 1;
+    }
+#endif
+
+    std::cout << "Build: " << RPC3_TESTS_BUILD << std::endl;
+    SetMalloc_Ex(CountingMalloc);
+    SetRealloc_Ex(CountingRealloc);
+
     TestValues testValues;
     testValues.allReady = false;
     
@@ -273,6 +617,15 @@ int main(int argc, char *argv[]) {
             socketDescriptorClient.socketFamily = AF_INET;
             
             rakPeers[i]->Startup(1, &socketDescriptorClient, 1);
+            
+#ifdef __RPC3_STD_H
+            // The last clients talk to the server in the legacy layout.
+            if (i + legacyClients >= peerCount) {
+                rpcPlugins[i]->SetCompactHeaderEnabled(false);
+                std::cout << "Client #" << i << " uses the legacy header."
+                          << std::endl;
+            }
+#endif
 
             // Send out a LAN broadcast to find the server on the same computer.
             rakPeers[i]->Ping("255.255.255.255", 60000, true, 0);
@@ -299,6 +652,22 @@ int main(int argc, char *argv[]) {
                 "TestSlotTest", &ClassC::TestSlotTest, c[i].GetNetworkID(), 0);
         rpcPlugins[i]->RegisterSlot(
                 "TestSlotTest", &ClassD::TestSlotTest, d[i].GetNetworkID(), 0);
+        
+#ifdef __RPC3_STD_H
+        if (wireChecks) {
+            RPC3_REGISTER_FUNCTION(rpcPlugins[i], WireTest);
+            // Compressed for the clients on the compact header.
+            rpcPlugins[i]->SetCompressionForIdentifier("WireTest", true);
+        }
+        
+        // Registration is done, switch to the perfect-hash lookup.
+        rpcPlugins[i]->FreezeRegistry();
+        
+        // The first client records what it receives, for --replay.
+        if (i == 1 && capturePath) {
+            rpcPlugins[i]->StartCapture(capturePath);
+        }
+#endif
     }
     
     std::cout << "Clients will automatically connect to running server." << std::endl;
@@ -349,10 +718,13 @@ int main(int argc, char *argv[]) {
                                   
                         if (!clientCount) {
                             // If all clients are connected.
+                            testValues.callStartTime = RakNet::GetTimeUS();
+                            testValues.bytesSent = GetBytesSent(rakPeers[0]);
+                            testValues.allocations = allocationCount;
                             serverT = std::thread(
                                 serverThread, mutex_.get(), &testValues,
                                 &a[0], &c[0], &d[0], rpcPlugins[0],
-                                peerCount, callCount
+                                peerCount, callCount, roundSleep, wireChecks
                             );
                             
                             serverT.detach();
@@ -429,7 +801,23 @@ int main(int argc, char *argv[]) {
                       << allCount << std::endl;*/
                 allready = false;
             }
+#ifdef __RPC3_STD_H
+            if (wireChecks && i > 0 &&
+                    wireTestCalls[rpcPlugins[i]].size() < allCount) {
+                allready = false;
+            }
+#endif
         }
+        
+#ifdef __RPC3_STD_H
+        // A call that never arrives would otherwise keep the test waiting.
+        if (wireChecks && !allready &&
+                RakNet::GetTimeUS() - programStartTime > 60000000) {
+            std::cout << "WireTest timed out, not every call arrived."
+                      << std::endl;
+            return 1;
+        }
+#endif
 
         RakSleep(0);
         
@@ -442,24 +830,51 @@ int main(int argc, char *argv[]) {
         allready = true;
     }
 
+    testValues.callEndTime = RakNet::GetTimeUS();
+    testValues.allocations = allocationCount - testValues.allocations;
+    testValues.bytesSent = GetBytesSent(rakPeers[0]) - testValues.bytesSent;
+    // Every round broadcasts a member call, a C call and a signal per client,
+    // and WireTest with --wire-checks.
+    testValues.messageCount = (wireChecks ? 4 : 3) *
+        (uint64_t) (peerCount - 1) * (peerCount - 1) * callCount;
+    
     testValues.programRunTime = RakNet::GetTimeUS() - programStartTime;
     testValues.AppendCFuncValues(cFuncTestCalls);
+    testValues.AppendLatencies(cFuncTestCalls);
     
     for (size_t i = 1; i < peerCount; i++) {
         testValues.AppendCClassValues(c[i].testCalls);
         
         testValues.AppendCClassSlotValues(c[i].testSlots);
         testValues.AppendCClassSlotValues(d[i].testSlots);
+        
+        testValues.AppendLatencies(c[i].testCalls);
+        testValues.AppendLatencies(c[i].testSlots);
+        testValues.AppendLatencies(d[i].testSlots);
     }
     
     testValues.PrintTestSummary();
+    
+    if (reportPath && !testValues.WriteReport(reportPath)) {
+        std::cout << "Could not write " << reportPath << std::endl;
+    }
 
+    // Shutdown notifies the plugins, so they are deleted afterwards.
     for (std::size_t i = 0; i < peerCount; i++) {
-        delete rpcPlugins[i];
         rakPeers[i]->Shutdown(0, 0);
+    }
+    for (std::size_t i = 0; i < peerCount; i++) {
+        rakPeers[i]->DetachPlugin(rpcPlugins[i]);
+        delete rpcPlugins[i];
         RakNet::RakPeerInterface::DestroyInstance(rakPeers[i]);
     }
     rpcPlugins.clear();
     
+#ifdef __RPC3_STD_H
+    if (wireChecks) {
+        std::cout << "WireTest failures: " << wireTestFailures << std::endl;
+        return wireTestFailures ? 1 : 0;
+    }
+#endif
     return 1;
 }